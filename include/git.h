@@ -38,5 +38,7 @@ extern bool  git_revision_is_branch(const char* path, const char* revision, bool
 extern bool  git_uncommitted_changes(const char* path, bool* changed);
 extern char* git_current_branch(const char* path);
 extern char* git_current_commit(const char* path);
+extern char* git_ref_commit(const char* path, const char* ref);
+extern char* git_show(const char* path, const char* revision, const char* file);
 
 #endif
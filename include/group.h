@@ -19,7 +19,9 @@
 #ifndef __group_h__
 #define __group_h__
 
+#include "hash.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct
 {
@@ -47,4 +49,29 @@ extern bool group_list_parse(
 	const char* groups, bool filter,
 	group_t** list, unsigned* list_count);
 
+
+
+/* Group names are interned into dense IDs so that a list of groups can be
+ * held as a set of bits, GROUP_SET_WORDS gives the size of such a set. */
+
+typedef struct
+{
+	group_t*     name;
+	unsigned     count;
+	unsigned     capacity;
+	hash_table_t index;
+} group_table_t;
+
+#define GROUP_SET_WORDS(count) (((count) + 63) / 64)
+
+extern void group_table_init(group_table_t* table);
+extern void group_table_clear(group_table_t* table);
+extern bool group_table_copy(
+	const group_table_t* table, group_table_t* copy);
+
+extern bool group_table_intern(
+	group_table_t* table, const char* name, unsigned size, unsigned* id);
+extern bool group_table_find(
+	const group_table_t* table, const char* name, unsigned size, unsigned* id);
+
 #endif
@@ -0,0 +1,68 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __hash_h__
+#define __hash_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit XXH64 hash, data may be hashed in parts by passing each
+ * part's hash as the seed of the next. */
+extern uint64_t hash_data(const void* data, size_t size, uint64_t seed);
+
+/* Open addressed tables of entry indices keyed by string, keys are read
+ * through a callback so entries stay in the caller's own arrays. Entries
+ * with equal keys are found in index order. */
+
+typedef const char* (*hash_key_func_t)(
+	const void* context, uint32_t index, size_t* size);
+
+typedef struct
+{
+	uint32_t* slot;
+	uint32_t  mask;
+	bool      owned;
+} hash_table_t;
+
+extern bool hash_table_build(
+	hash_table_t* table, uint32_t count,
+	hash_key_func_t key_func, const void* context);
+extern void hash_table_delete(hash_table_t* table);
+
+/* Adds entry index to a table holding every entry before it, the table
+ * is rebuilt larger when it gets too full. */
+extern bool hash_table_insert(
+	hash_table_t* table, uint32_t index,
+	hash_key_func_t key_func, const void* context);
+
+/* Uses slots which were built earlier and stored, capacity must be the
+ * power of two that they were built with. The slots aren't freed. */
+extern bool hash_table_wrap(
+	hash_table_t* table, const uint32_t* slot,
+	uint32_t capacity, uint32_t count);
+
+/* Finds the first entry with a matching key, or if next is set the first
+ * one after the entry already in index. */
+extern bool hash_table_find(
+	const hash_table_t* table, const char* key, size_t size,
+	hash_key_func_t key_func, const void* context,
+	bool next, uint32_t* index);
+
+#endif
@@ -21,7 +21,9 @@
 
 #include "xml.h"
 #include "group.h"
+#include "hash.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct
 {
@@ -35,6 +37,8 @@ typedef struct
 	const char* dest;
 } copyfile_t;
 
+/* Projects are decoded from a manifest's columns on request, so a
+ * project_t is a copy which stays valid as long as the manifest does. */
 typedef struct
 {
 	const char* path;
@@ -42,35 +46,162 @@ typedef struct
 	const char* remote;
 	const char* remote_name;
 	const char* revision;
-	copyfile_t* copyfile;
+	int         priority;
 	unsigned    copyfile_count;
-	group_t*    group;
 	unsigned    group_count;
 } project_t;
 
-typedef struct
+typedef struct manifest_s manifest_t;
+
+struct manifest_s
 {
-	remote_t*  remote;
-	unsigned   remote_count;
-	project_t* project;
-	unsigned   project_count;
-	xml_tag_t* document;
-	long int   threads;
-} manifest_t;
+	remote_t* remote;
+	unsigned  remote_count;
+	unsigned  project_count;
+	long int  threads;
+
+	/* Projects are stored as columns of offsets into one string table,
+	 * copyfile and group lists as ranges of shared arrays; the range of
+	 * project i ends where that of project i + 1 starts. Strings which
+	 * repeat are stored once. Everything is in one block, so that a cache
+	 * image of it can be used in place. */
+	void*       table;
+	void*       mapping;
+	size_t      mapping_size;
+	const char* string;
+	uint32_t    string_size;
+	uint32_t*   remote_string;    /* Name and fetch of each remote. */
+	uint32_t*   project_path;
+	uint32_t*   project_name;
+	uint32_t*   project_revision;
+	uint32_t*   project_remote;   /* Index of the remote. */
+	uint32_t*   project_priority; /* Signed, projects default to 0. */
+	uint32_t*   project_copyfile;
+	uint32_t*   project_group;
+	uint32_t*   copyfile;         /* Source and dest of each copyfile. */
+	uint32_t    copyfile_count;
+	uint32_t*   group;
+	uint32_t    group_count;
+	uint32_t*   include;          /* Path of each included manifest. */
+	uint32_t*   include_hash;     /* Content hash of each, in two words. */
+	uint32_t    include_count;
+
+	/* A view selects projects from a base manifest which it holds a
+	 * reference to, it has no table and its projects are only reached
+	 * through the accessors. Position maps each base project to its place
+	 * in the view, or to UINT32_MAX if the view leaves it out. */
+	manifest_t* base;
+	uint32_t*   index;
+	uint32_t*   position;
+	unsigned    refs;
+
+	hash_table_t path_index;
+	hash_table_t name_index;
+	hash_table_t remote_index;
+
+	/* Project paths as a trie of components, in one block with the table
+	 * of its edges, built on the first path lookup. Each node is six words:
+	 * parent, name offset and size, project, first child and next sibling. */
+	uint32_t* trie;
+	uint32_t  trie_count;
+	uint32_t* trie_slot;
+	uint32_t  trie_mask;
+
+	/* Every group named by a project, and each project's groups as a set
+	 * of GROUP_SET_WORDS(groups.count) words. */
+	group_table_t groups;
+	uint64_t*     group_set;
+};
 
 
 
 extern void        manifest_delete(manifest_t* manifest);
-extern manifest_t* manifest_parse(xml_tag_t* document);
+extern manifest_t* manifest_parse(char* source, size_t size);
+extern manifest_t* manifest_parse_string(char* source);
 extern manifest_t* manifest_read(const char* path);
 
+/* Includes are read from include_dir, or the directory holding the
+ * manifest when it's NULL, and parsed included manifests are cached in
+ * cache_dir unless it's NULL. */
+extern manifest_t* manifest_read_include(
+	const char* path, const char* include_dir, const char* cache_dir);
+
+extern project_t manifest_project(
+	const manifest_t* manifest, unsigned i);
+extern const char* manifest_project_path(
+	const manifest_t* manifest, unsigned i);
+extern const char* manifest_project_name(
+	const manifest_t* manifest, unsigned i);
+extern const char* manifest_project_revision(
+	const manifest_t* manifest, unsigned i);
+extern int manifest_project_priority(
+	const manifest_t* manifest, unsigned i);
+extern copyfile_t manifest_project_copyfile(
+	const manifest_t* manifest, unsigned i, unsigned j);
+extern group_t manifest_project_group(
+	const manifest_t* manifest, unsigned i, unsigned j);
+
+/* Finds return the project's position in the manifest. With next set,
+ * the search continues after the project at *index. */
+extern bool manifest_find_path(
+	const manifest_t* manifest, const char* path, unsigned* index);
+extern bool manifest_find_name(
+	const manifest_t* manifest, const char* name,
+	bool next, unsigned* index);
+extern remote_t* manifest_find_remote(
+	const manifest_t* manifest, const char* name);
+
+/* Paths are relative to the workspace root. Finds the project holding
+ * path, the deepest if projects are nested. */
+extern bool manifest_find_containing(
+	const manifest_t* manifest, const char* path, unsigned* index);
+/* Sets mask for every project at or below path, returning how many
+ * there are. */
+extern unsigned manifest_mark_path(
+	const manifest_t* manifest, const char* path, bool* mask);
+/* Fills parent with the position of the nearest project holding each
+ * project, or UINT_MAX if no other project holds it. */
+extern bool manifest_find_parents(
+	const manifest_t* manifest, unsigned* parent);
+
+/* Differences of a project from the project at the same path in
+ * another manifest, as a set of flags. */
+typedef enum
+{
+	manifest_change_none     = 0,
+	manifest_change_added    = 1 << 0,
+	manifest_change_revision = 1 << 1,
+	manifest_change_remote   = 1 << 2,
+	manifest_change_copyfile = 1 << 3,
+} manifest_change_e;
+
 extern manifest_t* manifest_copy(manifest_t* a);
 extern manifest_t* manifest_subtract(manifest_t* a, manifest_t* b);
+extern manifest_t* manifest_select(manifest_t* manifest, const bool* mask);
+
+/* Fills change with the changes of every project in b from a, projects
+ * of a which aren't in b are found by manifest_subtract(a, b). */
+extern bool manifest_diff(
+	const manifest_t* a, const manifest_t* b, unsigned* change);
 
-extern bool manifest_write_snapshot(manifest_t* manifest, const char* path);
+/* Writes the manifest as XML with every project's remote and revision
+ * given in full, atomically replacing the file at path. */
+extern bool manifest_write(const manifest_t* manifest, const char* path);
+extern bool manifest_write_snapshot(
+	manifest_t* manifest, const char* path, long int threads);
 
 extern manifest_t* manifest_group_filter(
 	manifest_t* manifest,
 	group_t* filter, unsigned filter_count);
 
+extern manifest_t* manifest_changed_since(
+	manifest_t* manifest, manifest_t* snapshot);
+
+extern uint64_t manifest_fingerprint(
+	const char* path, group_t* filter, unsigned filter_count);
+extern manifest_t* manifest_cache_read(
+	const char* path, uint64_t fingerprint);
+extern bool manifest_cache_write(
+	manifest_t* manifest, const char* path, uint64_t fingerprint);
+
 #endif
@@ -0,0 +1,40 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __parallel_h__
+#define __parallel_h__
+
+#include <stdbool.h>
+
+typedef bool (*parallel_func_t)(void* context, unsigned index);
+
+extern bool parallel_for(
+	unsigned count, long int threads,
+	parallel_func_t func, void* context);
+
+/* Runs each task once the task it depends on has succeeded, or at once
+ * if depend[index] isn't a task. Tasks depending on one which fails are
+ * never run, and count as failures. Of the tasks ready to run, those with
+ * the highest priority start first, then those earliest in order. Either
+ * of depend and priority may be NULL. */
+extern bool parallel_for_depend(
+	unsigned count, long int threads,
+	const unsigned* depend, const int* priority,
+	parallel_func_t func, void* context);
+
+#endif
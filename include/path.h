@@ -21,4 +21,8 @@
 
 extern char* path_join(const char* base, const char* path);
 
+/* Returns an absolute path relative to root, with "." and ".." removed
+ * without following links, or NULL if it isn't inside root. */
+extern char* path_relative(const char* root, const char* path);
+
 #endif
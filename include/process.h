@@ -0,0 +1,47 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __process_h__
+#define __process_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+	int    status;
+	char*  output;
+	size_t output_size;
+} process_result_t;
+
+extern char** process_environ(
+	const char* const* name, const char* const* value, unsigned count);
+
+extern bool process_run(
+	const char* path, const char* command,
+	const char* const* argv, unsigned argc,
+	char* const* env,
+	const char* input, size_t input_size,
+	bool capture, process_result_t* result);
+
+/* Every child process is counted, including those started through
+ * system() or popen() elsewhere, so that commands can report it. */
+extern void     process_spawned(void);
+extern unsigned process_spawn_count(void);
+
+#endif
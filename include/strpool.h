@@ -0,0 +1,37 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __strpool_h__
+#define __strpool_h__
+
+#include <stddef.h>
+
+/* Strings are copied into large blocks owned by the pool, they stay
+ * valid and NUL terminated until the pool is deleted. */
+typedef struct strpool_s strpool_t;
+
+extern strpool_t*  strpool_create(void);
+extern void        strpool_delete(strpool_t* pool);
+extern const char* strpool_add(
+	strpool_t* pool, const char* string, unsigned size);
+
+/* Moves every string from other into pool and deletes other, strings
+ * keep their addresses. */
+extern void strpool_merge(strpool_t* pool, strpool_t* other);
+
+#endif
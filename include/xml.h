@@ -19,29 +19,82 @@
 #ifndef __xml_h__
 #define __xml_h__
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef struct xml_tag_s   xml_tag_t;
 typedef struct xml_field_s xml_field_t;
+typedef struct xml_arena_s xml_arena_t;
+
+/* Names and values are views into the document source, which is
+ * NUL terminated and entity decoded in place while parsing. */
 
 struct xml_field_s
 {
-	char* name;
-	char* data;
+	const char* name;
+	unsigned    name_size;
+	const char* data;
+	unsigned    data_size;
 };
 
 struct xml_tag_s
 {
-	char*         name;
-	xml_tag_t*    parent;
-	xml_field_t** field;
-	unsigned      field_count;
-	xml_tag_t**   tag;
-	unsigned      tag_count;
+	const char*  name;
+	unsigned     name_size;
+	xml_tag_t*   parent;
+	xml_tag_t*   next;
+	xml_field_t* field;
+	unsigned     field_count;
+	xml_tag_t**  tag;
+	unsigned     tag_count;
 };
 
+/* Event callbacks for xml_parse and xml_read, either may be NULL and
+ * returning false stops the parse. Fields are only valid during the
+ * tag_open call, and the name is only NUL terminated by tag_close. */
+typedef struct
+{
+	bool (*tag_open)(void* context,
+		const char* name, unsigned name_size,
+		xml_field_t* field, unsigned field_count);
+	bool (*tag_close)(void* context,
+		const char* name, unsigned name_size);
+} xml_handler_t;
+
+/* All tags and field arrays belong to the document's arena
+ * and are released together by xml_document_delete. */
+typedef struct
+{
+	xml_tag_t*   root;
+	xml_arena_t* arena;
+	char*        source;
+	size_t       size;
+	size_t       mapped;
+} xml_document_t;
+
+
+
+extern bool xml_parse(
+	char* source, size_t size,
+	const xml_handler_t* handler, void* context);
+extern bool xml_read(
+	const char* path,
+	const xml_handler_t* handler, void* context);
+
+/* Parses a run of sibling tags, as found between a parent's opening and
+ * closing tags, which must make up the whole of the source. */
+extern bool xml_parse_fragment(
+	char* source, size_t size,
+	const xml_handler_t* handler, void* context);
+
+/* Maps a file privately and writably with a NUL terminator after its last
+ * byte, ready to be parsed in place. Released with munmap(source, mapped). */
+extern char* xml_source_map(const char* path, size_t* size, size_t* mapped);
 
+extern xml_document_t* xml_document_parse(char* source, size_t size);
+extern xml_document_t* xml_document_read(const char* path);
+extern void            xml_document_delete(xml_document_t* document);
 
-extern xml_tag_t*  xml_document_parse(const char* source);
 extern const char* xml_tag_field(xml_tag_t* tag, const char* name);
-extern void        xml_tag_delete(xml_tag_t* tag);
 
 #endif
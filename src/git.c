@@ -17,10 +17,12 @@
  */
 
 #include "git.h"
+#include "process.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <limits.h>
 #include <sys/types.h>
@@ -34,6 +36,7 @@ static int system_silent(const char* command)
 {
 	char command_silent[strlen(command) + 13];
 	sprintf(command_silent, "%s > /dev/null", command);
+	process_spawned();
 	return system(command_silent);
 }
 
@@ -42,16 +45,16 @@ static bool git__command(const char* path, const char* command)
 	if (!path || !command)
 		return false;
 
-	char pdir[PATH_MAX];
-	if (getcwd(pdir, PATH_MAX) != pdir)
-		return false;
-	if (chdir(path) != 0)
-		return false;
+	char cmd[strlen(path) + strlen(command) + 32];
+	sprintf(cmd, "cd %s 2> /dev/null && %s", path, command);
+	return (system_silent(cmd) == EXIT_SUCCESS);
+}
 
-	bool ret = (system_silent(command) == EXIT_SUCCESS);
-	if (chdir(pdir) != 0)
-		abort();
-	return ret;
+static bool git__directory_exists(const char* path)
+{
+	struct stat path_stat;
+	return ((stat(path, &path_stat) == 0)
+		&& S_ISDIR(path_stat.st_mode));
 }
 
 bool git_reset_hard(const char* path, const char* commit)
@@ -92,9 +95,9 @@ bool git_remove(const char* path)
 bool git_exists(const char* path)
 {
 	if (!path) return false;
-	char cmd[strlen(path) + 64];
-	sprintf(cmd, "[ -d %s/.git ]", path);
-	return (system_silent(cmd) == EXIT_SUCCESS);
+	char git_path[strlen(path) + 8];
+	sprintf(git_path, "%s/.git", path);
+	return git__directory_exists(git_path);
 }
 
 bool git_checkout(const char* path, const char* revision, bool create)
@@ -298,28 +301,27 @@ bool git_uncommitted_changes(const char* path, bool* changed)
 	if (!path || !changed)
 		return false;
 
-	char pdir[PATH_MAX];
-	if (getcwd(pdir, PATH_MAX) != pdir)
-		return false;
-	if (chdir(path) != 0)
+	/* Commands run in a subshell so this is safe to call from worker threads. */
+	if (!git__directory_exists(path))
 		return false;
 
-	bool unstaged
-		= (system_silent("git diff --quiet --exit-code") != EXIT_SUCCESS);
-	bool uncommitted
-		= (system_silent("git diff --cached --quiet --exit-code") != EXIT_SUCCESS);
+	bool unstaged = !git__command(path,
+		"git diff --quiet --exit-code");
+	bool uncommitted = !git__command(path,
+		"git diff --cached --quiet --exit-code");
 
 	*changed = (unstaged || uncommitted);
-
-	if (chdir(pdir) != 0)
-		abort();
 	return true;
 }
 
 
 
-static char* git__pipe_read(const char* cmd)
+static char* git__pipe_read(const char* path, const char* command)
 {
+	char cmd[strlen(path) + strlen(command) + 32];
+	sprintf(cmd, "cd %s 2> /dev/null && %s", path, command);
+
+	process_spawned();
 	FILE* fp = popen(cmd, "r");
 	if (!fp) return NULL;
 
@@ -335,14 +337,19 @@ static char* git__pipe_read(const char* cmd)
 		if (!nresult)
 		{
 			free(result);
+			pclose(fp);
 			return NULL;
 		}
 		result = nresult;
 		read += fread(&result[read], 1, (size - read), fp);
 	} while (read >= size);
 
-	if (read == 0)
+	if ((pclose(fp) != EXIT_SUCCESS)
+		|| (read == 0))
+	{
+		free(result);
 		return NULL;
+	}
 
 	if (result[read - 1] == '\n')
 		read--;
@@ -353,7 +360,6 @@ static char* git__pipe_read(const char* cmd)
 			result, (read + 1));
 	if (nresult) result = nresult;
 
-	pclose(fp);
 	return result;
 }
 
@@ -361,38 +367,217 @@ char* git_current_branch(const char* path)
 {
 	if (!path) return NULL;
 
-	char pdir[PATH_MAX];
-	if (getcwd(pdir, PATH_MAX) != pdir)
-		return NULL;
-	if (chdir(path) != 0)
-		return NULL;
-
 	char* branch
-		= git__pipe_read("git rev-parse --symbolic-full-name --abbrev-ref HEAD");
+		= git__pipe_read(path, "git rev-parse --symbolic-full-name --abbrev-ref HEAD");
 	if (branch && (strcmp(branch, "HEAD") == 0))
 	{
 		free(branch);
-		branch = git__pipe_read("git rev-parse HEAD");
+		branch = git__pipe_read(path, "git rev-parse HEAD");
 	}
 
-	if (chdir(pdir) != 0)
-		abort();
 	return branch;
 }
 
+static bool git__is_hash(const char* str)
+{
+	unsigned i;
+	for (i = 0; i < 40; i++)
+	{
+		if (!isxdigit(str[i]))
+			return false;
+	}
+	return ((str[i] == '\0') || isspace(str[i]));
+}
+
+static bool git__file_read_line(const char* path, char* line, size_t size)
+{
+	FILE* fp = fopen(path, "r");
+	if (!fp) return false;
+
+	bool success = (fgets(line, size, fp) != NULL);
+	fclose(fp);
+	if (!success)
+		return false;
+
+	size_t len = strlen(line);
+	while ((len > 0) && isspace(line[len - 1]))
+		line[--len] = '\0';
+	return true;
+}
+
+/* Finds the git directory of a working tree and, for linked worktrees,
+ * the common directory which holds the shared refs. */
+static bool git__dir(const char* path, char* dir, char* common)
+{
+	char dotgit[PATH_MAX];
+	if (snprintf(dotgit, PATH_MAX, "%s/.git", path) >= PATH_MAX)
+		return false;
+
+	struct stat dotgit_stat;
+	if (stat(dotgit, &dotgit_stat) != 0)
+		return false;
+
+	if (S_ISDIR(dotgit_stat.st_mode))
+	{
+		strcpy(dir, dotgit);
+	}
+	else
+	{
+		char line[PATH_MAX];
+		if (!git__file_read_line(dotgit, line, PATH_MAX)
+			|| (strncmp(line, "gitdir: ", 8) != 0))
+			return false;
+
+		int len = (line[8] == '/'
+			? snprintf(dir, PATH_MAX, "%s", &line[8])
+			: snprintf(dir, PATH_MAX, "%s/%s", path, &line[8]));
+		if (len >= PATH_MAX)
+			return false;
+	}
+
+	char commondir[PATH_MAX];
+	char line[PATH_MAX];
+	if ((snprintf(commondir, PATH_MAX, "%s/commondir", dir) < PATH_MAX)
+		&& git__file_read_line(commondir, line, PATH_MAX))
+	{
+		int len = (line[0] == '/'
+			? snprintf(common, PATH_MAX, "%s", line)
+			: snprintf(common, PATH_MAX, "%s/%s", dir, line));
+		if (len >= PATH_MAX)
+			return false;
+	}
+	else
+	{
+		strcpy(common, dir);
+	}
+
+	return true;
+}
+
+static bool git__packed_ref(const char* common, const char* ref, char* hash)
+{
+	char packed[PATH_MAX];
+	if (snprintf(packed, PATH_MAX, "%s/packed-refs", common) >= PATH_MAX)
+		return false;
+
+	FILE* fp = fopen(packed, "r");
+	if (!fp) return false;
+
+	size_t ref_len = strlen(ref);
+	bool found = false;
+
+	char line[PATH_MAX + 64];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (found)
+		{
+			/* Prefer the peeled commit of an annotated tag. */
+			if ((line[0] == '^') && git__is_hash(&line[1]))
+				memcpy(hash, &line[1], 40);
+			break;
+		}
+
+		if ((line[0] == '#') || !git__is_hash(line)
+			|| (line[40] != ' ')
+			|| (strncmp(&line[41], ref, ref_len) != 0)
+			|| !isspace(line[41 + ref_len]))
+			continue;
+
+		memcpy(hash, line, 40);
+		hash[40] = '\0';
+		found = true;
+	}
+
+	fclose(fp);
+	return found;
+}
+
+static bool git__ref_lookup(
+	const char* dir, const char* common,
+	const char* ref, char* hash, unsigned depth)
+{
+	if (depth > 5)
+		return false;
+
+	/* HEAD and other pseudo-refs are per-worktree, refs/ are shared. */
+	const char* base = (strncmp(ref, "refs/", 5) == 0 ? common : dir);
+
+	char ref_path[PATH_MAX];
+	if (snprintf(ref_path, PATH_MAX, "%s/%s", base, ref) >= PATH_MAX)
+		return false;
+
+	char line[PATH_MAX];
+	if (git__file_read_line(ref_path, line, PATH_MAX))
+	{
+		if (strncmp(line, "ref: ", 5) == 0)
+			return git__ref_lookup(dir, common, &line[5], hash, (depth + 1));
+
+		if (!git__is_hash(line))
+			return false;
+		memcpy(hash, line, 40);
+		hash[40] = '\0';
+		return true;
+	}
+
+	return git__packed_ref(common, ref, hash);
+}
+
+char* git_ref_commit(const char* path, const char* ref)
+{
+	if (!path || !ref)
+		return NULL;
+
+	if (git__is_hash(ref))
+		return strdup(ref);
+
+	char dir[PATH_MAX], common[PATH_MAX];
+	if (!git__dir(path, dir, common))
+		return NULL;
+
+	const char* rule[] =
+	{
+		"%s",
+		"refs/%s",
+		"refs/tags/%s",
+		"refs/heads/%s",
+		"refs/remotes/%s",
+		"refs/remotes/%s/HEAD",
+	};
+
+	char hash[41];
+	unsigned r;
+	for (r = 0; r < (sizeof(rule) / sizeof(rule[0])); r++)
+	{
+		char full_ref[PATH_MAX];
+		if ((snprintf(full_ref, PATH_MAX, rule[r], ref) < PATH_MAX)
+			&& git__ref_lookup(dir, common, full_ref, hash, 0))
+			return strdup(hash);
+	}
+
+	return NULL;
+}
+
 char* git_current_commit(const char* path)
 {
 	if (!path) return NULL;
 
-	char pdir[PATH_MAX];
-	if (getcwd(pdir, PATH_MAX) != pdir)
-		return NULL;
-	if (chdir(path) != 0)
+	/* Resolve HEAD by reading the refs directly where possible,
+	 * only falling back to git for layouts we don't understand. */
+	char dir[PATH_MAX], common[PATH_MAX];
+	char hash[41];
+	if (git__dir(path, dir, common)
+		&& git__ref_lookup(dir, common, "HEAD", hash, 0))
+		return strdup(hash);
+
+	return git__pipe_read(path, "git rev-parse HEAD");
+}
+
+char* git_show(const char* path, const char* revision, const char* file)
+{
+	if (!path || !revision || !file)
 		return NULL;
 
-	char* commit
-		= git__pipe_read("git rev-parse HEAD");
-	if (chdir(pdir) != 0)
-		abort();
-	return commit;
+	char cmd[strlen(revision) + strlen(file) + 64];
+	sprintf(cmd, "git show %s:%s 2> /dev/null", revision, file);
+	return git__pipe_read(path, cmd);
 }
@@ -55,18 +55,28 @@ bool group_list_add(
 		|| !list || !list_count)
 		return false;
 
-	group_list_remove(name, size, list, list_count);
-
-	group_t* nlist = (group_t*)realloc(*list,
-		(sizeof(group_t) * (*list_count + 1)));
-	if (!nlist) return false;
-	(*list) = nlist;
+	/* A group which is already listed moves to the end, so the list only
+	 * has to grow for new names. */
+	unsigned i;
+	if (group_list_match(
+		name, size, *list, *list_count, &i))
+	{
+		for (; i < (*list_count - 1); i++)
+			(*list)[i] = (*list)[i + 1];
+	}
+	else
+	{
+		group_t* nlist = (group_t*)realloc(*list,
+			(sizeof(group_t) * (*list_count + 1)));
+		if (!nlist) return false;
+		(*list) = nlist;
+		(*list_count)++;
+	}
 
-	unsigned c = (*list_count);
+	unsigned c = (*list_count - 1);
 	(*list)[c].name    = name;
 	(*list)[c].size    = size;
 	(*list)[c].exclude = exclude;
-	(*list_count)++;
 
 	return true;
 }
@@ -128,23 +138,89 @@ bool group_list_copy(
 	return true;
 }
 
+static const char* group__key(
+	const void* context, uint32_t index, size_t* size)
+{
+	const group_t* group = &((const group_t*)context)[index];
+	*size = group->size;
+	return group->name;
+}
+
+/* Removes every entry which is named again later in the list, keeping the
+ * order of what remains. Short lists are checked pairwise since building
+ * an index would cost more than it saves. */
+static bool group__list_unique(group_t* list, unsigned* list_count)
+{
+	unsigned count = *list_count;
+	bool keep[count + 1];
+
+	unsigned i, j;
+	if (count <= 16)
+	{
+		for (i = 0; i < count; i++)
+		{
+			keep[i] = true;
+			for (j = i + 1; keep[i] && (j < count); j++)
+			{
+				keep[i] = (list[i].size != list[j].size)
+					|| (strncmp(list[i].name, list[j].name, list[i].size) != 0);
+			}
+		}
+	}
+	else
+	{
+		hash_table_t index;
+		if (!hash_table_build(&index, count, group__key, list))
+			return false;
+
+		for (i = 0; i < count; i++)
+		{
+			uint32_t later = i;
+			keep[i] = !hash_table_find(&index,
+				list[i].name, list[i].size,
+				group__key, list, true, &later);
+		}
+
+		hash_table_delete(&index);
+	}
+
+	for (i = 0, j = 0; i < count; i++)
+	{
+		if (keep[i])
+			list[j++] = list[i];
+	}
+	*list_count = j;
+	return true;
+}
+
 bool group_list_parse(
 	const char* groups, bool filter,
 	group_t** list, unsigned* list_count)
 {
-	if (!groups)
+	if (!groups || !list || !list_count)
 		return false;
 
-	group_t* nlist = NULL;
-	unsigned nlist_count = 0;
+	unsigned list_prev = *list_count;
 
-	if (list && list_count
-		&& !group_list_copy(
-			*list, *list_count,
-			&nlist, &nlist_count))
-		return false;
+	/* There can be no more groups than commas plus one, so the list is
+	 * allocated once rather than grown for every group. */
+	unsigned capacity = list_prev + 1;
+	unsigned i;
+	for (i = 0; groups[i] != '\0'; i++)
+	{
+		if (groups[i] == ',')
+			capacity++;
+	}
 
-	unsigned i = 0;
+	group_t* nlist = (group_t*)malloc(
+		sizeof(group_t) * capacity);
+	if (!nlist) return false;
+
+	unsigned nlist_count = list_prev;
+	if (list_prev > 0)
+		memcpy(nlist, *list, (sizeof(group_t) * list_prev));
+
+	i = 0;
 	while (groups[i] != '\0')
 	{
 		if (groups[i] == ',')
@@ -172,25 +248,122 @@ bool group_list_parse(
 			? ((uintptr_t)next - (uintptr_t)&groups[i])
 			: strlen(&groups[i]));
 
-		if (!group_list_add(
-			&groups[i], size, exclusion,
-			&nlist, &nlist_count))
+		if (size == 0)
 		{
 			free(nlist);
 			return false;
 		}
 
+		nlist[nlist_count].name    = &groups[i];
+		nlist[nlist_count].size    = size;
+		nlist[nlist_count].exclude = exclusion;
+		nlist_count++;
+
 		i += size + (next ? 1 : 0);
 	}
 
-	if (nlist && (!list || !list_count))
+	if (!group__list_unique(nlist, &nlist_count))
 	{
 		free(nlist);
 		return false;
 	}
 
+	if (nlist_count == 0)
+	{
+		free(nlist);
+		nlist = NULL;
+	}
+
 	free(*list);
 	*list = nlist;
 	*list_count = nlist_count;
 	return true;
 }
+
+
+
+void group_table_init(group_table_t* table)
+{
+	memset(table, 0x00, sizeof(group_table_t));
+}
+
+void group_table_clear(group_table_t* table)
+{
+	if (!table)
+		return;
+	free(table->name);
+	hash_table_delete(&table->index);
+	group_table_init(table);
+}
+
+bool group_table_copy(
+	const group_table_t* table, group_table_t* copy)
+{
+	group_table_init(copy);
+	if (table->count == 0)
+		return true;
+
+	copy->name = (group_t*)malloc(
+		sizeof(group_t) * table->count);
+	if (!copy->name) return false;
+	memcpy(copy->name, table->name,
+		(sizeof(group_t) * table->count));
+	copy->count    = table->count;
+	copy->capacity = table->count;
+
+	if (!hash_table_build(&copy->index,
+		copy->count, group__key, copy->name))
+	{
+		group_table_clear(copy);
+		return false;
+	}
+
+	return true;
+}
+
+bool group_table_find(
+	const group_table_t* table, const char* name, unsigned size, unsigned* id)
+{
+	uint32_t index;
+	if (!table || !name || (size == 0)
+		|| !hash_table_find(&table->index, name, size,
+			group__key, table->name, false, &index))
+		return false;
+
+	if (id) *id = index;
+	return true;
+}
+
+bool group_table_intern(
+	group_table_t* table, const char* name, unsigned size, unsigned* id)
+{
+	if (group_table_find(table, name, size, id))
+		return true;
+
+	if (!table || !name || (size == 0))
+		return false;
+
+	if (table->count >= table->capacity)
+	{
+		unsigned capacity = (table->capacity
+			? (table->capacity << 1) : 16);
+		group_t* nname = (group_t*)realloc(
+			table->name, (sizeof(group_t) * capacity));
+		if (!nname) return false;
+		table->name     = nname;
+		table->capacity = capacity;
+	}
+
+	group_t* group = &table->name[table->count];
+	group->name    = name;
+	group->size    = size;
+	group->exclude = false;
+
+	if (!hash_table_insert(&table->index,
+		table->count, group__key, table->name))
+		return false;
+
+	if (id) *id = table->count;
+	table->count++;
+	return true;
+}
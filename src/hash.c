@@ -0,0 +1,266 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+
+#define HASH__PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH__PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH__PRIME_3 0x165667B19E3779F9ULL
+#define HASH__PRIME_4 0x85EBCA77C2B2AE63ULL
+#define HASH__PRIME_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t hash__rotl(uint64_t x, unsigned r)
+{
+	return ((x << r) | (x >> (64 - r)));
+}
+
+/* Reads are done with memcpy since the data may be unaligned,
+ * the hash is defined on little endian words. */
+static inline uint64_t hash__read64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t hash__read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t hash__round(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH__PRIME_2;
+	acc  = hash__rotl(acc, 31);
+	return acc * HASH__PRIME_1;
+}
+
+static inline uint64_t hash__merge(uint64_t acc, uint64_t v)
+{
+	acc ^= hash__round(0, v);
+	return (acc * HASH__PRIME_1) + HASH__PRIME_4;
+}
+
+
+
+uint64_t hash_data(const void* data, size_t size, uint64_t seed)
+{
+	const uint8_t* p   = (const uint8_t*)data;
+	const uint8_t* end = &p[size];
+
+	uint64_t h;
+	if (size >= 32)
+	{
+		uint64_t v1 = seed + HASH__PRIME_1 + HASH__PRIME_2;
+		uint64_t v2 = seed + HASH__PRIME_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - HASH__PRIME_1;
+
+		const uint8_t* limit = &end[-32];
+		do
+		{
+			v1 = hash__round(v1, hash__read64(&p[ 0]));
+			v2 = hash__round(v2, hash__read64(&p[ 8]));
+			v3 = hash__round(v3, hash__read64(&p[16]));
+			v4 = hash__round(v4, hash__read64(&p[24]));
+			p += 32;
+		} while (p <= limit);
+
+		h = hash__rotl(v1, 1) + hash__rotl(v2, 7)
+			+ hash__rotl(v3, 12) + hash__rotl(v4, 18);
+		h = hash__merge(h, v1);
+		h = hash__merge(h, v2);
+		h = hash__merge(h, v3);
+		h = hash__merge(h, v4);
+	}
+	else
+	{
+		h = seed + HASH__PRIME_5;
+	}
+
+	h += (uint64_t)size;
+
+	for (; (end - p) >= 8; p += 8)
+	{
+		h ^= hash__round(0, hash__read64(p));
+		h  = (hash__rotl(h, 27) * HASH__PRIME_1) + HASH__PRIME_4;
+	}
+
+	if ((end - p) >= 4)
+	{
+		h ^= (uint64_t)hash__read32(p) * HASH__PRIME_1;
+		h  = (hash__rotl(h, 23) * HASH__PRIME_2) + HASH__PRIME_3;
+		p += 4;
+	}
+
+	for (; p < end; p++)
+	{
+		h ^= (*p) * HASH__PRIME_5;
+		h  = hash__rotl(h, 11) * HASH__PRIME_1;
+	}
+
+	h ^= h >> 33;
+	h *= HASH__PRIME_2;
+	h ^= h >> 29;
+	h *= HASH__PRIME_3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+
+static void hash__table_place(
+	hash_table_t* table, uint32_t index,
+	hash_key_func_t key_func, const void* context)
+{
+	size_t size;
+	const char* key = key_func(context, index, &size);
+
+	/* Slots hold the entry index plus one so that zero marks empty. */
+	uint32_t s = (uint32_t)hash_data(key, size, 0) & table->mask;
+	while (table->slot[s])
+		s = (s + 1) & table->mask;
+	table->slot[s] = index + 1;
+}
+
+bool hash_table_build(
+	hash_table_t* table, uint32_t count,
+	hash_key_func_t key_func, const void* context)
+{
+	/* Tables are kept at most half full so probe runs stay short. */
+	uint32_t capacity = 8;
+	while (capacity < (count * 2))
+		capacity <<= 1;
+
+	table->slot = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+	if (!table->slot)
+	{
+		table->mask  = 0;
+		table->owned = false;
+		return false;
+	}
+	table->mask  = capacity - 1;
+	table->owned = true;
+
+	uint32_t i;
+	for (i = 0; i < count; i++)
+		hash__table_place(table, i, key_func, context);
+
+	return true;
+}
+
+void hash_table_delete(hash_table_t* table)
+{
+	if (!table)
+		return;
+	if (table->owned)
+		free(table->slot);
+	table->slot  = NULL;
+	table->mask  = 0;
+	table->owned = false;
+}
+
+bool hash_table_insert(
+	hash_table_t* table, uint32_t index,
+	hash_key_func_t key_func, const void* context)
+{
+	if (!table)
+		return false;
+
+	if (!table->slot || !table->owned
+		|| (((index + 1) * 2) > (table->mask + 1)))
+	{
+		hash_table_t grown;
+		if (!hash_table_build(&grown, (index + 1), key_func, context))
+			return false;
+		hash_table_delete(table);
+		*table = grown;
+		return true;
+	}
+
+	hash__table_place(table, index, key_func, context);
+	return true;
+}
+
+bool hash_table_wrap(
+	hash_table_t* table, const uint32_t* slot,
+	uint32_t capacity, uint32_t count)
+{
+	if ((capacity == 0)
+		|| ((capacity & (capacity - 1)) != 0))
+		return false;
+
+	/* Every slot must name an entry and at least one must be empty, or
+	 * a search for a missing key would never end. */
+	bool empty = false;
+	uint32_t i;
+	for (i = 0; i < capacity; i++)
+	{
+		if (slot[i] > count)
+			return false;
+		empty |= (slot[i] == 0);
+	}
+	if (!empty)
+		return false;
+
+	table->slot  = (uint32_t*)slot;
+	table->mask  = capacity - 1;
+	table->owned = false;
+	return true;
+}
+
+bool hash_table_find(
+	const hash_table_t* table, const char* key, size_t size,
+	hash_key_func_t key_func, const void* context,
+	bool next, uint32_t* index)
+{
+	if (!table || !table->slot || !key)
+		return false;
+
+	uint32_t s = (uint32_t)hash_data(key, size, 0) & table->mask;
+	for (; table->slot[s]; s = (s + 1) & table->mask)
+	{
+		uint32_t i = table->slot[s] - 1;
+		if (next && (i <= *index))
+			continue;
+
+		size_t entry_size;
+		const char* entry = key_func(context, i, &entry_size);
+		if ((entry_size == size)
+			&& (memcmp(entry, key, size) == 0))
+		{
+			*index = i;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -27,14 +27,18 @@
 #include <errno.h>
 #include <libgen.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <time.h>
 
 #include "git.h"
 #include "xml.h"
 #include "path.h"
+#include "parallel.h"
+#include "process.h"
 #include "manifest.h"
 #include "settings.h"
 
+extern char** environ;
+
 
 typedef enum
 {
@@ -43,6 +47,7 @@ typedef enum
 	frepo_command_snapshot,
 	frepo_command_list,
 	frepo_command_forall,
+	frepo_command_which,
 	frepo_command_count
 } frepo_command_e;
 
@@ -50,277 +55,709 @@ typedef enum
 
 void print_usage(const char* prog)
 {
-	printf("%s init name -u manifest [-b branch] [-g groups] [--mirror] [-j threads]\n", prog);
-	printf("%s sync [-f] [-b branch] [-g groups] [-j threads]\n", prog);
-	printf("%s snapshot name [-g groups]\n", prog);
-	printf("%s list [-g groups]\n", prog);
-	printf("%s forall  [-g groups] [-p] -c command\n", prog);
+	printf("%s init name -u manifest [-b branch] [-g groups] [--mirror] [-j threads]"
+		" [--priority-groups groups] [--priority-done file]\n", prog);
+	printf("%s sync [-f] [-n] [-b branch] [-g groups] [-j threads]"
+		" [--incremental] [--shard i/N] [--priority-groups groups]"
+		" [--priority-done file] [project-or-path...]\n", prog);
+	printf("%s snapshot name [-g groups] [-j threads]\n", prog);
+	printf("%s list [-g groups] [--changed-since snapshot]\n", prog);
+	printf("%s forall  [-g groups] [-p] [-j threads] [--interleaved]"
+		" [--batch[=size] [--stdin]] [--changed-since snapshot]"
+		" [path...] -c command\n", prog);
+	printf("%s which path...\n", prog);
+	printf("Paths select the projects at or below them"
+		", or the project holding them.\n");
+	printf("Sync also takes project names, and with -n doesn't update"
+		" the manifest repository.\n");
+	printf("Projects with a higher priority, or in a priority group, are"
+		" synced first, and the done file is created once they all are.\n");
+	printf("Any command also takes --timing to report its run time"
+		" and child processes.\n");
 }
 
 
-struct manifest_thread_params
+struct frepo_sync_context
 {
 	const char* manifest_url;
 	manifest_t* manifest;
 	bool        mirror;
-	sem_t*      semaphore;
+	bool        check;
 	unsigned    retries;
 	unsigned    retry_delay;
-
-	pthread_t   thread;
-	unsigned    project;
 	bool*       error;
-	bool        complete;
+	unsigned*   duration;
+	const int*  priority;
+	unsigned    priority_left;
+	unsigned    priority_failed;
+	const char* priority_done;
 };
 
-static void* frepo_sync_manifest__thread(void* param)
+static bool frepo_sync_manifest__update(
+	struct frepo_sync_context* sc, unsigned p)
 {
-	volatile struct manifest_thread_params* tp
-		= (volatile struct manifest_thread_params*)param;
+	const project_t project = manifest_project(sc->manifest, p);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	sc->error[p] = false;
 
-	unsigned p = tp->project;
+	bool exists = git_exists(project.path);
 
-	bool exists = git_exists(tp->manifest->project[p].path);
+	if (exists && sc->check)
+	{
+		bool uncommitted_changes;
+		if (!git_uncommitted_changes(
+			project.path, &uncommitted_changes))
+		{
+			fprintf(stderr, "Error: Failed to check for uncommitted changes"
+				" in '%s', won't update.\n",
+				project.name);
+			sc->error[p] = true;
+			return false;
+		}
+		else if (uncommitted_changes)
+		{
+			fprintf(stderr, "Error: '%s' has uncommitted changes"
+				", won't update.\n", project.name);
+			sc->error[p] = true;
+			return false;
+		}
+	}
 
 	printf("%s repository (%u/%u) '%s'.\n",
 		(exists ? "Updating" : "Cloning"),
-		(p + 1), tp->manifest->project_count,
-		tp->manifest->project[p].path);
+		(p + 1), sc->manifest->project_count,
+		project.path);
 
 	char* revision = NULL;
 	bool revision_differs = false;
 
-	if (exists && !tp->mirror)
+	if (exists && !sc->mirror)
 	{
 		revision = git_current_branch(
-			tp->manifest->project[p].path);
+			project.path);
 		if (!revision)
 		{
 			fprintf(stderr, "Error: Failed to check current revision of '%s'.\n",
-				tp->manifest->project[p].path);
-			*(tp->error) = true;
-			sem_post(tp->semaphore);
-			return NULL;
+				project.path);
+			sc->error[p] = true;
+			return false;
 		}
 
 		revision_differs
-			= (strcmp(revision, tp->manifest->project[p].revision) != 0);
+			= (strcmp(revision, project.revision) != 0);
 		if (revision_differs && !git_checkout(
-			tp->manifest->project[p].path,
-			tp->manifest->project[p].revision, false))
+			project.path,
+			project.revision, false))
 		{
 			free(revision);
 			fprintf(stderr, "Error: Failed to checkout revision '%s' of '%s'.\n",
-				tp->manifest->project[p].revision,
-				tp->manifest->project[p].path);
-			*(tp->error) = true;
-			sem_post(tp->semaphore);
-			return NULL;
+				project.revision,
+				project.path);
+			sc->error[p] = true;
+			return false;
 		}
 	}
 
 	char* remote_full
-		= path_join(tp->manifest_url,
-			tp->manifest->project[p].remote);
+		= path_join(sc->manifest_url,
+			project.remote);
 	if (!remote_full)
 	{
 		fprintf(stderr,
 			"Error: Failed to create relative repo url"
 				", since manifest url is unknown.");
-		*(tp->error) = true;
-		sem_post(tp->semaphore);
-		return NULL;
+		free(revision);
+		sc->error[p] = true;
+		return false;
 	}
 
 	bool update_success = git_update(
-		tp->manifest->project[p].path,
+		project.path,
 		remote_full,
-		tp->manifest->project[p].name,
-		tp->manifest->project[p].remote_name,
-		tp->manifest->project[p].revision, tp->mirror);
+		project.name,
+		project.remote_name,
+		project.revision, sc->mirror);
 
 	unsigned r, d;
-	for (r = 0, d = tp->retry_delay;
-		!update_success && (r < tp->retries);
+	for (r = 0, d = sc->retry_delay;
+		!update_success && (r < sc->retries);
 		r++, d *= 2)
 	{
 		fprintf(stderr, "Warning: Failed to %s '%s'"
 			", waiting %u ms and retrying.\n",
 			(exists ? "update" : "clone"),
-			tp->manifest->project[p].path, d);
+			project.path, d);
 
-		usleep(tp->retry_delay * 1000);
+		usleep(sc->retry_delay * 1000);
 
 		update_success = git_update(
-			tp->manifest->project[p].path,
+			project.path,
 			remote_full,
-			tp->manifest->project[p].name,
-			tp->manifest->project[p].remote_name,
-			tp->manifest->project[p].revision, tp->mirror);
+			project.name,
+			project.remote_name,
+			project.revision, sc->mirror);
 	}
 
 	if (!update_success)
 	{
 		fprintf(stderr, "Error: Failed to %s '%s'",
 			(exists ? "update" : "clone"),
-			tp->manifest->project[p].path);
-		if (tp->retries != 0)
-			fprintf(stderr, " after %u retries", tp->retries);
+			project.path);
+		if (sc->retries != 0)
+			fprintf(stderr, " after %u retries", sc->retries);
 		fprintf(stderr, ".\n");
-		*(tp->error) = true;
+		sc->error[p] = true;
 	}
 	free(remote_full);
 
 	unsigned j;
-	for (j = 0; j < tp->manifest->project[p].copyfile_count; j++)
+	for (j = 0; j < project.copyfile_count; j++)
 	{
-		char cmd[strlen(tp->manifest->project[p].path)
-			+ strlen(tp->manifest->project[p].copyfile[j].source)
-			+ strlen(tp->manifest->project[p].copyfile[j].dest) + 16];
+		copyfile_t copyfile = manifest_project_copyfile(sc->manifest, p, j);
+		char cmd[strlen(project.path)
+			+ strlen(copyfile.source)
+			+ strlen(copyfile.dest) + 16];
 		sprintf(cmd, "cp %s/%s %s",
-			tp->manifest->project[p].path,
-			tp->manifest->project[p].copyfile[j].source,
-			tp->manifest->project[p].copyfile[j].dest);
+			project.path,
+			copyfile.source,
+			copyfile.dest);
+		process_spawned();
 		if (system(cmd) != EXIT_SUCCESS)
 		{
 			unsigned k;
 			for (k = 0; k < j; k++)
-				git_remove(tp->manifest->project[k].path);
+				git_remove(manifest_project_path(sc->manifest, k));
 			fprintf(stderr,
 				"Error: Failed to perform copy '%s' to '%s'"
 				" for project '%s'\n",
-				tp->manifest->project[p].copyfile[j].source,
-				tp->manifest->project[p].copyfile[j].dest,
-				tp->manifest->project[p].path);
-			*(tp->error) = true;
+				copyfile.source,
+				copyfile.dest,
+				project.path);
+			sc->error[p] = true;
 		}
 	}
 
 	if (revision_differs && !git_checkout(
-		tp->manifest->project[p].path,
+		project.path,
 		revision, false))
 	{
 		fprintf(stderr, "Error: Failed to revert '%s' to revision '%s'.\n",
-			tp->manifest->project[p].path, revision);
-		*(tp->error) = true;
+			project.path, revision);
+		sc->error[p] = true;
 	}
 
 	free(revision);
 
-	tp->complete = true;
-	sem_post(tp->semaphore);
-	return NULL;
+	if (sc->duration)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sc->duration[p] = ((now.tv_sec - start.tv_sec) * 1000)
+			+ ((now.tv_nsec - start.tv_nsec) / 1000000);
+	}
+
+	return !sc->error[p];
+}
+
+static void frepo__priority_done(const char* path)
+{
+	if (!path)
+		return;
+
+	FILE* fp = fopen(path, "w");
+	if (fp)
+		fclose(fp);
+	else
+		fprintf(stderr, "Warning: Failed to create '%s'.\n", path);
+}
+
+/* Once the last priority project has synced, that's announced and the
+ * done file is created, unless any of them failed. Projects which never
+ * run since one they depend on failed keep the count from reaching zero. */
+static bool frepo_sync_manifest__project(void* context, unsigned p)
+{
+	struct frepo_sync_context* sc
+		= (struct frepo_sync_context*)context;
+
+	bool success = frepo_sync_manifest__update(sc, p);
+	if (sc->priority[p] <= 0)
+		return success;
+
+	if (!success)
+		__sync_fetch_and_or(&sc->priority_failed, 1);
+	if ((__sync_sub_and_fetch(&sc->priority_left, 1) == 0)
+		&& (__sync_fetch_and_or(&sc->priority_failed, 0) == 0))
+	{
+		printf("Priority projects synced.\n");
+		fflush(stdout);
+		frepo__priority_done(sc->priority_done);
+	}
+
+	return success;
+}
+
+/* The sync history holds the time in milliseconds that each project last
+ * took to sync, as one "time path" line each, so that shards can be
+ * balanced. Projects which weren't synced keep their last entry. */
+static const char* frepo__history_path = ".frepo/sync.history";
+
+static bool frepo__history_write(
+	manifest_t* manifest, const unsigned* duration, const bool* error)
+{
+	const char* tmp_path = ".frepo/sync.history.tmp";
+	FILE* fp = fopen(tmp_path, "w");
+	if (!fp)
+		return false;
+
+	unsigned p;
+	for (p = 0; p < manifest->project_count; p++)
+	{
+		if (!error[p])
+			fprintf(fp, "%u %s\n", duration[p],
+				manifest_project_path(manifest, p));
+	}
+
+	FILE* old = fopen(frepo__history_path, "r");
+	if (old)
+	{
+		char*   line = NULL;
+		size_t  size = 0;
+		ssize_t length;
+		while ((length = getline(&line, &size, old)) > 0)
+		{
+			if (line[length - 1] == '\n')
+				line[--length] = '\0';
+
+			char* path = strchr(line, ' ');
+			if (!path)
+				continue;
+
+			unsigned index;
+			if (manifest_find_path(manifest, &path[1], &index)
+				&& !error[index])
+				continue;
+
+			fprintf(fp, "%s\n", line);
+		}
+		free(line);
+		fclose(old);
+	}
+
+	bool success = (fclose(fp) == 0)
+		&& (rename(tmp_path, frepo__history_path) == 0);
+	if (!success)
+		unlink(tmp_path);
+	return success;
+}
+
+/* Fills weight with one more than each project's last sync time, or the
+ * mean of those for projects without one, returning false if there's no
+ * history. */
+static bool frepo__history_read(manifest_t* manifest, uint64_t* weight)
+{
+	FILE* fp = fopen(frepo__history_path, "r");
+	if (!fp)
+		return false;
+
+	unsigned p;
+	for (p = 0; p < manifest->project_count; p++)
+		weight[p] = 0;
+
+	uint64_t total = 0;
+	unsigned known = 0;
+
+	char*   line = NULL;
+	size_t  size = 0;
+	ssize_t length;
+	while ((length = getline(&line, &size, fp)) > 0)
+	{
+		if (line[length - 1] == '\n')
+			line[--length] = '\0';
+
+		char* path;
+		unsigned long duration = strtoul(line, &path, 10);
+		if ((path == line) || (path[0] != ' '))
+			continue;
+
+		unsigned index;
+		if (!manifest_find_path(manifest, &path[1], &index)
+			|| (weight[index] != 0))
+			continue;
+
+		weight[index] = (duration + 1);
+		total += weight[index];
+		known++;
+	}
+	free(line);
+	fclose(fp);
+
+	uint64_t mean = (known > 0 ? (total / known) : 1);
+	for (p = 0; p < manifest->project_count; p++)
+	{
+		if (weight[p] == 0)
+			weight[p] = mean;
+	}
+
+	return true;
+}
+
+static bool frepo__project_in_groups(
+	manifest_t* manifest, unsigned p, group_t* group, unsigned group_count)
+{
+	unsigned count = manifest_project(manifest, p).group_count;
+	unsigned j;
+	for (j = 0; j < count; j++)
+	{
+		group_t g = manifest_project_group(manifest, p, j);
+		if (group_list_match(g.name, g.size, group, group_count, NULL))
+			return true;
+	}
+	return false;
 }
 
 static bool frepo_sync_manifest(
 	manifest_t* manifest, const char* url,
-	bool mirror, long int threads)
+	bool mirror, bool check, bool record,
+	group_t* priority_group, unsigned priority_group_count,
+	const char* priority_done, long int threads)
 {
 	if (!manifest)
 		return false;
 
+	/* A done file left by an earlier run mustn't signal this one. */
+	if (priority_done && (unlink(priority_done) != 0) && (errno != ENOENT))
+	{
+		fprintf(stderr, "Error: Failed to remove '%s'.\n", priority_done);
+		return false;
+	}
+
 	if (manifest->project_count == 0)
+	{
+		frepo__priority_done(priority_done);
 		return true;
+	}
 
-	if (threads <= 0)
-		threads = 1;
-	if ((unsigned)threads > manifest->project_count)
-		threads = manifest->project_count;
+	/* The per project arrays are allocated together, as a stack frame
+	 * sized by the manifest could overflow. */
+	unsigned count = manifest->project_count;
+	void* block = malloc(count * ((sizeof(unsigned) * 2)
+		+ sizeof(int) + sizeof(bool)));
+	if (!block)
+	{
+		fprintf(stderr, "Error: Failed to allocate sync state.\n");
+		return false;
+	}
+	unsigned* parent   = (unsigned*)block;
+	unsigned* duration = &parent[count];
+	int*      priority = (int*)&duration[count];
+	bool*     error    = (bool*)&priority[count];
+
+	/* A project nested in one which isn't cloned yet only starts once that
+	 * has been, as cloning either into the other's directory fails. Once
+	 * the parent exists they're independent. */
+	if (!manifest_find_parents(manifest, parent))
+	{
+		free(block);
+		return false;
+	}
 
-	sem_t semaphore;
-	if (sem_init(&semaphore, 0, 0) < 0)
-		abort();
+	unsigned p;
+	for (p = 0; p < manifest->project_count; p++)
+	{
+		error[p] = true;
+		if ((parent[p] != UINT_MAX)
+			&& git_exists(manifest_project_path(manifest, parent[p])))
+			parent[p] = UINT_MAX;
+
+		priority[p] = manifest_project_priority(manifest, p);
+		if ((priority[p] < 1) && (priority_group_count > 0)
+			&& frepo__project_in_groups(manifest, p,
+				priority_group, priority_group_count))
+			priority[p] = 1;
+	}
 
-	volatile struct manifest_thread_params tp[threads];
-	long int i;
-	for (i = 0; i < threads; i++)
+	/* A project waiting on its parent raises the parent's priority, so
+	 * that it isn't held behind projects which rank below it. */
+	unsigned priority_left = 0;
+	for (p = 0; p < manifest->project_count; p++)
+	{
+		unsigned q;
+		for (q = parent[p]; (q != UINT_MAX) && (priority[q] < priority[p]);
+			q = parent[q])
+			priority[q] = priority[p];
+	}
+	for (p = 0; p < manifest->project_count; p++)
+		priority_left += (priority[p] > 0);
+	if (priority_left == 0)
+		frepo__priority_done(priority_done);
+
+	struct frepo_sync_context sc;
+	sc.manifest_url = url;
+	sc.manifest     = manifest;
+	sc.mirror       = mirror;
+	sc.check        = (check && !mirror);
+	sc.retries      = 8;
+	sc.retry_delay  = 100;
+	sc.error        = error;
+	sc.duration     = (record ? duration : NULL);
+	sc.priority     = priority;
+	sc.priority_left   = priority_left;
+	sc.priority_failed = 0;
+	sc.priority_done   = priority_done;
+
+	bool success = parallel_for_depend(manifest->project_count, threads,
+		parent, priority, frepo_sync_manifest__project, &sc);
+
+	/* The history only balances shards, so failing to write it is fine. */
+	if (record)
+		(void)frepo__history_write(manifest, duration, error);
+
+	if (!success)
 	{
-		tp[i].manifest_url = url;
-		tp[i].manifest     = manifest;
-		tp[i].mirror       = mirror;
-		tp[i].semaphore    = &semaphore;
-		tp[i].retries      = 8;
-		tp[i].retry_delay  = 100;
+		for (p = 0; p < manifest->project_count; p++)
+		{
+			if (error[p])
+				fprintf(stderr, "Error: Failed to sync project '%s'.\n",
+					manifest_project_path(manifest, p));
+		}
 	}
 
-	unsigned p = 0;
-	unsigned error_count = 0;
-	bool error[manifest->project_count];
+	free(block);
+	return success;
+}
 
-	long int t;
-	for (t = 0; t < threads; t++)
-	{
-		error[p] = false;
-		tp[t].project  = p;
-		tp[t].error    = &error[p];
-		tp[t].complete = false;
+static bool frepo_sync__deprecated_check(void* context, unsigned i)
+{
+	manifest_t* manifest_old = (manifest_t*)context;
+	const project_t project = manifest_project(manifest_old, i);
 
-		if (pthread_create(
-			(void*)&tp[t].thread, NULL,
-			frepo_sync_manifest__thread,
-			(void*)&tp[t]) != 0)
-			abort();
-		p++;
-	}
+	/* Syncing its path alone may have removed it already. */
+	if (!git_exists(project.path))
+		return true;
 
-	while (p < manifest->project_count)
+	bool uncommitted_changes;
+	if (!git_uncommitted_changes(
+		project.path, &uncommitted_changes))
 	{
-		sem_wait(&semaphore);
+		fprintf(stderr, "Error: '%s' is deprecated but can't remove"
+			" because checking for uncommitted changes failed.\n",
+			project.name);
+		return false;
+	}
+	else if (uncommitted_changes)
+	{
+		fprintf(stderr, "Error: '%s' is deprecated but can't remove"
+			" because it has uncommitted changes.\n",
+			project.name);
+		return false;
+	}
+
+	return true;
+}
+
+/* Selects the projects at or below each path, or the project holding a
+ * path with none below it, and sets matched for each path which selects
+ * any. When names are given, an argument naming projects selects those
+ * instead, and a path may be NULL if its argument can only be a name. */
+static manifest_t* frepo__path_select(
+	manifest_t* manifest, const char** name,
+	char** path, unsigned path_count, bool* matched)
+{
+	bool mask[manifest->project_count + 1];
+	memset(mask, 0x00, (manifest->project_count * sizeof(bool)));
 
-		do
+	unsigned i;
+	for (i = 0; i < path_count; i++)
+	{
+		unsigned index;
+		if (name && manifest_find_name(manifest, name[i], false, &index))
 		{
-			for (t = 0; t < threads; t++)
+			do
 			{
-				if (*tp[t].error || tp[t].complete)
-				{
-					error_count += (*tp[t].error ? 1 : 0);
-					break;
-				}
-			}
-		} while (t >= threads);
+				mask[index] = true;
+			} while (manifest_find_name(manifest, name[i], true, &index));
+			matched[i] = true;
+		}
+		else if (!path[i])
+		{
+			continue;
+		}
+		else if (manifest_mark_path(manifest, path[i], mask) > 0)
+		{
+			matched[i] = true;
+		}
+		else if (manifest_find_containing(manifest, path[i], &index))
+		{
+			mask[index] = true;
+			matched[i] = true;
+		}
+	}
+
+	return manifest_select(manifest, mask);
+}
+
+typedef struct
+{
+	uint64_t weight;
+	uint64_t hash;
+	unsigned index;
+} frepo__shard_t;
+
+static int frepo__shard_compare(const void* a, const void* b)
+{
+	const frepo__shard_t* sa = (const frepo__shard_t*)a;
+	const frepo__shard_t* sb = (const frepo__shard_t*)b;
+	if (sa->weight != sb->weight)
+		return (sa->weight > sb->weight ? -1 : 1);
+	if (sa->hash != sb->hash)
+		return (sa->hash < sb->hash ? -1 : 1);
+	return (sa->index < sb->index ? -1 : (sa->index > sb->index));
+}
+
+static bool frepo__shard_hashed(
+	const char* path, unsigned shard, unsigned shard_count)
+{
+	return ((hash_data(path, strlen(path), 0) % shard_count) == shard);
+}
+
+/* Finds the outermost project holding each project, or itself if none
+ * does. A nested project is only cloned once the one holding it is, so
+ * a whole subtree has to go to the same shard. Each project's parent is
+ * replaced by its outermost ancestor in place, which every later search
+ * through it then jumps straight to. */
+static bool frepo__shard_roots(
+	const manifest_t* manifest, unsigned* root)
+{
+	if (!manifest_find_parents(manifest, root))
+		return false;
 
-		error[p] = false;
-		tp[t].project  = p;
-		tp[t].error    = &error[p];
-		tp[t].complete = false;
+	unsigned p;
+	for (p = 0; p < manifest->project_count; p++)
+	{
+		unsigned q;
+		for (q = p; (root[q] != UINT_MAX) && (root[q] != q); q = root[q]);
+		root[p] = q;
+	}
+	return true;
+}
 
-		if (pthread_create(
-			(void*)&tp[t].thread, NULL,
-			frepo_sync_manifest__thread,
-			(void*)&tp[t]) != 0)
-			abort();
-		p++;
+/* Splits subtrees by a hash of their outermost path. */
+static manifest_t* frepo__shard_by_path(
+	manifest_t* manifest, unsigned shard, unsigned shard_count)
+{
+	unsigned count = manifest->project_count;
+	unsigned* root = (unsigned*)malloc((count + 1) * sizeof(unsigned));
+	bool*     mask = (bool*)malloc((count + 1) * sizeof(bool));
+
+	manifest_t* selected = NULL;
+	if (root && mask && frepo__shard_roots(manifest, root))
+	{
+		unsigned p;
+		for (p = 0; p < count; p++)
+			mask[p] = frepo__shard_hashed(
+				manifest_project_path(manifest, root[p]), shard, shard_count);
+		selected = manifest_select(manifest, mask);
 	}
 
-	for (t = 0; t < threads; t++)
-		sem_wait(&semaphore);
-	sem_destroy(&semaphore);
+	free(mask);
+	free(root);
+	return selected;
+}
 
-	for (t = 0; t < threads; t++)
+/* With a sync history, subtrees are taken longest first and each given
+ * to the least loaded shard, otherwise they're spread by a hash of their
+ * outermost path. Either way every machine with the same manifest and
+ * history picks the same shards, so sharded syncs never write the
+ * history. */
+static manifest_t* frepo__shard_select(
+	manifest_t* manifest, unsigned shard, unsigned shard_count)
+{
+	unsigned count = manifest->project_count;
+	uint64_t* weight = (uint64_t*)calloc(
+		((count * 2) + 1), sizeof(uint64_t));
+	unsigned* root = (unsigned*)malloc((count + 1) * sizeof(unsigned));
+	bool*     mask = (bool*)malloc((count + 1) * sizeof(bool));
+	uint64_t* load = (uint64_t*)calloc(shard_count, sizeof(uint64_t));
+	frepo__shard_t* order = NULL;
+	manifest_t* selected = NULL;
+
+	if (!weight || !root || !mask || !load)
+		goto frepo__shard_select_end;
+
+	if (!frepo__history_read(manifest, weight))
 	{
-		if (tp[t].error || tp[t].complete)
-			error_count += (*tp[t].error ? 1 : 0);
+		selected = frepo__shard_by_path(manifest, shard, shard_count);
+		goto frepo__shard_select_end;
 	}
 
-	if (error_count != 0)
+	if (!frepo__shard_roots(manifest, root))
+		goto frepo__shard_select_end;
+
+	/* Each subtree weighs what all of its projects took together. */
+	uint64_t* total = &weight[count];
+	unsigned root_count = 0;
+	unsigned p;
+	for (p = 0; p < count; p++)
 	{
-		for (p = 0; p < manifest->project_count; p++)
+		total[root[p]] += weight[p];
+		root_count += (root[p] == p);
+	}
+
+	order = (frepo__shard_t*)malloc(root_count * sizeof(frepo__shard_t));
+	if (!order && (root_count > 0))
+		goto frepo__shard_select_end;
+
+	unsigned r = 0;
+	for (p = 0; p < count; p++)
+	{
+		if (root[p] != p)
+			continue;
+
+		const char* path = manifest_project_path(manifest, p);
+		order[r].weight = total[p];
+		order[r].hash   = hash_data(path, strlen(path), 0);
+		order[r].index  = p;
+		r++;
+	}
+	qsort(order, root_count, sizeof(frepo__shard_t), frepo__shard_compare);
+
+	for (r = 0; r < root_count; r++)
+	{
+		unsigned s, least = 0;
+		for (s = 1; s < shard_count; s++)
 		{
-			if (error[p])
-				fprintf(stderr, "Error: Failed to sync project '%s'.\n",
-					manifest->project[p].path);
+			if (load[s] < load[least])
+				least = s;
 		}
-		return false;
+		load[least] += order[r].weight;
+		mask[order[r].index] = (least == shard);
 	}
 
-	return true;
+	for (p = 0; p < count; p++)
+		mask[p] = mask[root[p]];
+
+	selected = manifest_select(manifest, mask);
+
+frepo__shard_select_end:
+	free(order);
+	free(load);
+	free(mask);
+	free(root);
+	free(weight);
+	return selected;
 }
 
 static int frepo_init(
 	manifest_t* manifest, const char* url,
-	bool mirror, long int threads)
+	bool mirror,
+	group_t* priority_group, unsigned priority_group_count,
+	const char* priority_done, long int threads)
 {
-	return (frepo_sync_manifest(manifest, url, mirror, threads)
+	return (frepo_sync_manifest(manifest, url, mirror, false, true,
+		priority_group, priority_group_count, priority_done, threads)
 		? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
@@ -331,7 +768,12 @@ static int frepo_sync(
 	const char* manifest_url,
 	bool force, const char* branch,
 	group_t* group, unsigned group_count,
-	long int threads)
+	const char** name, char** path, unsigned path_count,
+	bool* path_matched, bool manifest_update,
+	unsigned shard, unsigned shard_count,
+	group_t* priority_group, unsigned priority_group_count,
+	const char* priority_done,
+	bool stale, bool incremental, long int threads)
 {
 	char* manifest_branch = NULL;
 	char* manifest_branch_old = NULL;
@@ -339,6 +781,7 @@ static int frepo_sync(
 	char* manifest_head_latest = NULL;
 	manifest_t* manifest_updated = NULL;
 	manifest_t* manifest_old = NULL;
+	manifest_t* manifest_sync = NULL;
 
 	char pdir[PATH_MAX];
 	if (getcwd(pdir, PATH_MAX) != pdir)
@@ -347,64 +790,79 @@ static int frepo_sync(
 		goto frepo_sync_failed;
 	}
 
-	bool manifest_uncommitted_changes;
-	if (!git_uncommitted_changes(manifest_repo, &manifest_uncommitted_changes))
-	{
-		fprintf(stderr, "Error: Failed to check for uncommitted changes"
-			" in your manifest.\n");
-		goto frepo_sync_failed;
-	}
-	else if (manifest_uncommitted_changes)
+	/* The manifest repository isn't touched when only updating projects
+	 * from it as it is. */
+	bool manifest_changed = false;
+	if (manifest_update)
 	{
-		fprintf(stderr, "Error: There are uncommitted changes in your manifest,"
-			" commit or discard these to continue.\n");
-		goto frepo_sync_failed;
-	}
+		bool manifest_uncommitted_changes;
+		if (!git_uncommitted_changes(
+			manifest_repo, &manifest_uncommitted_changes))
+		{
+			fprintf(stderr, "Error: Failed to check for uncommitted changes"
+				" in your manifest.\n");
+			goto frepo_sync_failed;
+		}
+		else if (manifest_uncommitted_changes)
+		{
+			fprintf(stderr, "Error: There are uncommitted changes"
+				" in your manifest, commit or discard these to continue.\n");
+			goto frepo_sync_failed;
+		}
 
-	manifest_head_old
-		= git_current_commit(manifest_repo);
-	if (!manifest_head_old)
-	{
-		fprintf(stderr, "Error: Failed to get local manifest commit.\n");
-		goto frepo_sync_failed;
-	}
+		manifest_head_old
+			= git_current_commit(manifest_repo);
+		if (!manifest_head_old)
+		{
+			fprintf(stderr, "Error: Failed to get local manifest commit.\n");
+			goto frepo_sync_failed;
+		}
 
-	printf("Updating manifest.\n");
+		printf("Updating manifest.\n");
 
-	manifest_branch = git_current_branch(manifest_repo);
-	if (branch)
-	{
-		manifest_branch_old = manifest_branch;
-		if (!git_checkout(manifest_repo, branch, false))
+		manifest_branch = git_current_branch(manifest_repo);
+		if (branch)
+		{
+			manifest_branch_old = manifest_branch;
+			if (!git_checkout(manifest_repo, branch, false))
+			{
+				fprintf(stderr, "Error: Failed to checkout manifest branch.\n");
+				goto frepo_sync_failed;
+			}
+			manifest_branch = (char*)branch;
+		}
+
+		if (!git_update(manifest_repo,
+				NULL, NULL, NULL,
+				manifest_branch, false))
 		{
-			fprintf(stderr, "Error: Failed to checkout manifest branch.\n");
+			fprintf(stderr, "Error: Failed to update manifest.\n");
 			goto frepo_sync_failed;
 		}
-		manifest_branch = (char*)branch;
-	}
 
-	if (!git_update(manifest_repo,
-			NULL, NULL, NULL,
-			manifest_branch, false))
-	{
-		fprintf(stderr, "Error: Failed to update manifest.\n");
-		goto frepo_sync_failed;
-	}
+		manifest_head_latest
+			= git_current_commit(manifest_repo);
+		if (!manifest_head_latest)
+		{
+			fprintf(stderr, "Error: Failed to get latest manifest commit.\n");
+			goto frepo_sync_failed;
+		}
 
-	manifest_head_latest
-		= git_current_commit(manifest_repo);
-	if (!manifest_head_latest)
-	{
-		fprintf(stderr, "Error: Failed to get latest manifest commit.\n");
-		goto frepo_sync_failed;
+		manifest_changed
+			= (strcmp(manifest_head_old, manifest_head_latest) != 0);
 	}
 
-	bool manifest_changed
-		= (strcmp(manifest_head_old, manifest_head_latest) != 0);
-
-	if (manifest_changed)
+	/* An incremental sync compares against the stored state even if the
+	 * manifest hasn't moved, since the last sync may not have finished,
+	 * as does any sync after one which only synced some paths. Shards are
+	 * always taken from the manifest, so that they don't depend on which
+	 * other shards have already been synced. Without an update the
+	 * repository may have been moved by hand, so it's always read. */
+	if (manifest_changed || !manifest_update
+		|| incremental || stale || (shard_count > 0))
 	{
-		manifest_updated = manifest_read(manifest_path);
+		manifest_updated = manifest_read_include(
+			manifest_path, manifest_repo, ".frepo/include");
 		if (!manifest_updated)
 		{
 			fprintf(stderr, "Error: Failed to read new manifest.\n");
@@ -418,13 +876,40 @@ static int frepo_sync(
 			fprintf(stderr, "Error: Failed to filter new manifest.\n");
 			goto frepo_sync_failed;
 		}
-		manifest_filtered->document = manifest_updated->document;
-		manifest_updated->document = NULL;
 		manifest_delete(manifest_updated);
 		manifest_updated = manifest_filtered;
 
+		if (path_count > 0)
+		{
+			manifest_filtered = frepo__path_select(
+				manifest_updated, name, path, path_count, path_matched);
+			if (!manifest_filtered)
+			{
+				fprintf(stderr, "Error: Failed to select projects by path.\n");
+				goto frepo_sync_failed;
+			}
+			manifest_delete(manifest_updated);
+			manifest_updated = manifest_filtered;
+		}
+
 		manifest_old = manifest_subtract(
 			manifest, manifest_updated);
+
+		/* Removed projects can't be balanced against the new manifest,
+		 * so they're always split by their outermost removed path. */
+		if (manifest_old && (shard_count > 0))
+		{
+			manifest_t* manifest_shard = frepo__shard_by_path(
+				manifest_old, shard, shard_count);
+			manifest_delete(manifest_old);
+			manifest_old = manifest_shard;
+			if (!manifest_old)
+			{
+				fprintf(stderr, "Error: Failed to select shard.\n");
+				goto frepo_sync_failed;
+			}
+		}
+
 		if (manifest_old && (manifest_old->project_count > 0))
 		{
 			if (!force)
@@ -439,26 +924,9 @@ static int frepo_sync(
 			printf("%u repositories will be removed.\n",
 				manifest_old->project_count);
 
-			unsigned i;
-			for (i = 0; i < manifest_old->project_count; i++)
-			{
-				bool uncommitted_changes;
-				if (!git_uncommitted_changes(
-					manifest_old->project[i].path, &uncommitted_changes))
-				{
-					fprintf(stderr, "Error: '%s' is deprecated but can't remove"
-						" because checking for uncommitted changes failed.\n",
-						manifest_old->project[i].name);
-					goto frepo_sync_failed;
-				}
-				else if (uncommitted_changes)
-				{
-					fprintf(stderr, "Error: '%s' is deprecated but can't remove"
-						" because it has uncommitted changes.\n",
-						manifest_old->project[i].name);
-					goto frepo_sync_failed;
-				}
-			}
+			if (!parallel_for(manifest_old->project_count, threads,
+				frepo_sync__deprecated_check, manifest_old))
+				goto frepo_sync_failed;
 		}
 	}
 	else
@@ -466,56 +934,111 @@ static int frepo_sync(
 		manifest_updated = manifest_copy(manifest);
 	}
 
-	if (manifest_updated)
+	if (manifest_updated && (shard_count > 0))
 	{
-		unsigned i;
-		for (i = 0; i < manifest_updated->project_count; i++)
+		manifest_t* manifest_shard = frepo__shard_select(
+			manifest_updated, shard, shard_count);
+		if (!manifest_shard)
+		{
+			fprintf(stderr, "Error: Failed to select shard.\n");
+			goto frepo_sync_failed;
+		}
+
+		printf("Shard %u/%u has %u of %u projects.\n",
+			(shard + 1), shard_count,
+			manifest_shard->project_count, manifest_updated->project_count);
+
+		manifest_delete(manifest_updated);
+		manifest_updated = manifest_shard;
+	}
+
+	/* Each path must select projects from the old or new manifest. */
+	unsigned p;
+	for (p = 0; p < path_count; p++)
+	{
+		if (!path_matched[p])
 		{
-			printf("Checking for uncommitted changes in '%s' (%u/%u).\n",
-				manifest_updated->project[i].path,
-				(i + 1), manifest_updated->project_count);
+			fprintf(stderr, "Error: No project named, at or holding '%s'.\n",
+				name[p]);
+			goto frepo_sync_failed;
+		}
+	}
 
-			if (!git_exists(manifest_updated->project[i].path))
-				continue;
+	if (incremental && manifest_updated)
+	{
+		unsigned count = manifest_updated->project_count;
+		unsigned change[count + 1];
+		bool     mask[count + 1];
+		if (!manifest_diff(manifest, manifest_updated, change))
+		{
+			fprintf(stderr, "Error: Failed to compare manifests.\n");
+			goto frepo_sync_failed;
+		}
 
-			bool uncommitted_changes;
-			if (!git_uncommitted_changes(
-				manifest_updated->project[i].path, &uncommitted_changes))
-			{
-				fprintf(stderr, "Error: Failed to check for uncommitted changes"
-					" in  '%s', won't update.\n",
-						manifest_updated->project[i].name);
-				goto frepo_sync_failed;
-			}
-			else if (uncommitted_changes)
-			{
-				fprintf(stderr, "Error: '%s' has uncommitted changes"
-					", won't update.\n", manifest_updated->project[i].name);
-				goto frepo_sync_failed;
-			}
+		unsigned added = 0, revision = 0, remote = 0, unchanged = 0;
+		unsigned i;
+		for (i = 0; i < count; i++)
+		{
+			added    += ((change[i] & manifest_change_added) != 0);
+			revision += ((change[i] & manifest_change_revision) != 0);
+			remote   += ((change[i] & manifest_change_remote) != 0);
+			mask[i] = (change[i] != manifest_change_none);
+
+			/* Projects which the stored state already has may still be
+			 * missing, for example when the group filter was widened. */
+			struct stat project_stat;
+			if (!mask[i] && (stat(manifest_project_path(
+				manifest_updated, i), &project_stat) != 0))
+				mask[i] = true;
+			unchanged += !mask[i];
 		}
 
-		if (!frepo_sync_manifest(manifest_updated, manifest_url, false, threads))
-			return EXIT_FAILURE;
+		printf("%u added, %u removed, %u revision changed"
+			", %u remote changed, %u unchanged.\n",
+			added, (manifest_old ? manifest_old->project_count : 0),
+			revision, remote, unchanged);
+
+		manifest_sync = manifest_select(manifest_updated, mask);
+		if (!manifest_sync)
+		{
+			fprintf(stderr, "Error: Failed to select changed projects.\n");
+			goto frepo_sync_failed;
+		}
+	}
+	else if (manifest_updated)
+	{
+		manifest_sync = manifest_copy(manifest_updated);
 	}
 
+	/* Each project is checked for uncommitted changes by its own sync task,
+	 * so clean projects start updating without waiting for the rest. */
+	if (manifest_sync
+		&& !frepo_sync_manifest(manifest_sync, manifest_url,
+			false, true, (shard_count == 0),
+			priority_group, priority_group_count, priority_done, threads))
+		goto frepo_sync_failed;
+
 	if (manifest_old)
 	{
 		unsigned i;
 		for (i = 0; i < manifest_old->project_count; i++)
 		{
+			const char* path = manifest_project_path(manifest_old, i);
+			if (!git_exists(path))
+				continue;
+
 			printf("Removing old repository (%u/%u) '%s'.\n",
-				(i + 1), manifest_old->project_count,
-				manifest_old->project[i].path);
+				(i + 1), manifest_old->project_count, path);
 
-			if (!git_remove(manifest_old->project[i].path))
+			if (!git_remove(path))
 				fprintf(stderr, "Warning: Failed to remove deprecated"
-					" project '%s'.\n", manifest_old->project[i].path);
+					" project '%s'.\n", path);
 		}
 	}
 
 	/* TODO - Delete unused directories. */
 
+	manifest_delete(manifest_sync);
 	manifest_delete(manifest_updated);
 	manifest_delete(manifest_old);
 	free(manifest_head_latest);
@@ -530,6 +1053,7 @@ frepo_sync_failed:
 		git_checkout(manifest_repo, manifest_branch_old, false);
 	if (manifest_head_old)
 		git_reset_hard(manifest_repo, manifest_head_old);
+	manifest_delete(manifest_sync);
 	manifest_delete(manifest_updated);
 	manifest_delete(manifest_old);
 	free(manifest_head_latest);
@@ -544,7 +1068,7 @@ static int frepo_snapshot(
 	manifest_t* manifest,
 	const char* manifest_repo,
 	const char* manifest_path,
-	const char* name)
+	const char* name, long int threads)
 {
 	bool changes;
 	if (!git_uncommitted_changes(manifest_repo, &changes))
@@ -563,64 +1087,490 @@ static int frepo_snapshot(
 	if (!branch)
 		branch = git_current_commit(manifest_repo);
 
-	if (!branch)
-	{
-		fprintf(stderr, "Error: Failed get current HEAD.\n");
-		return EXIT_FAILURE;
+	if (!branch)
+	{
+		fprintf(stderr, "Error: Failed get current HEAD.\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!git_checkout(manifest_repo, name, true))
+	{
+		free(branch);
+		fprintf(stderr, "Error: Failed to checkout snapshot branch '%s'.\n", name);
+		return EXIT_FAILURE;
+	}
+
+	char snapshot_message[64 + strlen(name)];
+	sprintf(snapshot_message, "Manifest snapshot '%s'", name);
+
+	if (!manifest_write_snapshot(manifest, manifest_path, threads))
+	{
+		fprintf(stderr, "Error: Failed to snapshot manifest.\n");
+		goto frepo_snapshot_failed;
+	}
+
+	if (!git_commit(manifest_repo, snapshot_message))
+	{
+		fprintf(stderr, "Error: Failed to commit snapshot, reverting.\n");
+		if (!git_reset_hard(manifest_repo, "HEAD"))
+			fprintf(stderr, "Warning: Failed to reset uncommitted snapshot.\n");
+		goto frepo_snapshot_failed;
+	}
+
+	if (!git_checkout(manifest_repo, branch, false))
+		fprintf(stderr, "Warning: Failed to revert manifest"
+			" to previous branch '%s'.\n", branch);
+	free(branch);
+
+	return EXIT_SUCCESS;
+
+frepo_snapshot_failed:
+	if (!git_checkout(manifest_repo, branch, false))
+		fprintf(stderr, "Warning: Failed to revert manifest"
+			" to previous branch '%s'.\n", branch);
+	else if (!git_reset_hard(manifest_repo, "HEAD"))
+		fprintf(stderr, "Warning: Failed to reset manifest to HEAD.\n");
+	free(branch);
+	return EXIT_FAILURE;
+}
+
+static manifest_t* frepo__snapshot_read(
+	settings_t* settings, const char* snapshot)
+{
+	struct stat snapshot_stat;
+	if ((stat(snapshot, &snapshot_stat) == 0)
+		&& S_ISREG(snapshot_stat.st_mode))
+		return manifest_read(snapshot);
+
+	char* source = git_show(
+		settings->manifest_repo, snapshot,
+		settings->manifest_name);
+	if (!source)
+		return NULL;
+
+	return manifest_parse_string(source);
+}
+
+static bool frepo__directory_exists(const char* path)
+{
+	struct stat path_stat;
+	return ((stat(path, &path_stat) == 0)
+		&& S_ISDIR(path_stat.st_mode));
+}
+
+/* The workspace root is the nearest directory at or above the working
+ * directory which holds .frepo, found without changing directory so that
+ * paths given on the command line keep their meaning. */
+static bool frepo__root_find(char* root)
+{
+	if (!getcwd(root, PATH_MAX))
+		return false;
+
+	while (true)
+	{
+		size_t size = strlen(root);
+		char frepo_path[size + 8];
+		sprintf(frepo_path, "%s/.frepo", (size > 1 ? root : ""));
+		if (frepo__directory_exists(frepo_path))
+			return true;
+
+		char* slash = strrchr(root, '/');
+		if (!slash || (size <= 1))
+			return false;
+		slash[slash == root ? 1 : 0] = '\0';
+	}
+}
+
+static bool frepo__path_exists(const char* path)
+{
+	struct stat path_stat;
+	return (stat(path, &path_stat) == 0);
+}
+
+/* Resolves a path given on the command line to its path from the root,
+ * following links when it exists. */
+static char* frepo__path_resolve(const char* root, const char* path)
+{
+	char resolved[PATH_MAX];
+	if (realpath(path, resolved))
+		return path_relative(root, resolved);
+
+	if (path[0] == '/')
+		return path_relative(root, path);
+
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, PATH_MAX))
+		return NULL;
+
+	char absolute[strlen(cwd) + strlen(path) + 2];
+	sprintf(absolute, "%s/%s", cwd, path);
+	return path_relative(root, absolute);
+}
+
+static double frepo__elapsed(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) * 1000.0)
+		+ ((now.tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+/* The stored state is the whole manifest with its includes resolved,
+ * so that it describes the workspace regardless of how the manifest
+ * repository changes later. */
+static bool frepo__state_write(
+	settings_t* settings,
+	const char* manifest_path, const char* manifest_base)
+{
+	manifest_t* manifest = manifest_read_include(
+		manifest_base, settings->manifest_repo, ".frepo/include");
+	if (!manifest)
+		return false;
+
+	bool success = manifest_write(manifest, manifest_path);
+	manifest_delete(manifest);
+	return success;
+}
+
+/* The filtered stored manifest is cached as a binary image keyed by the
+ * fingerprint of the manifest file and group filter, so that commands
+ * which don't change the manifest can skip parsing it. */
+static manifest_t* frepo__manifest_read(
+	settings_t* settings,
+	const char* manifest_path, const char* manifest_base,
+	bool warn)
+{
+	const char* cache_path = ".frepo/manifest.cache";
+	const char* include_cache = ".frepo/include";
+
+	uint64_t fingerprint = manifest_fingerprint(manifest_path,
+		settings->group, settings->group_count);
+
+	manifest_t* manifest
+		= manifest_cache_read(cache_path, fingerprint);
+	if (manifest)
+		return manifest;
+
+	/* Includes are always resolved against the manifest repository, and
+	 * parsed included manifests are cached alongside the stored state. */
+	manifest = manifest_read_include(manifest_path,
+		settings->manifest_repo, include_cache);
+	if (!manifest)
+	{
+		manifest = manifest_read_include(manifest_base,
+			settings->manifest_repo, include_cache);
+		if (!manifest)
+		{
+			fprintf(stderr, "Error: Unable to read manifest file.\n");
+			return NULL;
+		}
+		if (warn)
+		{
+			fprintf(stderr, "Warning: Failed to read stored manifest"
+				", frepo may fail to track deletions cleanly.\n");
+		}
+		fingerprint = 0;
+	}
+
+	manifest_t* manifest_filtered
+		= manifest_group_filter(manifest,
+			settings->group, settings->group_count);
+	if (!manifest_filtered)
+	{
+		fprintf(stderr, "Error: Failed to filter manifest groups.\n");
+		manifest_delete(manifest);
+		return NULL;
+	}
+	manifest_delete(manifest);
+
+	/* The cache is only an optimization, so failing to write it is fine. */
+	if (fingerprint)
+		(void)manifest_cache_write(manifest_filtered, cache_path, fingerprint);
+
+	return manifest_filtered;
+}
+
+static int frepo_which(
+	manifest_t* manifest, char** path, unsigned path_count)
+{
+	if (path_count == 0)
+	{
+		fprintf(stderr, "Error: No path given.\n");
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	unsigned i;
+	for (i = 0; i < path_count; i++)
+	{
+		unsigned index;
+		if (!manifest_find_containing(manifest, path[i], &index))
+		{
+			fprintf(stderr, "Error: '%s' is not in a project.\n", path[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		printf("%s\n", manifest_project_path(manifest, index));
+	}
+	return ret;
+}
+
+static int frepo_list(manifest_t* manifest)
+{
+	unsigned i;
+	for (i = 0; i < manifest->project_count; i++)
+	{
+		const project_t project = manifest_project(manifest, i);
+		printf("%s : %s\n", project.path, project.name);
+	}
+	return EXIT_SUCCESS;
+}
+
+struct frepo_forall_context
+{
+	manifest_t*       manifest;
+	const char*       command;
+	bool              print;
+	bool              capture;
+	bool              interleaved;
+	bool              stdin_list;
+	unsigned          unit_count;
+	unsigned*         batch;
+	process_result_t* result;
+	bool*             done;
+	unsigned          printed;
+	pthread_mutex_t   mutex;
+};
+
+static void frepo_forall__print_header(
+	struct frepo_forall_context* fc, unsigned u)
+{
+	if (!fc->print)
+		return;
+
+	unsigned first = (fc->batch ? fc->batch[u] : u);
+	unsigned last  = (fc->batch ? fc->batch[u + 1] : (u + 1));
+
+	unsigned p;
+	for (p = first; p < last; p++)
+		printf("project %s\n", manifest_project_path(fc->manifest, p));
+}
+
+static void frepo_forall__print(
+	struct frepo_forall_context* fc, unsigned u)
+{
+	frepo_forall__print_header(fc, u);
+	if (fc->result[u].output)
+		fwrite(fc->result[u].output, 1, fc->result[u].output_size, stdout);
+	fflush(stdout);
+
+	free(fc->result[u].output);
+	fc->result[u].output = NULL;
+	fc->result[u].output_size = 0;
+}
+
+static bool frepo_forall__complete(
+	struct frepo_forall_context* fc, unsigned u, bool success)
+{
+	/* Reported once in the summary after all units complete. */
+	if (!success)
+		fc->result[u].status = -1;
+
+	if (fc->capture)
+	{
+		pthread_mutex_lock(&fc->mutex);
+		fc->done[u] = true;
+		if (fc->interleaved)
+		{
+			frepo_forall__print(fc, u);
+		}
+		else
+		{
+			while ((fc->printed < fc->unit_count)
+				&& fc->done[fc->printed])
+				frepo_forall__print(fc, fc->printed++);
+		}
+		pthread_mutex_unlock(&fc->mutex);
+	}
+
+	return (fc->result[u].status == EXIT_SUCCESS);
+}
+
+static bool frepo_forall__project(void* context, unsigned p)
+{
+	struct frepo_forall_context* fc
+		= (struct frepo_forall_context*)context;
+	project_t project = manifest_project(fc->manifest, p);
+
+	const char* env_name[] =
+	{
+		"REPO_PROJECT",
+		"REPO_PATH",
+		"REPO_REMOTE",
+		"REPO_RREV",
+		"REPO_LREV",
+	};
+
+	/* TODO - Set REMOTE_LREV to HEAD HASH */
+	const char* env_value[] =
+	{
+		project.name,
+		project.path,
+		project.remote_name,
+		project.revision,
+		NULL,
+	};
+
+	if (!fc->capture)
+	{
+		frepo_forall__print_header(fc, p);
+		fflush(stdout);
+	}
+
+	char** env = process_environ(env_name, env_value, 5);
+	bool success = (env && process_run(
+		project.path, fc->command, NULL, 0, env,
+		NULL, 0, fc->capture, &fc->result[p]));
+	free(env);
+
+	return frepo_forall__complete(fc, p, success);
+}
+
+static bool frepo_forall__batch(void* context, unsigned b)
+{
+	struct frepo_forall_context* fc
+		= (struct frepo_forall_context*)context;
+
+	unsigned first = fc->batch[b];
+	unsigned count = (fc->batch[b + 1] - first);
+
+	if (!fc->capture)
+	{
+		frepo_forall__print_header(fc, b);
+		fflush(stdout);
+	}
+
+	bool success;
+	if (fc->stdin_list)
+	{
+		/* Each project is four NUL terminated fields:
+		 * path, name, remote name and revision. */
+		size_t input_size = 0;
+		unsigned p;
+		for (p = first; p < (first + count); p++)
+		{
+			project_t project = manifest_project(fc->manifest, p);
+			input_size += strlen(project.path) + 1
+				+ strlen(project.name) + 1
+				+ (project.remote_name ? strlen(project.remote_name) : 0) + 1
+				+ (project.revision ? strlen(project.revision) : 0) + 1;
+		}
+
+		char* input = (char*)malloc(input_size);
+		if (!input)
+			return frepo_forall__complete(fc, b, false);
+
+		char* field = input;
+		for (p = first; p < (first + count); p++)
+		{
+			project_t project = manifest_project(fc->manifest, p);
+			const char* value[] =
+			{
+				project.path,
+				project.name,
+				project.remote_name,
+				project.revision,
+			};
+
+			unsigned v;
+			for (v = 0; v < 4; v++)
+			{
+				size_t len = (value[v] ? strlen(value[v]) : 0);
+				memcpy(field, (value[v] ? value[v] : ""), len);
+				field[len] = '\0';
+				field += len + 1;
+			}
+		}
+
+		success = process_run(
+			NULL, fc->command, NULL, 0, NULL,
+			input, input_size, fc->capture, &fc->result[b]);
+		free(input);
 	}
-
-	if (!git_checkout(manifest_repo, name, true))
+	else
 	{
-		free(branch);
-		fprintf(stderr, "Error: Failed to checkout snapshot branch '%s'.\n", name);
-		return EXIT_FAILURE;
+		const char* argv[count];
+		unsigned p;
+		for (p = 0; p < count; p++)
+			argv[p] = manifest_project_path(fc->manifest, (first + p));
+
+		success = process_run(
+			NULL, fc->command, argv, count, NULL,
+			NULL, 0, fc->capture, &fc->result[b]);
 	}
 
-	char snapshot_message[64 + strlen(name)];
-	sprintf(snapshot_message, "Manifest snapshot '%s'", name);
+	return frepo_forall__complete(fc, b, success);
+}
 
-	if (!manifest_write_snapshot(manifest, manifest_path))
+static unsigned frepo_forall__batch_split(
+	manifest_t* manifest, size_t command_size,
+	unsigned batch_size, bool stdin_list, long int threads,
+	unsigned* batch)
+{
+	/* Leave headroom below ARG_MAX for the environment
+	 * and the shell's own arguments. */
+	long arg_max = sysconf(_SC_ARG_MAX);
+	if (arg_max <= 0)
+		arg_max = _POSIX_ARG_MAX;
+
+	size_t env_size = 0;
+	unsigned e;
+	for (e = 0; environ[e]; e++)
+		env_size += strlen(environ[e]) + 1 + sizeof(char*);
+
+	size_t reserved = env_size + command_size + 4096;
+	size_t arg_limit = ((size_t)arg_max > (reserved + 4096)
+		? ((size_t)arg_max - reserved) : 4096);
+
+	if (batch_size == 0)
 	{
-		fprintf(stderr, "Error: Failed to snapshot manifest.\n");
-		goto frepo_snapshot_failed;
+		batch_size = (manifest->project_count
+			+ (threads - 1)) / threads;
+		if (batch_size == 0)
+			batch_size = 1;
 	}
 
-	if (!git_commit(manifest_repo, snapshot_message))
+	unsigned count = 0;
+	size_t   arg_size = 0;
+	unsigned b = 0;
+	unsigned p;
+	for (p = 0; p < manifest->project_count; p++)
 	{
-		fprintf(stderr, "Error: Failed to commit snapshot, reverting.\n");
-		if (!git_reset_hard(manifest_repo, "HEAD"))
-			fprintf(stderr, "Warning: Failed to reset uncommitted snapshot.\n");
-		goto frepo_snapshot_failed;
-	}
-
-	if (!git_checkout(manifest_repo, branch, false))
-		fprintf(stderr, "Warning: Failed to revert manifest"
-			" to previous branch '%s'.\n", branch);
-	free(branch);
+		size_t size = stdin_list ? 0
+			: (strlen(manifest_project_path(manifest, p)) + 1 + sizeof(char*));
 
-	return EXIT_SUCCESS;
+		if ((count > 0)
+			&& ((count >= batch_size)
+				|| ((arg_size + size) > arg_limit)))
+		{
+			batch[b++] = (p - count);
+			count = 0;
+			arg_size = 0;
+		}
 
-frepo_snapshot_failed:
-	if (!git_checkout(manifest_repo, branch, false))
-		fprintf(stderr, "Warning: Failed to revert manifest"
-			" to previous branch '%s'.\n", branch);
-	else if (!git_reset_hard(manifest_repo, "HEAD"))
-		fprintf(stderr, "Warning: Failed to reset manifest to HEAD.\n");
-	free(branch);
-	return EXIT_FAILURE;
-}
+		count++;
+		arg_size += size;
+	}
+	batch[b++] = (p - count);
+	batch[b] = p;
 
-static int frepo_list(manifest_t* manifest)
-{
-	unsigned i;
-	for (i = 0; i < manifest->project_count; i++)
-		printf("%s : %s\n",
-			manifest->project[i].path,
-			manifest->project[i].name);
-	return EXIT_SUCCESS;
+	return b;
 }
 
-static int frepo_forall(manifest_t* manifest, int argc, char** argv, bool print)
+static int frepo_forall(
+	manifest_t* manifest, int argc, char** argv,
+	bool print, bool interleaved, long int threads,
+	bool batch_mode, unsigned batch_size, bool stdin_list)
 {
 	if (!manifest)
 		return EXIT_FAILURE;
@@ -631,11 +1581,14 @@ static int frepo_forall(manifest_t* manifest, int argc, char** argv, bool print)
 		return EXIT_FAILURE;
 	}
 
+	if (manifest->project_count == 0)
+		return EXIT_SUCCESS;
+
 	int i, cmd_len;
 	for (i = 0, cmd_len = 0; i < argc; i++)
 		cmd_len += strlen(argv[i]) + 1;
 
-	char cmd[cmd_len];
+	char cmd[cmd_len + 8];
 	strcpy(cmd, argv[0]);
 	
 	for (i = 1; i < argc; i++)
@@ -644,62 +1597,108 @@ static int frepo_forall(manifest_t* manifest, int argc, char** argv, bool print)
 		strcat(cmd, argv[i]);
 	}
 
-	char pdir[PATH_MAX];
-	if (getcwd(pdir, PATH_MAX) != pdir)
+	if (batch_mode && !stdin_list)
+		strcat(cmd, " \"$@\"");
+
+	if (threads <= 0)
+		threads = 1;
+
+	unsigned* batch = NULL;
+	unsigned unit_count = manifest->project_count;
+	if (batch_mode)
+	{
+		batch = (unsigned*)malloc(
+			(manifest->project_count + 1) * sizeof(unsigned));
+		if (!batch)
+		{
+			fprintf(stderr, "Error: Failed to allocate forall batches.\n");
+			return EXIT_FAILURE;
+		}
+
+		unit_count = frepo_forall__batch_split(
+			manifest, strlen(cmd), batch_size,
+			stdin_list, threads, batch);
+	}
+
+	process_result_t* result = (process_result_t*)malloc(
+		unit_count * (sizeof(process_result_t) + sizeof(bool)));
+	if (!result)
 	{
-		fprintf(stderr, "Error: Failed to get current directory.\n");
+		fprintf(stderr, "Error: Failed to allocate forall results.\n");
+		free(batch);
 		return EXIT_FAILURE;
 	}
+	bool* done = (bool*)&result[unit_count];
 
 	unsigned j;
-	for (j = 0; j < manifest->project_count; j++)
+	for (j = 0; j < unit_count; j++)
 	{
-		if (print)
-			printf("project %s\n", manifest->project[j].path);
-
-		setenv("REPO_PROJECT", manifest->project[j].name, 1);
-		setenv("REPO_PATH", manifest->project[j].path, 1);
-
-		if (manifest->project[j].remote_name)
-			setenv("REPO_REMOTE", manifest->project[j].remote_name, 1);
-		else
-			unsetenv("REPO_REMOTE");
+		result[j].status      = -1;
+		result[j].output      = NULL;
+		result[j].output_size = 0;
+		done[j] = false;
+	}
 
-		if (manifest->project[j].revision)
-			setenv("REPO_RREV", manifest->project[j].revision, 1);
-		else
-			unsetenv("REPO_RREV");
+	/* Output is only buffered when commands run concurrently, so serial
+	 * runs keep the terminal for interactive commands. */
+	struct frepo_forall_context fc;
+	fc.manifest    = manifest;
+	fc.command     = cmd;
+	fc.print       = print;
+	fc.capture     = ((threads > 1) && (unit_count > 1));
+	fc.interleaved = interleaved;
+	fc.stdin_list  = stdin_list;
+	fc.unit_count  = unit_count;
+	fc.batch       = (batch_mode ? batch : NULL);
+	fc.result      = result;
+	fc.done        = done;
+	fc.printed     = 0;
+	if (pthread_mutex_init(&fc.mutex, NULL) != 0)
+		abort();
 
-		/* TODO - Set REMOTE_LREV to HEAD HASH */
-		unsetenv("REPO_LREV");
+	bool success = parallel_for(unit_count, threads,
+		(batch_mode ? frepo_forall__batch : frepo_forall__project), &fc);
+	pthread_mutex_destroy(&fc.mutex);
 
-		if (chdir(manifest->project[j].path) != 0)
+	if (!success)
+	{
+		for (j = 0; j < unit_count; j++)
 		{
-			fprintf(stderr, "Error: Failed to enter directory '%s'.\n",
-				manifest->project[j].path);
-			return EXIT_FAILURE;
-		}
+			if (result[j].status == EXIT_SUCCESS)
+				continue;
 
-		if (system(cmd) != EXIT_SUCCESS)
-		{
-			/* Do nothing. */
-		}
+			if (batch_mode)
+			{
+				fprintf(stderr, "Error: Command failed for batch %u"
+					" ('%s' to '%s')",
+					(j + 1), manifest_project_path(manifest, batch[j]),
+					manifest_project_path(manifest, (batch[j + 1] - 1)));
+			}
+			else
+			{
+				fprintf(stderr, "Error: Command failed in '%s'",
+					manifest_project_path(manifest, j));
+			}
 
-		if (chdir(pdir) != 0)
-		{
-			fprintf(stderr, "Error: Failed to exit directory '%s'.\n",
-				manifest->project[j].path);
-			return EXIT_FAILURE;
+			if (result[j].status < 0)
+				fprintf(stderr, ", failed to run.\n");
+			else
+				fprintf(stderr, " with exit status %d.\n", result[j].status);
 		}
 	}
 
-	return EXIT_SUCCESS;
+	free(result);
+	free(batch);
+	return (success ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 
 
 int main(int argc, char* argv[])
 {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	if (argc < 2)
 	{
 		fprintf(stderr, "Error: No command given.\n");
@@ -726,6 +1725,8 @@ int main(int argc, char* argv[])
 		command = frepo_command_list;
 	else if (strcmp(argv[1], "forall") == 0)
 		command = frepo_command_forall;
+	else if (strcmp(argv[1], "which") == 0)
+		command = frepo_command_which;
 	else
 	{
 		fprintf(stderr, "Error: Invalid command '%s'.\n", argv[1]);
@@ -737,11 +1738,37 @@ int main(int argc, char* argv[])
 	const char* repo    = NULL;
 	const char* branch  = NULL;
 	bool        force   = false;
+	bool        manifest_update = true;
+	unsigned    shard = 0;
+	unsigned    shard_count = 0;
+	group_t*    priority_group = NULL;
+	unsigned    priority_group_count = 0;
+	const char* priority_done = NULL;
+	char        priority_done_path[PATH_MAX];
+	bool        incremental = false;
 	bool        print   = false;
+	bool        interleaved = false;
+	bool        batch_mode  = false;
+	unsigned    batch_size  = 0;
+	bool        stdin_list  = false;
+	const char* changed_since = NULL;
+	char        changed_since_path[PATH_MAX];
 	long int    threads = 0;
+	bool        timing  = false;
+	const char* path_arg[argc];
+	unsigned    path_count = 0;
+
+	/* Settings are read from the workspace root, which is only entered
+	 * once the command line has been parsed. */
+	char root[PATH_MAX];
+	bool root_found = (command != frepo_command_init)
+		&& frepo__root_find(root);
 
 	const char* settings_path = ".frepo/config.ini";
-	settings_t* settings = settings_read(settings_path);
+	char settings_root_path[PATH_MAX + 32];
+	sprintf(settings_root_path, "%s/%s",
+		(root_found ? root : "."), settings_path);
+	settings_t* settings = settings_read(settings_root_path);
 	if (!settings)
 	{
 		settings = settings_create(false);
@@ -770,6 +1797,15 @@ int main(int argc, char* argv[])
 
 	for (; a < argc; a++)
 	{
+		if ((argv[a][0] != '-')
+			&& ((command == frepo_command_sync)
+				|| (command == frepo_command_forall)
+				|| (command == frepo_command_which)))
+		{
+			path_arg[path_count++] = argv[a];
+			continue;
+		}
+
 		if (argv[a][0] != '-')
 		{
 			fprintf(stderr, "Error: Unexpected argument '%s'.\n", argv[a]);
@@ -881,9 +1917,22 @@ int main(int argc, char* argv[])
 
 					force = true;
 					break;
+				case 'n':
+					if (command != frepo_command_sync)
+					{
+						fprintf(stderr,
+							"Error: -n flag invalid for command.\n");
+						print_usage(argv[0]);
+						return EXIT_FAILURE;
+					}
+
+					manifest_update = false;
+					break;
 				case 'j':
 					if ((command != frepo_command_init)
-						&& (command != frepo_command_sync))
+						&& (command != frepo_command_sync)
+						&& (command != frepo_command_snapshot)
+						&& (command != frepo_command_forall))
 					{
 						fprintf(stderr,
 							"Error: -j flag invalid for command.\n");
@@ -920,6 +1969,178 @@ int main(int argc, char* argv[])
 				}
 				settings->mirror = true;
 			}
+			else if (strcmp(argv[a], "--incremental") == 0)
+			{
+				if (command != frepo_command_sync)
+				{
+					fprintf(stderr,
+						"Error: --incremental flag invalid for command.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				incremental = true;
+			}
+			else if (strcmp(argv[a], "--interleaved") == 0)
+			{
+				if (command != frepo_command_forall)
+				{
+					fprintf(stderr,
+						"Error: --interleaved flag invalid for command.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				interleaved = true;
+			}
+			else if ((strcmp(argv[a], "--batch") == 0)
+				|| (strncmp(argv[a], "--batch=", 8) == 0))
+			{
+				if (command != frepo_command_forall)
+				{
+					fprintf(stderr,
+						"Error: --batch flag invalid for command.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+
+				if (argv[a][7] == '=')
+				{
+					long int size = strtol(&argv[a][8], NULL, 0);
+					if (size <= 0)
+					{
+						fprintf(stderr,
+							"Error: Invalid batch size '%s'.\n", &argv[a][8]);
+						print_usage(argv[0]);
+						return EXIT_FAILURE;
+					}
+					batch_size = size;
+				}
+				batch_mode = true;
+			}
+			else if (strcmp(argv[a], "--changed-since") == 0)
+			{
+				if ((command != frepo_command_list)
+					&& (command != frepo_command_forall))
+				{
+					fprintf(stderr,
+						"Error: --changed-since flag invalid for command.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+
+				if ((a + 1) >= argc)
+				{
+					fprintf(stderr,
+						"Error: No snapshot supplied with --changed-since.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				changed_since = argv[++a];
+
+				/* Manifest files are resolved now since we may change
+				 * to the workspace root before reading them. */
+				struct stat changed_since_stat;
+				if ((stat(changed_since, &changed_since_stat) == 0)
+					&& S_ISREG(changed_since_stat.st_mode)
+					&& realpath(changed_since, changed_since_path))
+					changed_since = changed_since_path;
+			}
+			else if (strcmp(argv[a], "--shard") == 0)
+			{
+				if (command != frepo_command_sync)
+				{
+					fprintf(stderr,
+						"Error: --shard flag invalid for command.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+
+				if ((a + 1) >= argc)
+				{
+					fprintf(stderr,
+						"Error: No shard supplied with --shard.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				a++;
+
+				char* end;
+				unsigned long i = strtoul(argv[a], &end, 10);
+				unsigned long n = 0;
+				if (end[0] == '/')
+					n = strtoul(&end[1], &end, 10);
+				if ((end[0] != '\0') || (i < 1) || (i > n) || (n > UINT_MAX))
+				{
+					fprintf(stderr,
+						"Error: Invalid shard '%s'.\n", argv[a]);
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				shard = (i - 1);
+				shard_count = n;
+			}
+			else if ((strcmp(argv[a], "--priority-groups") == 0)
+				|| (strcmp(argv[a], "--priority-done") == 0))
+			{
+				if ((command != frepo_command_init)
+					&& (command != frepo_command_sync))
+				{
+					fprintf(stderr,
+						"Error: %s flag invalid for command.\n", argv[a]);
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+
+				if ((a + 1) >= argc)
+				{
+					fprintf(stderr,
+						"Error: No argument supplied with %s.\n", argv[a]);
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				a++;
+
+				if (strcmp(argv[a - 1], "--priority-groups") == 0)
+				{
+					if (!group_list_parse(argv[a], false,
+						&priority_group, &priority_group_count))
+					{
+						fprintf(stderr,
+							"Error: Failed to parse priority groups.\n");
+						print_usage(argv[0]);
+						return EXIT_FAILURE;
+					}
+				}
+				else
+				{
+					/* The done file is created from the workspace root,
+					 * so a relative path is resolved now. */
+					char cwd[PATH_MAX];
+					priority_done = argv[a];
+					if ((argv[a][0] != '/') && getcwd(cwd, PATH_MAX))
+					{
+						int size = snprintf(priority_done_path,
+							sizeof(priority_done_path), "%s/%s", cwd, argv[a]);
+						if ((size > 0)
+							&& ((size_t)size < sizeof(priority_done_path)))
+							priority_done = priority_done_path;
+					}
+				}
+			}
+			else if (strcmp(argv[a], "--timing") == 0)
+			{
+				timing = true;
+			}
+			else if (strcmp(argv[a], "--stdin") == 0)
+			{
+				if (command != frepo_command_forall)
+				{
+					fprintf(stderr,
+						"Error: --stdin flag invalid for command.\n");
+					print_usage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				stdin_list = true;
+			}
 			else
 			{
 				fprintf(stderr,
@@ -930,6 +2151,22 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if (branch && !manifest_update)
+	{
+		fprintf(stderr,
+			"Error: -b flag can't be used with -n.\n");
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (stdin_list && !batch_mode)
+	{
+		fprintf(stderr,
+			"Error: --stdin flag requires --batch.\n");
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
 	if (command == frepo_command_init)
 	{
 		if (!settings_manifest_url_set(
@@ -952,6 +2189,7 @@ int main(int argc, char* argv[])
 
 		char mkdir_cmd[strlen(name) + 64];
 		sprintf(mkdir_cmd, "mkdir -p %s > /dev/null", name);
+		process_spawned();
 		if (system(mkdir_cmd) != EXIT_SUCCESS)
 		{
 			fprintf(stderr, "Error: Failed to create '%s' directory.\n", name);
@@ -983,6 +2221,7 @@ int main(int argc, char* argv[])
 	}
 
 	const char* manifest_path = ".frepo/manifest.xml";
+	const char* partial_path  = ".frepo/manifest.partial";
 
 	const char* manifest_base = settings_manifest_path_get(settings);
 	if (!manifest_base)
@@ -991,33 +2230,48 @@ int main(int argc, char* argv[])
 			"Error: Failed to get manifest path from settings.\n");
 		return EXIT_FAILURE;
 	}
-	size_t manifest_base_size = strlen(manifest_base);
 
-	char manifest_find_cmd[strlen(settings->manifest_repo) + 8];
-	sprintf(manifest_find_cmd, "[ -d %s ]", settings->manifest_repo);
+	/* Paths are given relative to the working directory, but projects
+	 * are found by their path from the workspace root. */
+	if (!root_found && !getcwd(root, PATH_MAX))
+		root[0] = '\0';
 
-	if (system(manifest_find_cmd) != EXIT_SUCCESS)
+	char* path[path_count + 1];
+	unsigned p;
+	for (p = 0; p < path_count; p++)
 	{
-		do
+		/* Sync arguments may also be project names, which are only
+		 * known to be wrong once the manifest has been read. */
+		path[p] = frepo__path_resolve(root, path_arg[p]);
+		if (!path[p] && (command != frepo_command_sync))
 		{
-			char curdir[PATH_MAX];
-			if ((getcwd(curdir, PATH_MAX) != curdir)
-				|| (strcmp(curdir, "/") == 0)
-				|| (chdir("..") != EXIT_SUCCESS)
-				|| (system("[ -d .frepo ]") == EXIT_SUCCESS))
-				break;
-		} while (true);
-
-		if ((system("[ -d .frepo ]") != EXIT_SUCCESS)
-			&& (system(manifest_find_cmd) != EXIT_SUCCESS))
+			fprintf(stderr, "Error: Path '%s' is outside the workspace.\n",
+				path_arg[p]);
+			for (; p > 0; p--)
+				free(path[p - 1]);
+			return EXIT_FAILURE;
+		}
+	}
+	bool path_matched[path_count + 1];
+	memset(path_matched, 0x00, (path_count * sizeof(bool)));
+
+	if (root_found)
+	{
+		if (chdir(root) != 0)
 		{
-			fprintf(stderr, "Error: Not in a frepo repository"
-				", no manifest directory found.\n");
+			fprintf(stderr, "Error: Failed to enter workspace root '%s'.\n",
+				root);
 			return EXIT_FAILURE;
 		}
 	}
+	else if (!frepo__directory_exists(settings->manifest_repo))
+	{
+		fprintf(stderr, "Error: Not in a frepo repository"
+			", no manifest directory found.\n");
+		return EXIT_FAILURE;
+	}
 
-	if (system("[ -d .frepo ]") != EXIT_SUCCESS)
+	if (!frepo__directory_exists(".frepo"))
 	{
 		fprintf(stderr, "Warning: No .frepo directory found"
 			", recreating but deletions may not be tracked.\n");
@@ -1031,91 +2285,151 @@ int main(int argc, char* argv[])
 			}
 		}
 
-		char cmd[strlen(manifest_path) + manifest_base_size + 5];
-		sprintf(cmd, "cp %s %s",
-			manifest_base, manifest_path);
-		if (system(cmd) != EXIT_SUCCESS)
+		if (!frepo__state_write(settings, manifest_path, manifest_base))
 		{
-			/* Safely ignore output. */
+			/* Safely ignore failure, the manifest is read from the
+			 * manifest repository instead. */
 		}
 	}
 
-	manifest_t* manifest
-		= manifest_read(manifest_path);
+	manifest_t* manifest = frepo__manifest_read(
+		settings, manifest_path, manifest_base,
+		(command != frepo_command_init));
 	if (!manifest)
+		return EXIT_FAILURE;
+
+	if (changed_since)
 	{
-		manifest = manifest_read(manifest_base);
-		if (!manifest)
+		manifest_t* snapshot
+			= frepo__snapshot_read(settings, changed_since);
+		if (!snapshot)
 		{
-			fprintf(stderr, "Error: Unable to read manifest file.\n");
+			fprintf(stderr, "Error: Failed to read snapshot '%s'.\n",
+				changed_since);
+			manifest_delete(manifest);
 			return EXIT_FAILURE;
 		}
-		if (command != frepo_command_init)
+
+		manifest_t* manifest_changed
+			= manifest_changed_since(manifest, snapshot);
+		manifest_delete(snapshot);
+		if (!manifest_changed)
 		{
-			fprintf(stderr, "Warning: Failed to read stored manifest"
-				", frepo may fail to track deletions cleanly.\n");
+			fprintf(stderr, "Error: Failed to compare manifest"
+				" against snapshot.\n");
+			manifest_delete(manifest);
+			return EXIT_FAILURE;
 		}
+		manifest_delete(manifest);
+		manifest = manifest_changed;
 	}
 
-	manifest_t* manifest_filtered
-		= manifest_group_filter(manifest,
-			settings->group, settings->group_count);
-	if (!manifest_filtered)
+	if ((path_count > 0)
+		&& ((command == frepo_command_sync)
+			|| (command == frepo_command_forall)))
 	{
-		fprintf(stderr, "Error: Failed to filter manifest groups.\n");
+		manifest_t* manifest_selected = frepo__path_select(manifest,
+			((command == frepo_command_sync) ? path_arg : NULL),
+			path, path_count, path_matched);
+		if (!manifest_selected)
+		{
+			fprintf(stderr, "Error: Failed to select projects by path.\n");
+			manifest_delete(manifest);
+			return EXIT_FAILURE;
+		}
 		manifest_delete(manifest);
-		return EXIT_FAILURE;
+		manifest = manifest_selected;
+
+		for (p = 0; (command == frepo_command_forall) && (p < path_count); p++)
+		{
+			if (!path_matched[p])
+			{
+				fprintf(stderr, "Error: No project at or holding '%s'.\n",
+					path[p]);
+				manifest_delete(manifest);
+				return EXIT_FAILURE;
+			}
+		}
 	}
-	manifest_filtered->document = manifest->document;
-	manifest->document = NULL;
-	manifest_delete(manifest);
-	manifest = manifest_filtered;
 
-	if (threads <= 0)
+	if ((threads <= 0)
+		&& (command != frepo_command_forall))
 		threads = manifest->threads;
 
+	if (timing)
+	{
+		fprintf(stderr, "Timing: started in %.1f ms"
+			" with %u child processes.\n",
+			frepo__elapsed(&start), process_spawn_count());
+	}
+
 	int ret = EXIT_FAILURE;
 	switch (command)
 	{
 		case frepo_command_init:
 			ret = frepo_init(
 				manifest, settings->manifest_url,
-				settings->mirror, threads);
+				settings->mirror,
+				priority_group, priority_group_count,
+				priority_done, threads);
 			break;
 		case frepo_command_sync:
 			ret = frepo_sync(
 				manifest,
 				settings->manifest_repo,
-				manifest_path,
+				manifest_base,
 				settings->manifest_url,
 				force, branch,
 				settings->group,
 				settings->group_count,
-				threads);
+				path_arg, path, path_count, path_matched,
+				manifest_update, shard, shard_count,
+				priority_group, priority_group_count, priority_done,
+				frepo__path_exists(partial_path),
+				incremental, threads);
 			break;
 		case frepo_command_snapshot:
 			ret = frepo_snapshot(
 				manifest,
 				settings->manifest_repo,
-				manifest_base, name);
+				manifest_base, name, threads);
 			break;
 		case frepo_command_forall:
-			ret = frepo_forall(manifest, fa_argc, fa_argv, print);
+			ret = frepo_forall(manifest, fa_argc, fa_argv,
+				print, interleaved, threads,
+				batch_mode, batch_size, stdin_list);
+			break;
+		case frepo_command_which:
+			ret = frepo_which(manifest, path, path_count);
 			break;
 		default:
 			ret = frepo_list(manifest);
 			break;
 	}
 
+	/* After syncing some paths or one shard the workspace matches neither
+	 * the stored state nor the new manifest, so the state is kept and
+	 * marked stale for the next sync to compare against the manifest. */
 	if ((ret == EXIT_SUCCESS)
+		&& (command == frepo_command_sync)
+		&& ((path_count > 0) || (shard_count > 0)))
+	{
+		FILE* fp = fopen(partial_path, "w");
+		if (fp)
+			fclose(fp);
+		else
+			fprintf(stderr, "Warning: Failed to mark manifest state as stale"
+				", frepo may fail to track deletions cleanly.\n");
+	}
+	else if ((ret == EXIT_SUCCESS)
 		&& ((command == frepo_command_init)
 			|| (command == frepo_command_sync)))
 	{
-		char cmd[strlen(manifest_path) + manifest_base_size + 5];
-		sprintf(cmd, "cp %s %s", manifest_base, manifest_path);
-		if (system(cmd) != EXIT_SUCCESS)
+		if (!frepo__state_write(settings, manifest_path, manifest_base))
 			fprintf(stderr, "Warning: Failed to store current manifest state"
 				", frepo may fail to track deletions cleanly.\n");
+		else
+			unlink(partial_path);
 
 		if (!settings_write(
 			settings, settings_path))
@@ -1124,6 +2438,16 @@ int main(int argc, char* argv[])
 
 	manifest_delete(manifest);
 	settings_delete(settings);
+	free(priority_group);
+	for (p = 0; p < path_count; p++)
+		free(path[p]);
+
+	if (timing)
+	{
+		fprintf(stderr, "Timing: finished in %.1f ms"
+			" with %u child processes.\n",
+			frepo__elapsed(&start), process_spawn_count());
+	}
 
 	return ret;
 }
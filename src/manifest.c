@@ -16,18 +16,27 @@
  * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "manifest.h"
 #include "git.h"
+#include "hash.h"
+#include "parallel.h"
+#include "strpool.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 
 
@@ -36,664 +45,3806 @@ void manifest_delete(manifest_t* manifest)
 	if (!manifest)
 		return;
 
-	unsigned i;
-	for (i = 0; i < manifest->project_count; i++)
+	/* Views hold a reference to their base manifest, so a base is only
+	 * released once every view of it has been deleted. */
+	if (--manifest->refs > 0)
+		return;
+
+	if (manifest->base)
+	{
+		manifest_t* base = manifest->base;
+		free(manifest);
+		manifest_delete(base);
+		return;
+	}
+
+	hash_table_delete(&manifest->path_index);
+	hash_table_delete(&manifest->name_index);
+	hash_table_delete(&manifest->remote_index);
+
+	group_table_clear(&manifest->groups);
+
+	/* A mapped cache image holds the table, the group sets and the trie. */
+	if (manifest->mapping)
+	{
+		munmap(manifest->mapping, manifest->mapping_size);
+	}
+	else
 	{
-		free(manifest->project[i].copyfile);
-		free(manifest->project[i].group);
+		free(manifest->table);
+		free(manifest->group_set);
+		free(manifest->trie);
 	}
 
-	if (manifest->document)
-		xml_tag_delete(manifest->document);
 	free(manifest);
 }
 
-manifest_t* manifest_parse(xml_tag_t* document)
+
+
+static inline const manifest_t* manifest__base(const manifest_t* manifest)
+{
+	return (manifest->base ? manifest->base : manifest);
+}
+
+static inline uint32_t manifest__base_index(
+	const manifest_t* manifest, unsigned i)
+{
+	return (manifest->base ? manifest->index[i] : i);
+}
+
+project_t manifest_project(const manifest_t* manifest, unsigned i)
+{
+	const manifest_t* base = manifest__base(manifest);
+	uint32_t b = manifest__base_index(manifest, i);
+	const remote_t* remote = &base->remote[base->project_remote[b]];
+
+	project_t project;
+	project.path        = &base->string[base->project_path[b]];
+	project.name        = &base->string[base->project_name[b]];
+	project.remote      = remote->fetch;
+	project.remote_name = remote->name;
+	project.revision    = &base->string[base->project_revision[b]];
+	project.priority    = (int32_t)base->project_priority[b];
+	project.copyfile_count
+		= base->project_copyfile[b + 1] - base->project_copyfile[b];
+	project.group_count
+		= base->project_group[b + 1] - base->project_group[b];
+	return project;
+}
+
+const char* manifest_project_path(const manifest_t* manifest, unsigned i)
+{
+	const manifest_t* base = manifest__base(manifest);
+	return &base->string[base->project_path[manifest__base_index(manifest, i)]];
+}
+
+const char* manifest_project_name(const manifest_t* manifest, unsigned i)
+{
+	const manifest_t* base = manifest__base(manifest);
+	return &base->string[base->project_name[manifest__base_index(manifest, i)]];
+}
+
+const char* manifest_project_revision(const manifest_t* manifest, unsigned i)
+{
+	const manifest_t* base = manifest__base(manifest);
+	return &base->string[base->project_revision[
+		manifest__base_index(manifest, i)]];
+}
+
+int manifest_project_priority(const manifest_t* manifest, unsigned i)
+{
+	const manifest_t* base = manifest__base(manifest);
+	return (int32_t)base->project_priority[manifest__base_index(manifest, i)];
+}
+
+copyfile_t manifest_project_copyfile(
+	const manifest_t* manifest, unsigned i, unsigned j)
+{
+	const manifest_t* base = manifest__base(manifest);
+	const uint32_t* entry = &base->copyfile[
+		(base->project_copyfile[manifest__base_index(manifest, i)] + j) * 2];
+
+	copyfile_t copyfile;
+	copyfile.source = &base->string[entry[0]];
+	copyfile.dest   = &base->string[entry[1]];
+	return copyfile;
+}
+
+group_t manifest_project_group(
+	const manifest_t* manifest, unsigned i, unsigned j)
+{
+	const manifest_t* base = manifest__base(manifest);
+
+	group_t group;
+	group.name = &base->string[base->group[
+		base->project_group[manifest__base_index(manifest, i)] + j]];
+	group.size = strlen(group.name);
+	group.exclude = false;
+	return group;
+}
+
+
+
+/* Every manifest carries indexes of its projects by path and by name and
+ * of its remotes by name. They're built by each constructor once the
+ * table is final, so lookups never have to scan. */
+
+static const char* manifest__key_path(
+	const void* context, uint32_t index, size_t* size)
+{
+	const manifest_t* manifest = (const manifest_t*)context;
+	const char* key = &manifest->string[manifest->project_path[index]];
+	*size = strlen(key);
+	return key;
+}
+
+static const char* manifest__key_name(
+	const void* context, uint32_t index, size_t* size)
+{
+	const manifest_t* manifest = (const manifest_t*)context;
+	const char* key = &manifest->string[manifest->project_name[index]];
+	*size = strlen(key);
+	return key;
+}
+
+static const char* manifest__key_remote(
+	const void* context, uint32_t index, size_t* size)
+{
+	const char* key = ((const remote_t*)context)[index].name;
+	*size = strlen(key);
+	return key;
+}
+
+static void manifest__init(manifest_t* manifest)
+{
+	manifest->table        = NULL;
+	manifest->mapping      = NULL;
+	manifest->mapping_size = 0;
+
+	manifest->base     = NULL;
+	manifest->index    = NULL;
+	manifest->position = NULL;
+	manifest->refs     = 1;
+
+	memset(&manifest->path_index  , 0x00, sizeof(hash_table_t));
+	memset(&manifest->name_index  , 0x00, sizeof(hash_table_t));
+	memset(&manifest->remote_index, 0x00, sizeof(hash_table_t));
+
+	manifest->trie       = NULL;
+	manifest->trie_count = 0;
+	manifest->trie_slot  = NULL;
+	manifest->trie_mask  = 0;
+
+	group_table_init(&manifest->groups);
+	manifest->group_set = NULL;
+}
+
+/* Group sets are built from each project's group range when a manifest
+ * is parsed, views use the rows of their base. */
+
+static bool manifest__group_build(manifest_t* manifest)
+{
+	unsigned i, j;
+	for (i = 0; i < manifest->group_count; i++)
+	{
+		const char* name = &manifest->string[manifest->group[i]];
+		if (!group_table_intern(&manifest->groups,
+			name, strlen(name), NULL))
+			return false;
+	}
+
+	unsigned words = GROUP_SET_WORDS(manifest->groups.count);
+	if (words == 0)
+		return true;
+
+	manifest->group_set = (uint64_t*)calloc(
+		(manifest->project_count * words), sizeof(uint64_t));
+	if (!manifest->group_set)
+		return false;
+
+	for (i = 0; i < manifest->project_count; i++)
+	{
+		uint64_t* set = &manifest->group_set[i * words];
+		for (j = manifest->project_group[i];
+			j < manifest->project_group[i + 1]; j++)
+		{
+			const char* name = &manifest->string[manifest->group[j]];
+			unsigned id;
+			group_table_find(&manifest->groups, name, strlen(name), &id);
+			set[id >> 6] |= (1ULL << (id & 63));
+		}
+	}
+
+	return true;
+}
+
+static manifest_t* manifest__index(manifest_t* manifest)
 {
-	if (!document
-		|| (document->tag_count != 1)
-		|| (strcmp(document->tag[0]->name, "manifest") != 0))
+	if (!manifest)
+		return NULL;
+
+	/* Project indexes may already have been loaded from a cache. */
+	if ((!manifest->path_index.slot
+			&& !hash_table_build(&manifest->path_index,
+				manifest->project_count,
+				manifest__key_path, manifest))
+		|| (!manifest->name_index.slot
+			&& !hash_table_build(&manifest->name_index,
+				manifest->project_count,
+				manifest__key_name, manifest))
+		|| !hash_table_build(&manifest->remote_index,
+			manifest->remote_count,
+			manifest__key_remote, manifest->remote))
 	{
-		fprintf(stderr, "Error: No manifest in XML file.\n");
+		fprintf(stderr, "Error: Failed to index manifest.\n");
+		manifest_delete(manifest);
 		return NULL;
 	}
 
-	xml_tag_t* mdoc = document->tag[0];
+	return manifest;
+}
 
-	unsigned remote_count  = 0;
-	unsigned project_count = 0;
+static bool manifest__find(
+	const manifest_t* manifest, bool by_name,
+	const char* key, bool next, unsigned* index)
+{
+	if (!manifest || !key || !index)
+		return false;
 
-	unsigned i;
-	for (i = 0; i < mdoc->tag_count; i++)
+	const manifest_t* base = manifest__base(manifest);
+	const hash_table_t* table
+		= (by_name ? &base->name_index : &base->path_index);
+	hash_key_func_t key_func
+		= (by_name ? manifest__key_name : manifest__key_path);
+
+	/* Keys may be shared, and a view may leave out the first projects
+	 * found, so the search continues in manifest order. */
+	uint32_t b = (next ? manifest__base_index(manifest, *index) : 0);
+	while (hash_table_find(table, key, strlen(key),
+		key_func, base, next, &b))
 	{
-		if (strcmp(mdoc->tag[i]->name, "remote") == 0)
-			remote_count++;
-		else if (strcmp(mdoc->tag[i]->name, "project") == 0)
-			project_count++;
-		else if (strcmp(mdoc->tag[i]->name, "default") != 0)
+		if (!manifest->base)
 		{
-			fprintf(stderr,
-				"Error: Unrecognized tag '%s' in manifest.\n",
-				mdoc->tag[i]->name);
+			*index = b;
+			return true;
+		}
+
+		if (manifest->position[b] != UINT32_MAX)
+		{
+			*index = manifest->position[b];
+			return true;
+		}
+
+		next = true;
+	}
+
+	return false;
+}
+
+bool manifest_find_path(
+	const manifest_t* manifest, const char* path, unsigned* index)
+{
+	return manifest__find(manifest, false, path, false, index);
+}
+
+bool manifest_find_name(
+	const manifest_t* manifest, const char* name,
+	bool next, unsigned* index)
+{
+	return manifest__find(manifest, true, name, next, index);
+}
+
+remote_t* manifest_find_remote(
+	const manifest_t* manifest, const char* name)
+{
+	if (!manifest)
+		return NULL;
+
+	const manifest_t* base = manifest__base(manifest);
+
+	uint32_t index;
+	if (!name
+		|| !hash_table_find(&base->remote_index, name, strlen(name),
+			manifest__key_remote, base->remote, false, &index))
+		return NULL;
+	return &base->remote[index];
+}
+
+
+
+/* Project paths are also indexed as a trie of path components, so that
+ * the project holding a path or the projects below one are found with a
+ * single probe per component. Each node's children are found through one
+ * table keyed by parent and component, and are linked as siblings so that
+ * a subtree can be walked. A node's project is the first at its path.
+ * Most commands never look a path up, so the trie is only built on first
+ * use, or when the manifest is cached so that it's loaded with it. */
+
+enum
+{
+	MANIFEST__TRIE_PARENT,
+	MANIFEST__TRIE_NAME,
+	MANIFEST__TRIE_SIZE,
+	MANIFEST__TRIE_PROJECT,
+	MANIFEST__TRIE_CHILD,
+	MANIFEST__TRIE_SIBLING,
+
+	MANIFEST__TRIE_WORDS
+};
+
+/* Components are separated by any number of slashes, and "." is skipped. */
+static const char* manifest__trie_component(const char** path, size_t* size)
+{
+	const char* c = *path;
+	while (true)
+	{
+		while (*c == '/')
+			c++;
+		if (*c == '\0')
 			return NULL;
+
+		const char* end = c;
+		while ((*end != '\0') && (*end != '/'))
+			end++;
+
+		if (((end - c) == 1) && (c[0] == '.'))
+		{
+			c = end;
+			continue;
 		}
+
+		*path = end;
+		*size = end - c;
+		return c;
 	}
+}
 
-	manifest_t* manifest = (manifest_t*)malloc(
-		sizeof(manifest_t)
-		+ (remote_count * sizeof(remote_t))
-		+ (project_count * sizeof(project_t)));
-	if (!manifest) return NULL;
-	manifest->remote_count = remote_count;
-	manifest->remote  = (remote_t*)((uintptr_t)manifest + sizeof(manifest_t));
-	manifest->project_count = project_count;
-	manifest->project = (project_t*)&manifest->remote[manifest->remote_count];
-	manifest->document = NULL;
-	manifest->threads = 1;
+static uint32_t manifest__trie_probe(
+	const uint32_t* node, const uint32_t* slot, uint32_t mask,
+	const char* string, uint32_t parent, const char* name, size_t size)
+{
+	uint32_t s = hash_data(name, size, parent) & mask;
+	while (slot[s] != UINT32_MAX)
+	{
+		const uint32_t* n = &node[slot[s] * MANIFEST__TRIE_WORDS];
+		if ((n[MANIFEST__TRIE_PARENT] == parent)
+			&& (n[MANIFEST__TRIE_SIZE] == size)
+			&& (memcmp(&string[n[MANIFEST__TRIE_NAME]], name, size) == 0))
+			break;
+		s = (s + 1) & mask;
+	}
+	return s;
+}
 
-	unsigned j;
-	for (i = 0, j = 0; i < mdoc->tag_count; i++)
+static uint32_t manifest__trie_capacity(size_t count)
+{
+	uint32_t capacity = 16;
+	while (capacity < (count * 2))
+		capacity <<= 1;
+	return capacity;
+}
+
+static bool manifest__trie_build(manifest_t* manifest)
+{
+	if (manifest->trie)
+		return true;
+
+	const char* string = manifest->string;
+
+	size_t limit = 1;
+	unsigned i;
+	for (i = 0; i < manifest->project_count; i++)
+	{
+		const char* path = &string[manifest->project_path[i]];
+		size_t size;
+		while (manifest__trie_component(&path, &size))
+			limit++;
+	}
+
+	/* Nodes are added with a table sized for one per component, which is
+	 * rebuilt to fit once the number of distinct nodes is known. */
+	uint32_t mask = manifest__trie_capacity(limit) - 1;
+	uint32_t* node = (uint32_t*)malloc(
+		limit * MANIFEST__TRIE_WORDS * sizeof(uint32_t));
+	uint32_t* slot = (uint32_t*)malloc(
+		((size_t)mask + 1) * sizeof(uint32_t));
+	if (!node || !slot)
 	{
-		if (strcmp(mdoc->tag[i]->name, "remote") == 0)
+		free(node);
+		free(slot);
+		return false;
+	}
+	memset(slot, 0xFF, (((size_t)mask + 1) * sizeof(uint32_t)));
+
+	uint32_t* root = node;
+	root[MANIFEST__TRIE_PARENT]  = UINT32_MAX;
+	root[MANIFEST__TRIE_NAME]    = 0;
+	root[MANIFEST__TRIE_SIZE]    = 0;
+	root[MANIFEST__TRIE_PROJECT] = UINT32_MAX;
+	root[MANIFEST__TRIE_CHILD]   = UINT32_MAX;
+	root[MANIFEST__TRIE_SIBLING] = UINT32_MAX;
+	uint32_t count = 1;
+
+	for (i = 0; i < manifest->project_count; i++)
+	{
+		const char* path = &string[manifest->project_path[i]];
+		uint32_t n = 0;
+
+		const char* name;
+		size_t size;
+		while ((name = manifest__trie_component(&path, &size)))
 		{
-			manifest->remote[j].name
-				= xml_tag_field(mdoc->tag[i], "name");
-			manifest->remote[j].fetch
-				= xml_tag_field(mdoc->tag[i], "fetch");
-			if (!manifest->remote[j].name
-				|| !manifest->remote[j].fetch)
+			uint32_t s = manifest__trie_probe(
+				node, slot, mask, string, n, name, size);
+			if (slot[s] == UINT32_MAX)
 			{
-				fprintf(stderr,
-					"Error: Missing 'name' or 'fetch' field in remote tag.\n");
-				free(manifest);
-				return NULL;
+				uint32_t* parent = &node[n * MANIFEST__TRIE_WORDS];
+				uint32_t* child = &node[count * MANIFEST__TRIE_WORDS];
+				child[MANIFEST__TRIE_PARENT]  = n;
+				child[MANIFEST__TRIE_NAME]    = name - string;
+				child[MANIFEST__TRIE_SIZE]    = size;
+				child[MANIFEST__TRIE_PROJECT] = UINT32_MAX;
+				child[MANIFEST__TRIE_CHILD]   = UINT32_MAX;
+				child[MANIFEST__TRIE_SIBLING] = parent[MANIFEST__TRIE_CHILD];
+				parent[MANIFEST__TRIE_CHILD]  = count;
+				slot[s] = count++;
 			}
-			j++;
+			n = slot[s];
 		}
+
+		uint32_t* leaf = &node[n * MANIFEST__TRIE_WORDS];
+		if (leaf[MANIFEST__TRIE_PROJECT] == UINT32_MAX)
+			leaf[MANIFEST__TRIE_PROJECT] = i;
+	}
+	free(slot);
+
+	uint32_t capacity = manifest__trie_capacity(count);
+	size_t node_words = (size_t)count * MANIFEST__TRIE_WORDS;
+	uint32_t* trie = (uint32_t*)realloc(node,
+		(node_words + capacity) * sizeof(uint32_t));
+	if (!trie)
+	{
+		free(node);
+		return false;
+	}
+	manifest->trie = trie;
+	manifest->trie_count = count;
+	manifest->trie_slot  = &manifest->trie[node_words];
+	manifest->trie_mask  = capacity - 1;
+	memset(manifest->trie_slot, 0xFF, (capacity * sizeof(uint32_t)));
+
+	uint32_t n;
+	for (n = 1; n < count; n++)
+	{
+		const uint32_t* c = &manifest->trie[n * MANIFEST__TRIE_WORDS];
+		uint32_t s = manifest__trie_probe(manifest->trie,
+			manifest->trie_slot, manifest->trie_mask, string,
+			c[MANIFEST__TRIE_PARENT], &string[c[MANIFEST__TRIE_NAME]],
+			c[MANIFEST__TRIE_SIZE]);
+		manifest->trie_slot[s] = n;
+	}
+
+	return true;
+}
+
+/* Finds the project of a trie node in the manifest, which may be a view
+ * that leaves it out. */
+static bool manifest__trie_project(
+	const manifest_t* manifest, const uint32_t* node, unsigned* index)
+{
+	uint32_t b = node[MANIFEST__TRIE_PROJECT];
+	if (b == UINT32_MAX)
+		return false;
+
+	if (manifest->base)
+	{
+		if (manifest->position[b] == UINT32_MAX)
+			return false;
+		b = manifest->position[b];
+	}
+
+	*index = b;
+	return true;
+}
+
+/* Builds the trie of a manifest's base the first time that it's needed,
+ * this isn't safe to do from several threads at once. */
+static const manifest_t* manifest__trie(const manifest_t* manifest)
+{
+	manifest_t* base = (manifest_t*)manifest__base(manifest);
+	if (!manifest__trie_build(base))
+	{
+		fprintf(stderr, "Error: Failed to index manifest paths.\n");
+		return NULL;
+	}
+	return base;
+}
+
+bool manifest_find_containing(
+	const manifest_t* manifest, const char* path, unsigned* index)
+{
+	if (!manifest || !path || !index)
+		return false;
+
+	const manifest_t* base = manifest__trie(manifest);
+	if (!base) return false;
+	bool found = false;
+
+	uint32_t n = 0;
+	while (true)
+	{
+		const uint32_t* node = &base->trie[n * MANIFEST__TRIE_WORDS];
+		found |= manifest__trie_project(manifest, node, index);
+
+		size_t size;
+		const char* name = manifest__trie_component(&path, &size);
+		if (!name)
+			break;
+
+		uint32_t s = manifest__trie_probe(base->trie, base->trie_slot,
+			base->trie_mask, base->string, n, name, size);
+		n = base->trie_slot[s];
+		if (n == UINT32_MAX)
+			break;
 	}
 
-	remote_t*   default_remote
-		= (manifest->remote_count > 0 ? &manifest->remote[0] : NULL);
-	const char* default_revision = NULL;
+	return found;
+}
+
+unsigned manifest_mark_path(
+	const manifest_t* manifest, const char* path, bool* mask)
+{
+	if (!manifest || !path || !mask)
+		return 0;
+
+	const manifest_t* base = manifest__trie(manifest);
+	if (!base) return 0;
+
+	uint32_t top = 0;
+	size_t size;
+	const char* name;
+	while ((name = manifest__trie_component(&path, &size)))
+	{
+		uint32_t s = manifest__trie_probe(base->trie, base->trie_slot,
+			base->trie_mask, base->string, top, name, size);
+		top = base->trie_slot[s];
+		if (top == UINT32_MAX)
+			return 0;
+	}
 
-	for (i = 0, j = 0; i < mdoc->tag_count; i++)
+	/* The subtree is walked through child and sibling links, climbing
+	 * back through parents, so no stack is needed. */
+	unsigned count = 0;
+	uint32_t n = top;
+	while (true)
 	{
-		if (strcmp(mdoc->tag[i]->name, "default") == 0)
+		const uint32_t* node = &base->trie[n * MANIFEST__TRIE_WORDS];
+
+		unsigned index;
+		if (manifest__trie_project(manifest, node, &index))
+		{
+			mask[index] = true;
+			count++;
+		}
+
+		if (node[MANIFEST__TRIE_CHILD] != UINT32_MAX)
 		{
-			const char* nrevision
-				= xml_tag_field(mdoc->tag[i], "revision");
-			if (nrevision)
-				default_revision = nrevision;
+			n = node[MANIFEST__TRIE_CHILD];
+			continue;
+		}
+
+		while ((n != top) && (base->trie[(n * MANIFEST__TRIE_WORDS)
+			+ MANIFEST__TRIE_SIBLING] == UINT32_MAX))
+			n = base->trie[(n * MANIFEST__TRIE_WORDS) + MANIFEST__TRIE_PARENT];
+		if (n == top)
+			break;
+		n = base->trie[(n * MANIFEST__TRIE_WORDS) + MANIFEST__TRIE_SIBLING];
+	}
 
-			const char* sync_j
-				= xml_tag_field(mdoc->tag[i], "sync-j");
-			long int threads = strtol(sync_j, NULL, 0);
-			if (threads > 0)
-				manifest->threads = threads;
+	return count;
+}
 
-			const char* nremote
-				= xml_tag_field(mdoc->tag[i], "remote");
-			if (nremote)
-			{
-				unsigned r;
-				for (r = 0; r < remote_count; r++)
-				{
-					const char* rname = manifest->remote[r].name;
-					if (rname && (strcmp(rname, nremote) == 0))
-					{
-						default_remote = &manifest->remote[r];
-						break;
-					}
-				}
-				if (r >= manifest->remote_count)
-				{
-					fprintf(stderr,
-						"Error: Invalid remote name '%s' in default tag.\n",
-						nremote);
-					free(manifest);
-					return NULL;
-				}
-			}
+bool manifest_find_parents(
+	const manifest_t* manifest, unsigned* parent)
+{
+	if (!manifest || !parent)
+		return false;
+
+	const manifest_t* base = manifest__trie(manifest);
+	if (!base) return false;
+
+	/* Every project's path is in the trie, so each of its components is
+	 * found, and the last project on the way is its parent. */
+	unsigned i;
+	for (i = 0; i < manifest->project_count; i++)
+	{
+		const char* path = manifest_project_path(manifest, i);
+		parent[i] = UINT_MAX;
+
+		uint32_t n = 0;
+		size_t size;
+		const char* name;
+		while ((name = manifest__trie_component(&path, &size)))
+		{
+			unsigned index;
+			if (manifest__trie_project(manifest,
+				&base->trie[n * MANIFEST__TRIE_WORDS], &index))
+				parent[i] = index;
+
+			uint32_t s = manifest__trie_probe(base->trie, base->trie_slot,
+				base->trie_mask, base->string, n, name, size);
+			n = base->trie_slot[s];
 		}
-		else if (strcmp(mdoc->tag[i]->name, "project") == 0)
+	}
+
+	return true;
+}
+
+
+
+typedef struct
+{
+	char*  data;
+	size_t size;
+	size_t capacity;
+	bool   error;
+} manifest__buffer_t;
+
+static void manifest__buffer_write(
+	manifest__buffer_t* buffer, const void* data, size_t size)
+{
+	if (buffer->error || (size == 0))
+		return;
+
+	if ((buffer->size + size) > buffer->capacity)
+	{
+		size_t capacity = (buffer->capacity ? buffer->capacity : 4096);
+		while ((buffer->size + size) > capacity)
+			capacity <<= 1;
+
+		char* ndata = (char*)realloc(buffer->data, capacity);
+		if (!ndata)
 		{
-			project_t* project = &manifest->project[j];
+			buffer->error = true;
+			return;
+		}
+		buffer->data = ndata;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(&buffer->data[buffer->size], data, size);
+	buffer->size += size;
+}
 
-			project->path
-				= xml_tag_field(mdoc->tag[i], "path");
-			project->name
-				= xml_tag_field(mdoc->tag[i], "name");
+static bool manifest__file_replace(
+	const char* path, const char* data, size_t size)
+{
+	char tmp_path[strlen(path) + 16];
+	sprintf(tmp_path, "%s.XXXXXX", path);
 
-			project->remote
-				= xml_tag_field(mdoc->tag[i], "remote");
-			if (project->remote)
-			{
-				unsigned r;
-				for (r = 0; r < remote_count; r++)
-				{
-					const char* rname = manifest->remote[r].name;
-					if (rname
-						&& (strcmp(rname, project->remote) == 0))
-					{
-						project->remote      = manifest->remote[r].fetch;
-						project->remote_name = manifest->remote[r].name;
-						break;
-					}
-				}
-				if (r >= remote_count)
-				{
-					fprintf(stderr,
-						"Error: Invalid remote name '%s' in project tag.\n",
-						project->remote);
-					free(manifest);
-					return NULL;
-				}
-			}
-			else
-			{
-				project->remote      = default_remote->fetch;
-				project->remote_name = default_remote->name;
-			}
+	mode_t mode = (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	struct stat path_stat;
+	if (stat(path, &path_stat) == 0)
+		mode = (path_stat.st_mode & 0777);
+
+	int fd = mkstemp(tmp_path);
+	if (fd < 0)
+		return false;
+
+	size_t written = 0;
+	while (written < size)
+	{
+		ssize_t w = write(fd, &data[written], (size - written));
+		if (w < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += w;
+	}
+
+	bool success = (written == size)
+		&& (fchmod(fd, mode) == 0)
+		&& (fsync(fd) == 0);
+	success = (close(fd) == 0) && success;
+
+	if (!success || (rename(tmp_path, path) != 0))
+	{
+		unlink(tmp_path);
+		return false;
+	}
+
+	return true;
+}
+
+
+
+/* A table is built one column at a time and copied into a single block
+ * once complete. Paths and names are nearly always unique so they're
+ * appended as they are, other strings are looked up first and shared. */
 
-			project->revision
-				= xml_tag_field(mdoc->tag[i], "revision");
-			if (!project->revision)
-				project->revision = default_revision;
+typedef enum
+{
+	MANIFEST__COLUMN_REMOTE,
+	MANIFEST__COLUMN_PATH,
+	MANIFEST__COLUMN_NAME,
+	MANIFEST__COLUMN_REVISION,
+	MANIFEST__COLUMN_PROJECT_REMOTE,
+	MANIFEST__COLUMN_PROJECT_PRIORITY,
+	MANIFEST__COLUMN_PROJECT_COPYFILE,
+	MANIFEST__COLUMN_PROJECT_GROUP,
+	MANIFEST__COLUMN_COPYFILE,
+	MANIFEST__COLUMN_GROUP,
+	MANIFEST__COLUMN_INCLUDE,
+	MANIFEST__COLUMN_INCLUDE_HASH,
+
+	MANIFEST__COLUMN_COUNT
+} manifest__column_t;
+
+typedef struct
+{
+	manifest__buffer_t string;
+	manifest__buffer_t shared;
+	hash_table_t       shared_index;
+	manifest__buffer_t column[MANIFEST__COLUMN_COUNT];
+	const char*        revision;
+	uint32_t           revision_offset;
+	unsigned           remote_count;
+	unsigned           project_count;
+} manifest__table_t;
+
+static size_t manifest__table_layout(manifest_t* manifest, void* table)
+{
+	uint32_t** column[MANIFEST__COLUMN_COUNT] =
+	{
+		&manifest->remote_string,
+		&manifest->project_path,
+		&manifest->project_name,
+		&manifest->project_revision,
+		&manifest->project_remote,
+		&manifest->project_priority,
+		&manifest->project_copyfile,
+		&manifest->project_group,
+		&manifest->copyfile,
+		&manifest->group,
+		&manifest->include,
+		&manifest->include_hash,
+	};
+
+	size_t count[MANIFEST__COLUMN_COUNT] =
+	{
+		(size_t)manifest->remote_count * 2,
+		manifest->project_count,
+		manifest->project_count,
+		manifest->project_count,
+		manifest->project_count,
+		manifest->project_count,
+		(size_t)manifest->project_count + 1,
+		(size_t)manifest->project_count + 1,
+		(size_t)manifest->copyfile_count * 2,
+		manifest->group_count,
+		manifest->include_count,
+		(size_t)manifest->include_count * 2,
+	};
+
+	/* Each column starts on eight bytes so that the block can be followed
+	 * by words which need that alignment. */
+	size_t size = 0;
+	unsigned c;
+	for (c = 0; c < MANIFEST__COLUMN_COUNT; c++)
+	{
+		if (table)
+			*column[c] = (uint32_t*)((uintptr_t)table + size);
+		size += ((count[c] * sizeof(uint32_t)) + 7) & ~(size_t)7;
+	}
+
+	if (table)
+		manifest->string = (const char*)((uintptr_t)table + size);
+	return size + ((manifest->string_size + 7) & ~(size_t)7);
+}
+
+static const char* manifest__table_key(
+	const void* context, uint32_t index, size_t* size)
+{
+	const manifest__table_t* table = (const manifest__table_t*)context;
+	const char* key = &table->string.data[
+		((const uint32_t*)table->shared.data)[index]];
+	*size = strlen(key);
+	return key;
+}
 
-			project->copyfile_count = 0;
-			project->copyfile = NULL;
+static uint32_t manifest__table_string(
+	manifest__table_t* table, const char* string, size_t size, bool shared)
+{
+	uint32_t index;
+	if (shared && hash_table_find(&table->shared_index, string, size,
+		manifest__table_key, table, false, &index))
+		return ((const uint32_t*)table->shared.data)[index];
+
+	if (table->string.size >= UINT32_MAX - size)
+	{
+		table->string.error = true;
+		return 0;
+	}
 
-			project->group_count = 0;
-			project->group = NULL;
+	uint32_t offset = table->string.size;
+	manifest__buffer_write(&table->string, string, size);
+	manifest__buffer_write(&table->string, "", 1);
+	if (shared && !table->string.error)
+	{
+		index = table->shared.size / sizeof(uint32_t);
+		manifest__buffer_write(&table->shared, &offset, sizeof(offset));
+		if (table->shared.error || !hash_table_insert(&table->shared_index,
+			index, manifest__table_key, table))
+			table->string.error = true;
+	}
+	return offset;
+}
+
+static void manifest__table_push(
+	manifest__table_t* table, manifest__column_t column, uint32_t value)
+{
+	manifest__buffer_write(&table->column[column], &value, sizeof(value));
+}
+
+static void manifest__table_init(manifest__table_t* table)
+{
+	memset(table, 0x00, sizeof(manifest__table_t));
+}
+
+static void manifest__table_free(manifest__table_t* table)
+{
+	free(table->string.data);
+	free(table->shared.data);
+	hash_table_delete(&table->shared_index);
+
+	unsigned c;
+	for (c = 0; c < MANIFEST__COLUMN_COUNT; c++)
+		free(table->column[c].data);
+}
+
+static void manifest__table_remote(
+	manifest__table_t* table, const char* name, const char* fetch)
+{
+	manifest__table_push(table, MANIFEST__COLUMN_REMOTE,
+		manifest__table_string(table, name, strlen(name), true));
+	manifest__table_push(table, MANIFEST__COLUMN_REMOTE,
+		manifest__table_string(table, fetch, strlen(fetch), true));
+	table->remote_count++;
+}
+
+/* Projects are added after every remote, and their lists straight after
+ * each project. */
+static void manifest__table_project(
+	manifest__table_t* table, const char* path, const char* name,
+	const char* revision, uint32_t remote, int priority)
+{
+	manifest__table_push(table, MANIFEST__COLUMN_PATH,
+		manifest__table_string(table, path, strlen(path), false));
+	manifest__table_push(table, MANIFEST__COLUMN_NAME,
+		manifest__table_string(table, name, strlen(name), false));
+
+	/* Most projects share their revision with the one before. */
+	if (revision != table->revision)
+	{
+		table->revision = revision;
+		table->revision_offset = manifest__table_string(
+			table, revision, strlen(revision), true);
+	}
+	manifest__table_push(table, MANIFEST__COLUMN_REVISION,
+		table->revision_offset);
+
+	manifest__table_push(table, MANIFEST__COLUMN_PROJECT_REMOTE, remote);
+	manifest__table_push(table, MANIFEST__COLUMN_PROJECT_PRIORITY,
+		(uint32_t)priority);
+	manifest__table_push(table, MANIFEST__COLUMN_PROJECT_COPYFILE,
+		table->column[MANIFEST__COLUMN_COPYFILE].size
+			/ (2 * sizeof(uint32_t)));
+	manifest__table_push(table, MANIFEST__COLUMN_PROJECT_GROUP,
+		table->column[MANIFEST__COLUMN_GROUP].size / sizeof(uint32_t));
+	table->project_count++;
+}
+
+static void manifest__table_copyfile(
+	manifest__table_t* table, const char* source, const char* dest)
+{
+	manifest__table_push(table, MANIFEST__COLUMN_COPYFILE,
+		manifest__table_string(table, source, strlen(source), true));
+	manifest__table_push(table, MANIFEST__COLUMN_COPYFILE,
+		manifest__table_string(table, dest, strlen(dest), true));
+}
+
+static void manifest__table_group(
+	manifest__table_t* table, const char* name, unsigned size)
+{
+	manifest__table_push(table, MANIFEST__COLUMN_GROUP,
+		manifest__table_string(table, name, size, true));
+}
+
+static void manifest__table_include(
+	manifest__table_t* table, const char* path, uint64_t hash)
+{
+	manifest__table_push(table, MANIFEST__COLUMN_INCLUDE,
+		manifest__table_string(table, path, strlen(path), false));
+	manifest__table_push(table, MANIFEST__COLUMN_INCLUDE_HASH,
+		(uint32_t)hash);
+	manifest__table_push(table, MANIFEST__COLUMN_INCLUDE_HASH,
+		(uint32_t)(hash >> 32));
+}
+
+/* Builds a manifest from a complete table, the table is freed either way. */
+static manifest_t* manifest__table_finish(
+	manifest__table_t* table, long int threads)
+{
+	manifest_t* manifest = NULL;
+
+	manifest__table_push(table, MANIFEST__COLUMN_PROJECT_COPYFILE,
+		table->column[MANIFEST__COLUMN_COPYFILE].size
+			/ (2 * sizeof(uint32_t)));
+	manifest__table_push(table, MANIFEST__COLUMN_PROJECT_GROUP,
+		table->column[MANIFEST__COLUMN_GROUP].size / sizeof(uint32_t));
+
+	bool error = table->string.error;
+	unsigned c;
+	for (c = 0; c < MANIFEST__COLUMN_COUNT; c++)
+		error |= table->column[c].error;
+	if (error)
+		goto manifest__table_finish_failed;
+
+	manifest = (manifest_t*)malloc(sizeof(manifest_t)
+		+ (table->remote_count * sizeof(remote_t)));
+	if (!manifest)
+		goto manifest__table_finish_failed;
+	manifest__init(manifest);
+	manifest->remote_count = table->remote_count;
+	manifest->remote = (remote_t*)((uintptr_t)manifest + sizeof(manifest_t));
+	manifest->project_count = table->project_count;
+	manifest->threads = threads;
+	manifest->copyfile_count = table->column[MANIFEST__COLUMN_COPYFILE].size
+		/ (2 * sizeof(uint32_t));
+	manifest->group_count = table->column[MANIFEST__COLUMN_GROUP].size
+		/ sizeof(uint32_t);
+	manifest->include_count = table->column[MANIFEST__COLUMN_INCLUDE].size
+		/ sizeof(uint32_t);
+	manifest->string_size = table->string.size;
+
+	size_t size = manifest__table_layout(manifest, NULL);
+	manifest->table = calloc(1, size);
+	if (!manifest->table)
+		goto manifest__table_finish_failed;
+	manifest__table_layout(manifest, manifest->table);
+
+	uint32_t* column[MANIFEST__COLUMN_COUNT] =
+	{
+		manifest->remote_string,
+		manifest->project_path,
+		manifest->project_name,
+		manifest->project_revision,
+		manifest->project_remote,
+		manifest->project_priority,
+		manifest->project_copyfile,
+		manifest->project_group,
+		manifest->copyfile,
+		manifest->group,
+		manifest->include,
+		manifest->include_hash,
+	};
+	for (c = 0; c < MANIFEST__COLUMN_COUNT; c++)
+	{
+		if (table->column[c].size > 0)
+			memcpy(column[c], table->column[c].data, table->column[c].size);
+	}
+	if (table->string.size > 0)
+		memcpy((char*)manifest->string,
+			table->string.data, table->string.size);
+
+	unsigned i;
+	for (i = 0; i < manifest->remote_count; i++)
+	{
+		manifest->remote[i].name
+			= &manifest->string[manifest->remote_string[i * 2]];
+		manifest->remote[i].fetch
+			= &manifest->string[manifest->remote_string[(i * 2) + 1]];
+	}
+
+	manifest__table_free(table);
+
+	if (!manifest__group_build(manifest))
+	{
+		fprintf(stderr, "Error: Failed to index manifest groups.\n");
+		manifest_delete(manifest);
+		return NULL;
+	}
+
+	return manifest__index(manifest);
+
+manifest__table_finish_failed:
+	fprintf(stderr, "Error: Failed to build manifest table.\n");
+	manifest__table_free(table);
+	if (manifest)
+		manifest_delete(manifest);
+	return NULL;
+}
+
+
+
+/* Manifests are built in a single pass over the parser's events, strings
+ * are copied into a pool owned by the builder so the source can be
+ * released as soon as parsing finishes. Remote names are resolved once
+ * the whole document has been seen, since remotes may follow projects,
+ * and the projects are then moved into the manifest's table. */
+
+#define MANIFEST__INCLUDE_DEPTH 16
+
+typedef struct
+{
+	const char* path;
+	const char* name;
+	const char* remote;
+	const char* remote_name;
+	const char* revision;
+	int         priority;
+	copyfile_t* copyfile;
+	unsigned    copyfile_count;
+	group_t*    group;
+	unsigned    group_count;
+	unsigned    remote_index;
+} manifest__project_t;
+
+/* An include tag is replaced by the included manifest's remotes and
+ * projects at the point where it appeared, the defaults in effect there
+ * apply to included projects which the included manifest leaves open. */
+typedef struct
+{
+	const char* name;
+	unsigned    project;
+	unsigned    remote;
+	const char* default_revision;
+	const char* default_remote;
+} manifest__include_t;
+
+typedef struct
+{
+	const char* path;
+	uint64_t    hash;
+} manifest__dependency_t;
+
+typedef struct manifest__builder_s
+{
+	strpool_t*   strings;
+	remote_t*    remote;
+	unsigned     remote_count;
+	unsigned     remote_capacity;
+	manifest__project_t*   project;
+	unsigned     project_count;
+	unsigned     project_capacity;
+	const char** default_remote;
+	unsigned     default_remote_count;
+	const char*  default_revision;
+	manifest__include_t*    include;
+	unsigned     include_count;
+	unsigned     include_capacity;
+	manifest__dependency_t* dependency;
+	unsigned     dependency_count;
+	const char*  include_dir;
+	const char*  cache_dir;
+	unsigned     include_depth;
+	const char*  include_path;
+	const struct manifest__builder_s* include_parent;
+	struct manifest__builder_s*       include_child;
+	const char*  source_path;
+	uint64_t     source_hash;
+	long int     threads;
+	unsigned     depth;
+	unsigned     manifest_count;
+	bool         in_project;
+	bool         fragment;
+	bool         included;
+	bool         quiet;
+	bool         error;
+} manifest__builder_t;
+
+static void manifest__builder_error(
+	manifest__builder_t* builder, const char* format, ...)
+{
+	if (builder->quiet)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+/* Tag and attribute names are interned as atoms while parsing, each tag's
+ * fields are then gathered into a table indexed by atom so handlers look
+ * attributes up by index rather than by comparing names. */
+
+typedef enum
+{
+	MANIFEST__ATOM_MANIFEST,
+	MANIFEST__ATOM_REMOTE,
+	MANIFEST__ATOM_DEFAULT,
+	MANIFEST__ATOM_PROJECT,
+	MANIFEST__ATOM_COPYFILE,
+	MANIFEST__ATOM_INCLUDE,
+	MANIFEST__ATOM_NAME,
+	MANIFEST__ATOM_FETCH,
+	MANIFEST__ATOM_PATH,
+	MANIFEST__ATOM_REVISION,
+	MANIFEST__ATOM_PRIORITY,
+	MANIFEST__ATOM_GROUPS,
+	MANIFEST__ATOM_SYNC_J,
+	MANIFEST__ATOM_SRC,
+	MANIFEST__ATOM_DEST,
+
+	MANIFEST__ATOM_COUNT
+} manifest__atom_t;
+
+static manifest__atom_t manifest__atom(const char* name, unsigned size)
+{
+	/* Known names are told apart by length first,
+	 * so at most three comparisons are made. */
+	switch (size)
+	{
+		case 3:
+			if (memcmp(name, "src", 3) == 0)
+				return MANIFEST__ATOM_SRC;
+			break;
+		case 4:
+			if (memcmp(name, "name", 4) == 0)
+				return MANIFEST__ATOM_NAME;
+			if (memcmp(name, "path", 4) == 0)
+				return MANIFEST__ATOM_PATH;
+			if (memcmp(name, "dest", 4) == 0)
+				return MANIFEST__ATOM_DEST;
+			break;
+		case 5:
+			if (memcmp(name, "fetch", 5) == 0)
+				return MANIFEST__ATOM_FETCH;
+			break;
+		case 6:
+			if (memcmp(name, "remote", 6) == 0)
+				return MANIFEST__ATOM_REMOTE;
+			if (memcmp(name, "groups", 6) == 0)
+				return MANIFEST__ATOM_GROUPS;
+			if (memcmp(name, "sync-j", 6) == 0)
+				return MANIFEST__ATOM_SYNC_J;
+			break;
+		case 7:
+			if (memcmp(name, "project", 7) == 0)
+				return MANIFEST__ATOM_PROJECT;
+			if (memcmp(name, "default", 7) == 0)
+				return MANIFEST__ATOM_DEFAULT;
+			if (memcmp(name, "include", 7) == 0)
+				return MANIFEST__ATOM_INCLUDE;
+			break;
+		case 8:
+			/* Four names share this length, their first letters differ. */
+			switch (name[0])
+			{
+				case 'r':
+					if (memcmp(name, "revision", 8) == 0)
+						return MANIFEST__ATOM_REVISION;
+					break;
+				case 'c':
+					if (memcmp(name, "copyfile", 8) == 0)
+						return MANIFEST__ATOM_COPYFILE;
+					break;
+				case 'm':
+					if (memcmp(name, "manifest", 8) == 0)
+						return MANIFEST__ATOM_MANIFEST;
+					break;
+				case 'p':
+					if (memcmp(name, "priority", 8) == 0)
+						return MANIFEST__ATOM_PRIORITY;
+					break;
+				default:
+					break;
+			}
+			break;
+		default:
+			break;
+	}
+
+	return MANIFEST__ATOM_COUNT;
+}
+
+static void manifest__attr_table(
+	xml_field_t* field, unsigned field_count,
+	xml_field_t** attr)
+{
+	unsigned i;
+	for (i = 0; i < MANIFEST__ATOM_COUNT; i++)
+		attr[i] = NULL;
+
+	/* The first occurrence of a repeated attribute wins. */
+	for (i = 0; i < field_count; i++)
+	{
+		manifest__atom_t atom = manifest__atom(
+			field[i].name, field[i].name_size);
+		if ((atom < MANIFEST__ATOM_COUNT) && !attr[atom])
+			attr[atom] = &field[i];
+	}
+}
+
+static bool manifest__attr(
+	manifest__builder_t* builder,
+	xml_field_t** attr, manifest__atom_t atom,
+	const char** value)
+{
+	*value = NULL;
+	if (!attr[atom])
+		return true;
+
+	*value = strpool_add(builder->strings,
+		attr[atom]->data, attr[atom]->data_size);
+	if (!*value)
+	{
+		manifest__builder_error(builder,
+			"Error: Failed to store manifest string.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool manifest__builder_remote(
+	manifest__builder_t* builder,
+	xml_field_t** attr)
+{
+	if (builder->remote_count >= builder->remote_capacity)
+	{
+		unsigned capacity = (builder->remote_capacity
+			? (builder->remote_capacity << 1) : 4);
+		remote_t* nremote = (remote_t*)realloc(
+			builder->remote, (capacity * sizeof(remote_t)));
+		if (!nremote) return false;
+		builder->remote = nremote;
+		builder->remote_capacity = capacity;
+	}
+
+	remote_t* remote = &builder->remote[builder->remote_count];
+	if (!manifest__attr(builder, attr, MANIFEST__ATOM_NAME, &remote->name)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_FETCH, &remote->fetch))
+		return false;
+
+	if (!remote->name || !remote->fetch)
+	{
+		manifest__builder_error(builder,
+			"Error: Missing 'name' or 'fetch' field in remote tag.\n");
+		return false;
+	}
+
+	builder->remote_count++;
+	return true;
+}
+
+static bool manifest__builder_default(
+	manifest__builder_t* builder,
+	xml_field_t** attr)
+{
+	const char* nrevision;
+	const char* sync_j;
+	const char* nremote;
+	if (!manifest__attr(builder, attr, MANIFEST__ATOM_REVISION, &nrevision)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_SYNC_J, &sync_j)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_REMOTE, &nremote))
+		return false;
+
+	if (nrevision)
+		builder->default_revision = nrevision;
+
+	if (sync_j)
+	{
+		long int threads = strtol(sync_j, NULL, 0);
+		if (threads > 0)
+			builder->threads = threads;
+	}
+
+	if (nremote)
+	{
+		const char** ndefault_remote = (const char**)realloc(
+			builder->default_remote,
+			((builder->default_remote_count + 1) * sizeof(const char*)));
+		if (!ndefault_remote) return false;
+		builder->default_remote = ndefault_remote;
+		builder->default_remote[builder->default_remote_count++] = nremote;
+	}
+
+	return true;
+}
+
+static bool manifest__builder_project(
+	manifest__builder_t* builder,
+	xml_field_t** attr)
+{
+	if (builder->project_count >= builder->project_capacity)
+	{
+		unsigned capacity = (builder->project_capacity
+			? (builder->project_capacity << 1) : 64);
+		manifest__project_t* nproject = (manifest__project_t*)realloc(
+			builder->project, (capacity * sizeof(manifest__project_t)));
+		if (!nproject) return false;
+		builder->project = nproject;
+		builder->project_capacity = capacity;
+	}
+
+	manifest__project_t* project = &builder->project[builder->project_count];
+	project->copyfile_count = 0;
+	project->copyfile = NULL;
+	project->group_count = 0;
+	project->group = NULL;
+
+	/* Until remotes are resolved, remote holds the name given in the
+	 * project tag and remote_name the default remote at this point. */
+	project->remote_name = (builder->default_remote_count > 0
+		? builder->default_remote[builder->default_remote_count - 1]
+		: NULL);
+
+	const char* groups;
+	const char* priority;
+	if (!manifest__attr(builder, attr, MANIFEST__ATOM_PATH, &project->path)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_NAME, &project->name)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_REMOTE, &project->remote)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_REVISION, &project->revision)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_PRIORITY, &priority)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_GROUPS, &groups))
+		return false;
+
+	if (!project->revision)
+		project->revision = builder->default_revision;
+
+	project->priority = 0;
+	if (priority)
+	{
+		char* end;
+		errno = 0;
+		long int value = strtol(priority, &end, 10);
+		if ((end == priority) || (*end != '\0') || (errno != 0)
+			|| (value < INT32_MIN) || (value > INT32_MAX))
+		{
+			manifest__builder_error(builder,
+				"Error: Invalid project priority '%s'.\n", priority);
+			return false;
+		}
+		project->priority = value;
+	}
+
+	/* Counted before anything that can fail so the builder
+	 * frees this project's lists on error. */
+	builder->project_count++;
+
+	if (groups)
+	{
+		if (!group_list_parse(groups, false,
+			&project->group, &project->group_count))
+		{
+			manifest__builder_error(builder,
+				"Error: Failed to parse group list.\n");
+			return false;
+		}
+	}
+
+	/* Fragments and included manifests take their defaults from the
+	 * builder they're merged into. */
+	if (!project->path
+		|| !project->name
+		|| (!project->revision && !builder->fragment && !builder->included))
+	{
+		manifest__builder_error(builder,
+			"Error: Invalid project tag, missing field.\n");
+		return false;
+	}
+
+	return true;
+}
+
+static bool manifest__builder_copyfile(
+	manifest__builder_t* builder,
+	xml_field_t** attr)
+{
+	manifest__project_t* project = &builder->project[builder->project_count - 1];
+
+	copyfile_t* ncopyfile
+		= (copyfile_t*)realloc(project->copyfile,
+			(project->copyfile_count + 1) * sizeof(copyfile_t));
+	if (!ncopyfile)
+	{
+		manifest__builder_error(builder,
+			"Error: Failed to add copyfile to project.\n");
+		return false;
+	}
+	project->copyfile = ncopyfile;
+
+	copyfile_t* copyfile = &project->copyfile[project->copyfile_count];
+	if (!manifest__attr(builder, attr, MANIFEST__ATOM_SRC, &copyfile->source)
+		|| !manifest__attr(builder, attr, MANIFEST__ATOM_DEST, &copyfile->dest))
+		return false;
+
+	if (!copyfile->source)
+	{
+		manifest__builder_error(builder,
+			"Error: Invalid copyfile tag, missing source field.\n");
+		return false;
+	}
+
+	if (!copyfile->dest)
+	{
+		manifest__builder_error(builder,
+			"Error: Invalid copyfile tag, missing dest field.\n");
+		return false;
+	}
+
+	project->copyfile_count++;
+	return true;
+}
+
+static bool manifest__builder_include_tag(
+	manifest__builder_t* builder,
+	xml_field_t** attr)
+{
+	if (builder->include_count >= builder->include_capacity)
+	{
+		unsigned capacity = (builder->include_capacity
+			? (builder->include_capacity << 1) : 4);
+		manifest__include_t* ninclude = (manifest__include_t*)realloc(
+			builder->include, (capacity * sizeof(manifest__include_t)));
+		if (!ninclude) return false;
+		builder->include = ninclude;
+		builder->include_capacity = capacity;
+	}
+
+	manifest__include_t* include = &builder->include[builder->include_count];
+	if (!manifest__attr(builder, attr, MANIFEST__ATOM_NAME, &include->name))
+		return false;
+
+	if (!include->name)
+	{
+		manifest__builder_error(builder,
+			"Error: Missing 'name' field in include tag.\n");
+		return false;
+	}
+
+	include->project = builder->project_count;
+	include->remote  = builder->remote_count;
+	include->default_revision = builder->default_revision;
+	include->default_remote = (builder->default_remote_count > 0
+		? builder->default_remote[builder->default_remote_count - 1]
+		: NULL);
+
+	builder->include_count++;
+	return true;
+}
+
+static bool manifest__builder_open(
+	void* context, const char* name, unsigned name_size,
+	xml_field_t* field, unsigned field_count)
+{
+	manifest__builder_t* builder = (manifest__builder_t*)context;
+
+	if (builder->depth++ > 2)
+		return true;
+
+	manifest__atom_t tag = manifest__atom(name, name_size);
+
+	xml_field_t* attr[MANIFEST__ATOM_COUNT];
+	manifest__attr_table(field, field_count, attr);
+
+	bool success = true;
+	switch (builder->depth - 1)
+	{
+		case 0:
+			if ((builder->manifest_count++ > 0)
+				|| (tag != MANIFEST__ATOM_MANIFEST))
+			{
+				manifest__builder_error(builder,
+					"Error: No manifest in XML file.\n");
+				success = false;
+			}
+			break;
+
+		case 1:
+			if (builder->fragment && (tag != MANIFEST__ATOM_PROJECT))
+			{
+				success = false;
+				break;
+			}
+
+			switch (tag)
+			{
+				case MANIFEST__ATOM_REMOTE:
+					success = manifest__builder_remote(builder, attr);
+					break;
+				case MANIFEST__ATOM_DEFAULT:
+					success = manifest__builder_default(builder, attr);
+					break;
+				case MANIFEST__ATOM_PROJECT:
+					success = manifest__builder_project(builder, attr);
+					builder->in_project = true;
+					break;
+				case MANIFEST__ATOM_INCLUDE:
+					success = manifest__builder_include_tag(builder, attr);
+					break;
+				default:
+					manifest__builder_error(builder,
+						"Error: Unrecognized tag '%.*s' in manifest.\n",
+						name_size, name);
+					success = false;
+					break;
+			}
+			break;
+
+		default:
+			if (!builder->in_project)
+				break;
+
+			if (tag == MANIFEST__ATOM_COPYFILE)
+			{
+				success = manifest__builder_copyfile(builder, attr);
+			}
+			else
+			{
+				/* A quiet builder can't report the warning, so the
+				 * manifest is left to be parsed again serially. */
+				manifest__builder_error(builder,
+					"Warning: Unknown project sub-tag '%.*s'.\n",
+					name_size, name);
+				success = !builder->quiet;
+			}
+			break;
+	}
+
+	builder->error |= !success;
+	return success;
+}
+
+static bool manifest__builder_close(
+	void* context, const char* name, unsigned name_size)
+{
+	(void)name;
+	(void)name_size;
+
+	manifest__builder_t* builder = (manifest__builder_t*)context;
+	if (--builder->depth == 1)
+		builder->in_project = false;
+	return true;
+}
+
+static const xml_handler_t manifest__builder_handler =
+{
+	.tag_open  = manifest__builder_open,
+	.tag_close = manifest__builder_close,
+};
+
+static remote_t* manifest__builder_find_remote(
+	manifest__builder_t* builder, const hash_table_t* index, const char* name)
+{
+	uint32_t r;
+	if (!hash_table_find(index, name, strlen(name),
+		manifest__key_remote, builder->remote, false, &r))
+		return NULL;
+	return &builder->remote[r];
+}
+
+static bool manifest__builder_resolve(manifest__builder_t* builder)
+{
+	hash_table_t index;
+	if (!hash_table_build(&index, builder->remote_count,
+		manifest__key_remote, builder->remote))
+		return false;
+
+	bool success = false;
+
+	unsigned i;
+	for (i = 0; i < builder->default_remote_count; i++)
+	{
+		if (!manifest__builder_find_remote(
+			builder, &index, builder->default_remote[i]))
+		{
+			manifest__builder_error(builder,
+				"Error: Invalid remote name '%s' in default tag.\n",
+				builder->default_remote[i]);
+			goto manifest__builder_resolve_end;
+		}
+	}
+
+	for (i = 0; i < builder->project_count; i++)
+	{
+		manifest__project_t* project = &builder->project[i];
+
+		remote_t* remote;
+		if (project->remote)
+		{
+			remote = manifest__builder_find_remote(
+				builder, &index, project->remote);
+			if (!remote)
+			{
+				manifest__builder_error(builder,
+					"Error: Invalid remote name '%s' in project tag.\n",
+					project->remote);
+				goto manifest__builder_resolve_end;
+			}
+		}
+		else if (project->remote_name)
+		{
+			remote = manifest__builder_find_remote(
+				builder, &index, project->remote_name);
+		}
+		else
+		{
+			remote = (builder->remote_count > 0
+				? &builder->remote[0] : NULL);
+		}
+
+		if (!remote)
+		{
+			manifest__builder_error(builder,
+				"Error: Invalid project tag, missing field.\n");
+			goto manifest__builder_resolve_end;
+		}
+
+		project->remote_index = remote - builder->remote;
+	}
+
+	success = true;
+
+manifest__builder_resolve_end:
+	hash_table_delete(&index);
+	return success;
+}
+
+static void manifest__builder_free(manifest__builder_t* builder)
+{
+	unsigned i;
+	for (i = 0; i < builder->project_count; i++)
+	{
+		free(builder->project[i].copyfile);
+		free(builder->project[i].group);
+	}
+
+	free(builder->project);
+	free(builder->remote);
+	free(builder->default_remote);
+	free(builder->include);
+	free(builder->dependency);
+	strpool_delete(builder->strings);
+}
+
+static bool manifest__builder_init(manifest__builder_t* builder)
+{
+	memset(builder, 0x00, sizeof(manifest__builder_t));
+	builder->threads = 1;
+
+	builder->strings = strpool_create();
+	return (builder->strings != NULL);
+}
+
+/* Each included manifest is cached under the cache directory as it was
+ * parsed, before its own includes are resolved, keyed by its path and
+ * checked against a hash of its content. So when one fragment changes,
+ * only that fragment is parsed again. Strings are stored once in a table
+ * behind the records, and a missing string is stored as UINT32_MAX. */
+
+#define MANIFEST__FRAGMENT_MAGIC   "FREPOMF"
+#define MANIFEST__FRAGMENT_VERSION 2
+
+typedef struct
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t string_size;
+	uint64_t hash;
+	uint32_t path;
+	uint32_t default_revision;
+	uint32_t remote_count;
+	uint32_t default_remote_count;
+	uint32_t project_count;
+	uint32_t copyfile_count;
+	uint32_t group_count;
+	uint32_t include_count;
+} manifest__fragment_header_t;
+
+static void manifest__fragment_path(
+	const manifest__builder_t* builder, char* path)
+{
+	sprintf(path, "%s/%016llx.include", builder->cache_dir,
+		(unsigned long long)hash_data(builder->source_path,
+			strlen(builder->source_path), 0));
+}
+
+static void manifest__fragment_string(
+	manifest__buffer_t* record, manifest__table_t* strings,
+	const char* string)
+{
+	uint32_t offset = (string
+		? manifest__table_string(strings, string, strlen(string), true)
+		: UINT32_MAX);
+	manifest__buffer_write(record, &offset, sizeof(offset));
+}
+
+static void manifest__fragment_count(
+	manifest__buffer_t* record, uint32_t count)
+{
+	manifest__buffer_write(record, &count, sizeof(count));
+}
+
+static void manifest__fragment_write(const manifest__builder_t* builder)
+{
+	if (!builder->cache_dir)
+		return;
+
+	manifest__table_t strings;
+	manifest__table_init(&strings);
+	manifest__buffer_t record = { NULL, 0, 0, false };
+
+	manifest__fragment_header_t header;
+	memset(&header, 0x00, sizeof(header));
+	memcpy(header.magic, MANIFEST__FRAGMENT_MAGIC, sizeof(header.magic));
+	header.version = MANIFEST__FRAGMENT_VERSION;
+	header.hash    = builder->source_hash;
+	header.path    = manifest__table_string(&strings, builder->source_path,
+		strlen(builder->source_path), false);
+	header.default_revision = (builder->default_revision
+		? manifest__table_string(&strings, builder->default_revision,
+			strlen(builder->default_revision), true)
+		: UINT32_MAX);
+	header.remote_count         = builder->remote_count;
+	header.default_remote_count = builder->default_remote_count;
+	header.project_count        = builder->project_count;
+	header.include_count        = builder->include_count;
+
+	unsigned i, j;
+	for (i = 0; i < builder->remote_count; i++)
+	{
+		manifest__fragment_string(&record, &strings, builder->remote[i].name);
+		manifest__fragment_string(&record, &strings, builder->remote[i].fetch);
+	}
+
+	for (i = 0; i < builder->default_remote_count; i++)
+		manifest__fragment_string(&record, &strings, builder->default_remote[i]);
+
+	for (i = 0; i < builder->project_count; i++)
+	{
+		const manifest__project_t* project = &builder->project[i];
+		manifest__fragment_string(&record, &strings, project->path);
+		manifest__fragment_string(&record, &strings, project->name);
+		manifest__fragment_string(&record, &strings, project->remote);
+		manifest__fragment_string(&record, &strings, project->remote_name);
+		manifest__fragment_string(&record, &strings, project->revision);
+		manifest__fragment_count(&record, project->copyfile_count);
+		manifest__fragment_count(&record, project->group_count);
+		manifest__fragment_count(&record, (uint32_t)project->priority);
+		header.copyfile_count += project->copyfile_count;
+		header.group_count    += project->group_count;
+	}
+
+	for (i = 0; i < builder->project_count; i++)
+	{
+		const manifest__project_t* project = &builder->project[i];
+		for (j = 0; j < project->copyfile_count; j++)
+		{
+			manifest__fragment_string(&record, &strings,
+				project->copyfile[j].source);
+			manifest__fragment_string(&record, &strings,
+				project->copyfile[j].dest);
+		}
+	}
+
+	for (i = 0; i < builder->project_count; i++)
+	{
+		const manifest__project_t* project = &builder->project[i];
+		for (j = 0; j < project->group_count; j++)
+		{
+			manifest__fragment_count(&record, manifest__table_string(
+				&strings, project->group[j].name, project->group[j].size,
+				true));
+			manifest__fragment_count(&record, project->group[j].exclude);
+		}
+	}
+
+	for (i = 0; i < builder->include_count; i++)
+	{
+		const manifest__include_t* include = &builder->include[i];
+		manifest__fragment_string(&record, &strings, include->name);
+		manifest__fragment_count(&record, include->project);
+		manifest__fragment_count(&record, include->remote);
+		manifest__fragment_string(&record, &strings, include->default_revision);
+		manifest__fragment_string(&record, &strings, include->default_remote);
+	}
+
+	header.string_size = strings.string.size;
+
+	manifest__buffer_t image = { NULL, 0, 0, false };
+	manifest__buffer_write(&image, &header, sizeof(header));
+	manifest__buffer_write(&image, record.data, record.size);
+	manifest__buffer_write(&image, strings.string.data, strings.string.size);
+
+	/* The cache is only an optimization, so failing to write it isn't an
+	 * error and the fragment is simply parsed again next time. */
+	if (!image.error && !record.error && !strings.string.error)
+	{
+		char path[strlen(builder->cache_dir) + 32];
+		manifest__fragment_path(builder, path);
+		if ((mkdir(builder->cache_dir, (S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)) == 0)
+			|| (errno == EEXIST))
+			manifest__file_replace(path, image.data, image.size);
+	}
+
+	free(image.data);
+	free(record.data);
+	manifest__table_free(&strings);
+}
+
+static bool manifest__fragment_offsets(
+	const uint32_t* record, size_t count, size_t stride, unsigned field,
+	uint32_t limit, bool optional)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		uint32_t offset = record[(i * stride) + field];
+		if ((offset >= limit) && (!optional || (offset != UINT32_MAX)))
+			return false;
+	}
+	return true;
+}
+
+static const char* manifest__fragment_copy(
+	manifest__builder_t* builder, const char* string, uint32_t offset)
+{
+	if (offset == UINT32_MAX)
+		return NULL;
+
+	const char* copy = strpool_add(builder->strings,
+		&string[offset], strlen(&string[offset]));
+	if (!copy)
+		builder->error = true;
+	return copy;
+}
+
+/* Fills an empty builder from the fragment cache, an invalid or stale
+ * entry is ignored and the builder is left untouched. If the entry was
+ * valid but the builder couldn't be filled its error flag is set. */
+static bool manifest__fragment_read(manifest__builder_t* builder)
+{
+	if (!builder->cache_dir)
+		return false;
+
+	char path[strlen(builder->cache_dir) + 32];
+	manifest__fragment_path(builder, path);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat fragment_stat;
+	if ((fstat(fd, &fragment_stat) < 0)
+		|| ((size_t)fragment_stat.st_size
+			< sizeof(manifest__fragment_header_t)))
+	{
+		close(fd);
+		return false;
+	}
+
+	size_t size = fragment_stat.st_size;
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	const manifest__fragment_header_t* header
+		= (const manifest__fragment_header_t*)data;
+	const uint32_t* remote = (const uint32_t*)&header[1];
+	const uint32_t* default_remote = &remote[(size_t)header->remote_count * 2];
+	const uint32_t* project
+		= &default_remote[header->default_remote_count];
+	const uint32_t* copyfile = &project[(size_t)header->project_count * 8];
+	const uint32_t* group = &copyfile[(size_t)header->copyfile_count * 2];
+	const uint32_t* include = &group[(size_t)header->group_count * 2];
+	const char* string = (const char*)&include[
+		(size_t)header->include_count * 5];
+	uint32_t string_size = header->string_size;
+
+	bool valid = (memcmp(header->magic, MANIFEST__FRAGMENT_MAGIC,
+			sizeof(header->magic)) == 0)
+		&& (header->version == MANIFEST__FRAGMENT_VERSION)
+		&& (header->hash == builder->source_hash)
+		&& (((uintptr_t)string - (uintptr_t)data) + string_size == size)
+		&& (string_size > 0) && (string[string_size - 1] == '\0')
+		&& (header->path < string_size)
+		&& (strcmp(&string[header->path], builder->source_path) == 0)
+		&& ((header->default_revision < string_size)
+			|| (header->default_revision == UINT32_MAX))
+		&& manifest__fragment_offsets(remote,
+			((size_t)header->remote_count * 2), 1, 0, string_size, false)
+		&& manifest__fragment_offsets(default_remote,
+			header->default_remote_count, 1, 0, string_size, false)
+		&& manifest__fragment_offsets(project,
+			header->project_count, 8, 0, string_size, false)
+		&& manifest__fragment_offsets(project,
+			header->project_count, 8, 1, string_size, false)
+		&& manifest__fragment_offsets(project,
+			header->project_count, 8, 2, string_size, true)
+		&& manifest__fragment_offsets(project,
+			header->project_count, 8, 3, string_size, true)
+		&& manifest__fragment_offsets(project,
+			header->project_count, 8, 4, string_size, true)
+		&& manifest__fragment_offsets(copyfile,
+			((size_t)header->copyfile_count * 2), 1, 0, string_size, false)
+		&& manifest__fragment_offsets(group,
+			header->group_count, 2, 0, string_size, false)
+		&& manifest__fragment_offsets(include,
+			header->include_count, 5, 0, string_size, false)
+		&& manifest__fragment_offsets(include,
+			header->include_count, 5, 3, string_size, true)
+		&& manifest__fragment_offsets(include,
+			header->include_count, 5, 4, string_size, true);
+
+	size_t copyfile_count = 0, group_count = 0;
+	unsigned i, j;
+	for (i = 0; valid && (i < header->project_count); i++)
+	{
+		copyfile_count += project[(i * 8) + 5];
+		group_count    += project[(i * 8) + 6];
+	}
+	valid = valid
+		&& (copyfile_count == header->copyfile_count)
+		&& (group_count == header->group_count);
+
+	for (i = 0; valid && (i < header->include_count); i++)
+	{
+		const uint32_t* record = &include[i * 5];
+		valid = (record[1] <= header->project_count)
+			&& (record[2] <= header->remote_count)
+			&& ((i == 0) || ((record[1] >= record[-4])
+				&& (record[2] >= record[-3])));
+	}
+
+	if (!valid)
+	{
+		munmap(data, size);
+		return false;
+	}
+
+	builder->remote = (remote_t*)malloc(
+		(header->remote_count + 1) * sizeof(remote_t));
+	builder->default_remote = (const char**)malloc(
+		(header->default_remote_count + 1) * sizeof(const char*));
+	builder->project = (manifest__project_t*)malloc(
+		(header->project_count + 1) * sizeof(manifest__project_t));
+	builder->include = (manifest__include_t*)malloc(
+		(header->include_count + 1) * sizeof(manifest__include_t));
+	if (!builder->remote || !builder->default_remote
+		|| !builder->project || !builder->include)
+	{
+		builder->error = true;
+		munmap(data, size);
+		return false;
+	}
+	builder->remote_capacity  = header->remote_count + 1;
+	builder->project_capacity = header->project_count + 1;
+	builder->include_capacity = header->include_count + 1;
+
+	builder->default_revision = manifest__fragment_copy(
+		builder, string, header->default_revision);
+
+	for (i = 0; i < header->remote_count; i++)
+	{
+		builder->remote[i].name = manifest__fragment_copy(
+			builder, string, remote[i * 2]);
+		builder->remote[i].fetch = manifest__fragment_copy(
+			builder, string, remote[(i * 2) + 1]);
+	}
+	builder->remote_count = header->remote_count;
+
+	for (i = 0; i < header->default_remote_count; i++)
+	{
+		builder->default_remote[i] = manifest__fragment_copy(
+			builder, string, default_remote[i]);
+	}
+	builder->default_remote_count = header->default_remote_count;
+
+	for (i = 0; !builder->error && (i < header->project_count); i++)
+	{
+		const uint32_t* record = &project[i * 8];
+		manifest__project_t* p = &builder->project[i];
+		p->path        = manifest__fragment_copy(builder, string, record[0]);
+		p->name        = manifest__fragment_copy(builder, string, record[1]);
+		p->remote      = manifest__fragment_copy(builder, string, record[2]);
+		p->remote_name = manifest__fragment_copy(builder, string, record[3]);
+		p->revision    = manifest__fragment_copy(builder, string, record[4]);
+		p->copyfile_count = record[5];
+		p->group_count    = record[6];
+		p->priority       = (int32_t)record[7];
+		p->copyfile = (copyfile_t*)malloc(
+			(p->copyfile_count + 1) * sizeof(copyfile_t));
+		p->group = (group_t*)malloc((p->group_count + 1) * sizeof(group_t));
+		builder->project_count++;
+		if (!p->copyfile || !p->group)
+		{
+			builder->error = true;
+			break;
+		}
+
+		for (j = 0; j < p->copyfile_count; j++, copyfile += 2)
+		{
+			p->copyfile[j].source = manifest__fragment_copy(
+				builder, string, copyfile[0]);
+			p->copyfile[j].dest = manifest__fragment_copy(
+				builder, string, copyfile[1]);
+		}
+
+		for (j = 0; j < p->group_count; j++, group += 2)
+		{
+			p->group[j].name = manifest__fragment_copy(
+				builder, string, group[0]);
+			p->group[j].size = strlen(&string[group[0]]);
+			p->group[j].exclude = (group[1] != 0);
+		}
+	}
+
+	for (i = 0; i < header->include_count; i++)
+	{
+		const uint32_t* record = &include[i * 5];
+		manifest__include_t* inc = &builder->include[i];
+		inc->name     = manifest__fragment_copy(builder, string, record[0]);
+		inc->project  = record[1];
+		inc->remote   = record[2];
+		inc->default_revision
+			= manifest__fragment_copy(builder, string, record[3]);
+		inc->default_remote
+			= manifest__fragment_copy(builder, string, record[4]);
+	}
+	builder->include_count = header->include_count;
+	builder->manifest_count = 1;
+
+	munmap(data, size);
+	return !builder->error;
+}
+
+
+
+/* Includes name files in the include directory, usually the manifest
+ * repository. Every manifest in the tree of includes is loaded by one
+ * pool of workers: loading a manifest queues its own includes for any
+ * idle worker, each taken from the fragment cache when it's unchanged.
+ * The tree is then merged from the leaves up. Each loaded file's path
+ * and content hash is kept so that a cached manifest can tell when it's
+ * out of date. A manifest which includes itself, directly or through
+ * others, is caught by comparing its resolved path with those of the
+ * manifests it was included through. */
+
+typedef struct
+{
+	manifest__builder_t** queue;
+	unsigned              count;
+	unsigned              capacity;
+	unsigned              next;
+	unsigned              busy;
+	bool                  failed;
+	pthread_mutex_t       mutex;
+	pthread_cond_t        cond;
+} manifest__include_loader_t;
+
+static bool manifest__include_load(manifest__builder_t* child)
+{
+	size_t size, mapped;
+	char* source = xml_source_map(child->source_path, &size, &mapped);
+	if (!source)
+	{
+		manifest__builder_error(child,
+			"Error: Failed to read included manifest '%s'.\n",
+			child->source_path);
+		return false;
+	}
+	child->source_hash = hash_data(source, size, 0);
+
+	bool success = manifest__fragment_read(child);
+	if (!success && !child->error)
+	{
+		success = xml_parse(source, size, &manifest__builder_handler, child)
+			&& (child->manifest_count == 1);
+		if (success)
+			manifest__fragment_write(child);
+	}
+	munmap(source, mapped);
+
+	if (!success)
+	{
+		manifest__builder_error(child,
+			"Error: Failed to parse included manifest '%s'.\n",
+			child->source_path);
+		return false;
+	}
+
+	if ((child->include_count > 0)
+		&& (child->include_depth >= MANIFEST__INCLUDE_DEPTH))
+	{
+		manifest__builder_error(child,
+			"Error: Manifest includes are nested too deeply.\n");
+		return false;
+	}
+
+	return true;
+}
+
+/* Creates a builder for each of a loaded manifest's includes and resolves
+ * their paths, so that a cycle is found before anything is queued. */
+static bool manifest__include_children(
+	manifest__builder_t* builder, const char** cycle)
+{
+	unsigned count = builder->include_count;
+	builder->include_child = (manifest__builder_t*)calloc(
+		count, sizeof(manifest__builder_t));
+	if (!builder->include_child)
+		return false;
+
+	unsigned i;
+	for (i = 0; i < count; i++)
+	{
+		manifest__builder_t* child = &builder->include_child[i];
+		if (!manifest__builder_init(child))
+			return false;
+		child->include_dir    = builder->include_dir;
+		child->cache_dir      = builder->cache_dir;
+		child->include_depth  = builder->include_depth + 1;
+		child->include_parent = builder;
+		child->included       = true;
+		child->quiet          = builder->quiet;
+
+		const char* name = builder->include[i].name;
+		char path[strlen(builder->include_dir) + strlen(name) + 2];
+		sprintf(path, "%s/%s", builder->include_dir, name);
+
+		child->source_path = strpool_add(child->strings, path, strlen(path));
+		if (!child->source_path)
+			return false;
+
+		char resolved[PATH_MAX];
+		if (!realpath(path, resolved))
+			continue;
+		child->include_path = strpool_add(
+			child->strings, resolved, strlen(resolved));
+		if (!child->include_path)
+			return false;
+
+		const manifest__builder_t* parent;
+		for (parent = builder; parent; parent = parent->include_parent)
+		{
+			if (parent->include_path
+				&& (strcmp(parent->include_path, resolved) == 0))
+			{
+				*cycle = child->include_path;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool manifest__include_queue(
+	manifest__include_loader_t* loader, manifest__builder_t* builder)
+{
+	unsigned count = loader->count + builder->include_count;
+	if (count > loader->capacity)
+	{
+		unsigned capacity = (loader->capacity ? loader->capacity : 16);
+		while (capacity < count)
+			capacity <<= 1;
+		manifest__builder_t** nqueue = (manifest__builder_t**)realloc(
+			loader->queue, (capacity * sizeof(manifest__builder_t*)));
+		if (!nqueue) return false;
+		loader->queue = nqueue;
+		loader->capacity = capacity;
+	}
+
+	unsigned i;
+	for (i = 0; i < builder->include_count; i++)
+		loader->queue[loader->count++] = &builder->include_child[i];
+	return true;
+}
+
+/* Each worker takes queued manifests until the queue is empty and no
+ * other worker is still loading one which might queue more. The first
+ * failure stops every worker, so a cycle is reported only once. */
+static bool manifest__include_worker(void* context, unsigned index)
+{
+	(void)index;
+
+	manifest__include_loader_t* loader
+		= (manifest__include_loader_t*)context;
+
+	pthread_mutex_lock(&loader->mutex);
+	while (true)
+	{
+		while (!loader->failed && (loader->next >= loader->count)
+			&& (loader->busy > 0))
+			pthread_cond_wait(&loader->cond, &loader->mutex);
+		if (loader->failed || (loader->next >= loader->count))
+			break;
+
+		manifest__builder_t* child = loader->queue[loader->next++];
+		loader->busy++;
+		pthread_mutex_unlock(&loader->mutex);
+
+		const char* cycle = NULL;
+		bool success = manifest__include_load(child)
+			&& ((child->include_count == 0)
+				|| manifest__include_children(child, &cycle));
+
+		pthread_mutex_lock(&loader->mutex);
+		loader->busy--;
+		if (success && (child->include_count > 0))
+			success = manifest__include_queue(loader, child);
+		if (!success)
+		{
+			if (cycle && !loader->failed)
+			{
+				manifest__builder_error(child,
+					"Error: Included manifest '%s' includes itself.\n",
+					cycle);
+			}
+			loader->failed = true;
+		}
+		pthread_cond_broadcast(&loader->cond);
+	}
+	pthread_mutex_unlock(&loader->mutex);
+
+	return !loader->failed;
+}
+
+static bool manifest__include_depend(
+	manifest__builder_t* builder, const manifest__builder_t* child)
+{
+	unsigned dependency_count
+		= builder->dependency_count + child->dependency_count + 1;
+	manifest__dependency_t* ndependency = (manifest__dependency_t*)realloc(
+		builder->dependency,
+		(dependency_count * sizeof(manifest__dependency_t)));
+	if (!ndependency) return false;
+	builder->dependency = ndependency;
+
+	builder->dependency[builder->dependency_count].path = child->source_path;
+	builder->dependency[builder->dependency_count].hash = child->source_hash;
+	if (child->dependency_count > 0)
+	{
+		memcpy(&builder->dependency[builder->dependency_count + 1],
+			child->dependency,
+			(child->dependency_count * sizeof(manifest__dependency_t)));
+	}
+	builder->dependency_count = dependency_count;
+	return true;
+}
+
+static bool manifest__include_merge(
+	manifest__builder_t* builder, const manifest__include_t* include,
+	manifest__builder_t* child)
+{
+	unsigned i;
+	for (i = 0; i < child->project_count; i++)
+	{
+		manifest__project_t* project = &child->project[i];
+		if (!project->revision)
+			project->revision = include->default_revision;
+		if (!project->remote_name)
+			project->remote_name = include->default_remote;
+
+		if (!project->revision)
+		{
+			manifest__builder_error(builder,
+				"Error: Invalid project tag, missing field.\n");
+			return false;
+		}
+	}
+
+	unsigned remote_count = builder->remote_count + child->remote_count;
+	if (remote_count > builder->remote_capacity)
+	{
+		remote_t* nremote = (remote_t*)realloc(
+			builder->remote, (remote_count * sizeof(remote_t)));
+		if (!nremote) return false;
+		builder->remote = nremote;
+		builder->remote_capacity = remote_count;
+	}
+
+	unsigned project_count = builder->project_count + child->project_count;
+	if (project_count > builder->project_capacity)
+	{
+		manifest__project_t* nproject = (manifest__project_t*)realloc(
+			builder->project, (project_count * sizeof(manifest__project_t)));
+		if (!nproject) return false;
+		builder->project = nproject;
+		builder->project_capacity = project_count;
+	}
+
+	unsigned default_remote_count
+		= builder->default_remote_count + child->default_remote_count;
+	const char** ndefault_remote = (const char**)realloc(
+		builder->default_remote,
+		((default_remote_count + 1) * sizeof(const char*)));
+	if (!ndefault_remote) return false;
+	builder->default_remote = ndefault_remote;
+
+	if (child->remote_count > 0)
+	{
+		memmove(&builder->remote[include->remote + child->remote_count],
+			&builder->remote[include->remote],
+			((builder->remote_count - include->remote) * sizeof(remote_t)));
+		memcpy(&builder->remote[include->remote], child->remote,
+			(child->remote_count * sizeof(remote_t)));
+		builder->remote_count = remote_count;
+	}
+
+	if (child->project_count > 0)
+	{
+		memmove(&builder->project[include->project + child->project_count],
+			&builder->project[include->project],
+			((builder->project_count - include->project)
+				* sizeof(manifest__project_t)));
+		memcpy(&builder->project[include->project], child->project,
+			(child->project_count * sizeof(manifest__project_t)));
+		builder->project_count = project_count;
+		child->project_count = 0;
+	}
+
+	if (child->default_remote_count > 0)
+	{
+		memcpy(&builder->default_remote[builder->default_remote_count],
+			child->default_remote,
+			(child->default_remote_count * sizeof(const char*)));
+		builder->default_remote_count = default_remote_count;
+	}
+
+	strpool_merge(builder->strings, child->strings);
+	child->strings = NULL;
+	return true;
+}
+
+/* Merges every loaded include into the manifest which included it,
+ * deepest first, and releases them. */
+static bool manifest__include_resolve(
+	manifest__builder_t* builder, bool success)
+{
+	if (!builder->include_child)
+		return success;
+
+	unsigned count = builder->include_count;
+	manifest__builder_t* child = builder->include_child;
+	builder->include_child = NULL;
+
+	unsigned i;
+	for (i = 0; i < count; i++)
+	{
+		success = manifest__include_resolve(&child[i], success)
+			&& success && manifest__include_depend(builder, &child[i]);
+	}
+
+	/* Merged from the last so the positions of earlier includes hold. */
+	for (i = count; i-- > 0; )
+	{
+		if (success && !manifest__include_merge(
+			builder, &builder->include[i], &child[i]))
+			success = false;
+		manifest__builder_free(&child[i]);
+	}
+	free(child);
+
+	builder->include_count = 0;
+	return success;
+}
+
+static bool manifest__builder_include(manifest__builder_t* builder)
+{
+	if (builder->include_count == 0)
+		return true;
+
+	if (!builder->include_dir)
+	{
+		manifest__builder_error(builder,
+			"Error: Manifest includes need a manifest directory.\n");
+		return false;
+	}
+
+	long int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+
+	manifest__include_loader_t loader;
+	memset(&loader, 0x00, sizeof(loader));
+
+	const char* cycle = NULL;
+	bool success = manifest__include_children(builder, &cycle)
+		&& manifest__include_queue(&loader, builder);
+	if (cycle)
+	{
+		manifest__builder_error(builder,
+			"Error: Included manifest '%s' includes itself.\n", cycle);
+	}
+
+	if (success)
+	{
+		if ((pthread_mutex_init(&loader.mutex, NULL) != 0)
+			|| (pthread_cond_init(&loader.cond, NULL) != 0))
+			abort();
+
+		success = parallel_for(threads, threads,
+			manifest__include_worker, &loader);
+
+		pthread_cond_destroy(&loader.cond);
+		pthread_mutex_destroy(&loader.mutex);
+	}
+	free(loader.queue);
+
+	return manifest__include_resolve(builder, success);
+}
+
+static manifest_t* manifest__builder_finish(
+	manifest__builder_t* builder, bool parsed)
+{
+	if (!parsed && !builder->error)
+	{
+		manifest__builder_error(builder,
+			"Error: Failed to parse xml in manifest file.\n");
+		manifest__builder_free(builder);
+		return NULL;
+	}
+
+	if (!parsed || (builder->manifest_count == 0)
+		|| !manifest__builder_include(builder)
+		|| !manifest__builder_resolve(builder))
+	{
+		if (builder->manifest_count == 0)
+			manifest__builder_error(builder,
+				"Error: No manifest in XML file.\n");
+		manifest__builder_error(builder,
+			"Error: Failed to parse manifest from xml document.\n");
+		manifest__builder_free(builder);
+		return NULL;
+	}
+
+	manifest__table_t table;
+	manifest__table_init(&table);
+
+	unsigned i, j;
+	for (i = 0; i < builder->remote_count; i++)
+	{
+		manifest__table_remote(&table,
+			builder->remote[i].name, builder->remote[i].fetch);
+	}
+
+	for (i = 0; i < builder->project_count; i++)
+	{
+		const manifest__project_t* project = &builder->project[i];
+		manifest__table_project(&table, project->path, project->name,
+			project->revision, project->remote_index, project->priority);
+
+		for (j = 0; j < project->copyfile_count; j++)
+		{
+			manifest__table_copyfile(&table,
+				project->copyfile[j].source, project->copyfile[j].dest);
+		}
+
+		for (j = 0; j < project->group_count; j++)
+		{
+			manifest__table_group(&table,
+				project->group[j].name, project->group[j].size);
+		}
+	}
+
+	for (i = 0; i < builder->dependency_count; i++)
+	{
+		manifest__table_include(&table,
+			builder->dependency[i].path, builder->dependency[i].hash);
+	}
+
+	long int threads = builder->threads;
+	manifest__builder_free(builder);
+	return manifest__table_finish(&table, threads);
+}
+
+manifest_t* manifest_parse(char* source, size_t size)
+{
+	if (!source)
+		return NULL;
+
+	manifest__builder_t builder;
+	if (!manifest__builder_init(&builder))
+		return NULL;
+
+	return manifest__builder_finish(&builder,
+		xml_parse(source, size, &manifest__builder_handler, &builder));
+}
+
+manifest_t* manifest_parse_string(char* source)
+{
+	if (!source)
+		return NULL;
+
+	manifest_t* manifest
+		= manifest_parse(source, strlen(source));
+	free(source);
+	return manifest;
+}
+
+/* Large manifests are split on top-level project tags into chunks which
+ * are parsed on several threads. Chunks after the first may only hold
+ * projects, and every chunk is parsed quietly; anything unusual, from a
+ * boundary that wasn't really between two projects to a warning that
+ * would have to be printed, makes the caller parse the file serially
+ * instead, so the result is always the same as the serial parser's. */
+
+#define MANIFEST__CHUNK_SIZE  (1 << 20)
+#define MANIFEST__CHUNK_COUNT 64
+#define MANIFEST__CHUNK_ALIGN 32
+
+typedef struct
+{
+	char*                source;
+	size_t*              start;
+	size_t*              size;
+	manifest__builder_t* builder;
+} manifest__chunk_context_t;
+
+static bool manifest__is_space(char c)
+{
+	return ((c == ' ') || ((unsigned char)(c - '\t') <= ('\r' - '\t')));
+}
+
+/* The vector scanners load whole aligned blocks around the text they
+ * scan, which at a boundary would read memory that the neighbouring
+ * chunk's thread is terminating and decoding in place. So each chunk is
+ * parsed from its own copy, padded out to a whole block. */
+static bool manifest__chunk_parse(void* context, unsigned i)
+{
+	manifest__chunk_context_t* cc
+		= (manifest__chunk_context_t*)context;
+
+	size_t size = cc->size[i];
+	size_t padded = ((size / MANIFEST__CHUNK_ALIGN) + 1)
+		* MANIFEST__CHUNK_ALIGN;
+
+	void* chunk;
+	if (posix_memalign(&chunk, MANIFEST__CHUNK_ALIGN, padded) != 0)
+		return false;
+	memcpy(chunk, &cc->source[cc->start[i]], size);
+	memset(&((char*)chunk)[size], 0x00, (padded - size));
+
+	bool success = xml_parse_fragment((char*)chunk, size,
+		&manifest__builder_handler, &cc->builder[i]);
+	free(chunk);
+	return success;
+}
+
+/* The opening manifest tag is parsed from a copy with a closing tag added,
+ * so that it's parsed exactly as the serial parser would parse it. */
+static bool manifest__chunk_head(
+	manifest__builder_t* builder, const char* source, size_t size)
+{
+	char* head = (char*)malloc(size + 12);
+	if (!head) return false;
+	memcpy(head, source, size);
+	memcpy(&head[size], "</manifest>", 12);
+
+	bool success = xml_parse(head, (size + 11),
+		&manifest__builder_handler, builder);
+	free(head);
+
+	builder->depth = 1;
+	return success;
+}
+
+static bool manifest__chunk_merge(
+	manifest__builder_t* builder, manifest__builder_t* chunk)
+{
+	unsigned count = builder->project_count + chunk->project_count;
+	if (count > builder->project_capacity)
+	{
+		manifest__project_t* nproject = (manifest__project_t*)realloc(
+			builder->project, (count * sizeof(manifest__project_t)));
+		if (!nproject) return false;
+		builder->project = nproject;
+		builder->project_capacity = count;
+	}
+
+	const char* default_remote = (builder->default_remote_count > 0
+		? builder->default_remote[builder->default_remote_count - 1]
+		: NULL);
+
+	unsigned i;
+	for (i = 0; i < chunk->project_count; i++)
+	{
+		manifest__project_t* project = &chunk->project[i];
+		if (!project->revision)
+			project->revision = builder->default_revision;
+		project->remote_name = default_remote;
+
+		if (!project->revision)
+			return false;
+	}
+
+	memcpy(&builder->project[builder->project_count], chunk->project,
+		(chunk->project_count * sizeof(manifest__project_t)));
+	builder->project_count = count;
+	chunk->project_count = 0;
+
+	strpool_merge(builder->strings, chunk->strings);
+	chunk->strings = NULL;
+	return true;
+}
+
+static manifest_t* manifest__parse_chunked(
+	char* source, size_t size, long int threads,
+	const char* include_path, const char* include_dir, const char* cache_dir)
+{
+	size_t end = size;
+	while ((end > 0) && manifest__is_space(source[end - 1]))
+		end--;
+	if ((end < 11) || (memcmp(&source[end - 11], "</manifest>", 11) != 0))
+		return NULL;
+	size_t tail = end - 11;
+
+	const char* open = strstr(source, "<manifest");
+	if (!open) return NULL;
+	const char* open_end = strchr(open, '>');
+	if (!open_end) return NULL;
+	size_t body = (open_end + 1) - source;
+	if (body > tail) return NULL;
+
+	unsigned count = (tail - body) / MANIFEST__CHUNK_SIZE;
+	if (count > MANIFEST__CHUNK_COUNT)
+		count = MANIFEST__CHUNK_COUNT;
+	if (count < 2)
+		return NULL;
+
+	/* Boundaries are placed at the first project tag after each share
+	 * of the body that is preceded by whitespace, which is left out of
+	 * the chunk before. */
+	size_t start[count];
+	size_t chunk_size[count];
+	start[0] = body;
+
+	unsigned c;
+	for (c = 1; c < count; c++)
+	{
+		size_t from = body + (((tail - body) / count) * c);
+		if (from <= start[c - 1])
+			from = start[c - 1] + 1;
+
+		const char* project = NULL;
+		while (from < tail)
+		{
+			project = (const char*)memmem(&source[from],
+				(tail - from), "<project", 8);
+			if (!project)
+				break;
+
+			size_t offset = project - source;
+			char next = source[offset + 8];
+			if (manifest__is_space(source[offset - 1])
+				&& (manifest__is_space(next)
+					|| (next == '/') || (next == '>')))
+				break;
+
+			from = offset + 1;
+			project = NULL;
+		}
+
+		if (!project)
+			break;
+		start[c] = project - source;
+	}
+	count = c;
+	if (count < 2)
+		return NULL;
+
+	for (c = 0; c < count; c++)
+	{
+		size_t chunk_end = ((c + 1) < count ? (start[c + 1] - 1) : tail);
+		chunk_size[c] = chunk_end - start[c];
+	}
+
+	manifest__builder_t builder[count];
+	memset(builder, 0x00, sizeof(builder));
+
+	unsigned ready;
+	for (ready = 0; ready < count; ready++)
+	{
+		if (!manifest__builder_init(&builder[ready]))
+			break;
+		builder[ready].quiet = true;
+		builder[ready].fragment = (ready > 0);
+		builder[ready].depth = (ready > 0 ? 1 : 0);
+	}
+
+	manifest__chunk_context_t cc;
+	cc.source  = source;
+	cc.start   = start;
+	cc.size    = chunk_size;
+	cc.builder = builder;
+
+	builder[0].include_path = include_path;
+	builder[0].include_dir  = include_dir;
+	builder[0].cache_dir    = cache_dir;
+
+	bool success = (ready == count)
+		&& manifest__chunk_head(&builder[0], source, body)
+		&& parallel_for(count, (threads < count ? threads : count),
+			manifest__chunk_parse, &cc);
+
+	for (c = 1; c < count; c++)
+	{
+		if (success && !manifest__chunk_merge(&builder[0], &builder[c]))
+			success = false;
+		manifest__builder_free(&builder[c]);
+	}
+
+	if (!success)
+	{
+		manifest__builder_free(&builder[0]);
+		return NULL;
+	}
+
+	return manifest__builder_finish(&builder[0], true);
+}
+
+static manifest_t* manifest__read_chunked(
+	const char* path, const char* include_path,
+	const char* include_dir, const char* cache_dir)
+{
+	long int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 2)
+		return NULL;
+
+	size_t size, mapped;
+	char* source = xml_source_map(path, &size, &mapped);
+	if (!source) return NULL;
+
+	manifest_t* manifest = manifest__parse_chunked(
+		source, size, threads, include_path, include_dir, cache_dir);
+	munmap(source, mapped);
+	return manifest;
+}
+
+manifest_t* manifest_read_include(
+	const char* path, const char* include_dir, const char* cache_dir)
+{
+	struct stat manifest_stat;
+	if (stat(path, &manifest_stat) != 0)
+		return NULL;
+
+	char dir[strlen(path) + 2];
+	if (!include_dir)
+	{
+		const char* slash = strrchr(path, '/');
+		if (!slash)
+		{
+			strcpy(dir, ".");
+		}
+		else
+		{
+			size_t dir_size = (slash == path ? 1 : (size_t)(slash - path));
+			memcpy(dir, path, dir_size);
+			dir[dir_size] = '\0';
+		}
+		include_dir = dir;
+	}
+
+	/* Resolved so that an include of the manifest itself is caught. */
+	char resolved[PATH_MAX];
+	const char* include_path = (realpath(path, resolved) ? resolved : NULL);
+
+	if (manifest_stat.st_size >= (2 * MANIFEST__CHUNK_SIZE))
+	{
+		manifest_t* manifest = manifest__read_chunked(
+			path, include_path, include_dir, cache_dir);
+		if (manifest) return manifest;
+	}
+
+	manifest__builder_t builder;
+	if (!manifest__builder_init(&builder))
+		return NULL;
+	builder.include_path = include_path;
+	builder.include_dir  = include_dir;
+	builder.cache_dir    = cache_dir;
+
+	return manifest__builder_finish(&builder,
+		xml_read(path, &manifest__builder_handler, &builder));
+}
+
+manifest_t* manifest_read(const char* path)
+{
+	return manifest_read_include(path, NULL, NULL);
+}
+
+
+
+/* Copies, differences and filtered manifests are views which select
+ * projects from a base manifest rather than copying them. A view of a
+ * view selects from the same base. */
+
+static manifest_t* manifest__view(
+	manifest_t* manifest, const bool* mask, unsigned project_count)
+{
+	manifest_t* base = (manifest->base ? manifest->base : manifest);
+
+	manifest_t* view = (manifest_t*)malloc(
+		sizeof(manifest_t)
+		+ (project_count * sizeof(uint32_t))
+		+ (base->project_count * sizeof(uint32_t)));
+	if (!view) return NULL;
+	memset(view, 0x00, sizeof(manifest_t));
+	manifest__init(view);
+	view->remote_count = base->remote_count;
+	view->remote  = base->remote;
+	view->project_count = project_count;
+	view->threads = manifest->threads;
+	view->base     = base;
+	view->index    = (uint32_t*)((uintptr_t)view + sizeof(manifest_t));
+	view->position = &view->index[project_count];
+
+	unsigned i, j;
+	for (i = 0; i < base->project_count; i++)
+		view->position[i] = UINT32_MAX;
+
+	for (i = 0, j = 0; i < manifest->project_count; i++)
+	{
+		if (mask && !mask[i])
+			continue;
+
+		uint32_t index = manifest__base_index(manifest, i);
+		view->index[j] = index;
+		view->position[index] = j;
+		j++;
+	}
+
+	base->refs++;
+	return view;
+}
+
+manifest_t* manifest_copy(manifest_t* a)
+{
+	if (!a) return NULL;
+	return manifest__view(a, NULL, a->project_count);
+}
+
+manifest_t* manifest_subtract(manifest_t* a, manifest_t* b)
+{
+	if (!a) return NULL;
+	if (!b) return manifest_copy(a);
+
+	bool* mask = (bool*)malloc((a->project_count + 1) * sizeof(bool));
+	if (!mask) return NULL;
+
+	unsigned project_count = 0;
+	unsigned i, j;
+	for (i = 0; i < a->project_count; i++)
+	{
+		mask[i] = !manifest_find_path(b, manifest_project_path(a, i), &j);
+		if (mask[i])
+			project_count++;
+	}
+
+	manifest_t* view = (project_count > 0
+		? manifest__view(a, mask, project_count) : NULL);
+	free(mask);
+	return view;
+}
+
+manifest_t* manifest_select(manifest_t* manifest, const bool* mask)
+{
+	if (!manifest || !mask)
+		return NULL;
+
+	unsigned project_count = 0;
+	unsigned i;
+	for (i = 0; i < manifest->project_count; i++)
+		project_count += mask[i];
+
+	return manifest__view(manifest, mask, project_count);
+}
+
+static unsigned manifest__diff_project(
+	const manifest_t* a, unsigned i,
+	const manifest_t* b, unsigned j)
+{
+	project_t pa = manifest_project(a, i);
+	project_t pb = manifest_project(b, j);
+
+	unsigned change = manifest_change_none;
+	if (strcmp(pa.revision, pb.revision) != 0)
+		change |= manifest_change_revision;
+
+	/* A project is fetched from its remote and name together. */
+	if ((strcmp(pa.name, pb.name) != 0)
+		|| (strcmp(pa.remote, pb.remote) != 0)
+		|| (strcmp(pa.remote_name, pb.remote_name) != 0))
+		change |= manifest_change_remote;
+
+	if (pa.copyfile_count != pb.copyfile_count)
+		return (change | manifest_change_copyfile);
+
+	unsigned k;
+	for (k = 0; k < pa.copyfile_count; k++)
+	{
+		copyfile_t ca = manifest_project_copyfile(a, i, k);
+		copyfile_t cb = manifest_project_copyfile(b, j, k);
+		if ((strcmp(ca.source, cb.source) != 0)
+			|| (strcmp(ca.dest, cb.dest) != 0))
+			return (change | manifest_change_copyfile);
+	}
+
+	return change;
+}
+
+bool manifest_diff(
+	const manifest_t* a, const manifest_t* b, unsigned* change)
+{
+	if (!b || !change)
+		return false;
+
+	unsigned j;
+	for (j = 0; j < b->project_count; j++)
+	{
+		unsigned i;
+		change[j] = (a && manifest_find_path(a, manifest_project_path(b, j), &i)
+			? manifest__diff_project(a, i, b, j)
+			: manifest_change_added);
+	}
+
+	return true;
+}
+
+
+
+static void manifest__buffer_printf(
+	manifest__buffer_t* buffer, const char* format, ...)
+{
+	if (buffer->error)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(&buffer->data[buffer->size],
+		(buffer->capacity - buffer->size), format, args);
+	va_end(args);
+
+	if (len < 0)
+	{
+		buffer->error = true;
+		return;
+	}
+
+	if ((buffer->size + len) >= buffer->capacity)
+	{
+		size_t capacity = (buffer->capacity ? buffer->capacity : 4096);
+		while ((buffer->size + len) >= capacity)
+			capacity <<= 1;
+
+		char* ndata = (char*)realloc(buffer->data, capacity);
+		if (!ndata)
+		{
+			buffer->error = true;
+			return;
+		}
+		buffer->data = ndata;
+		buffer->capacity = capacity;
+
+		va_start(args, format);
+		vsnprintf(&buffer->data[buffer->size],
+			(buffer->capacity - buffer->size), format, args);
+		va_end(args);
+	}
+
+	buffer->size += len;
+}
+
+static void manifest__buffer_string(
+	manifest__buffer_t* buffer, const char* string)
+{
+	manifest__buffer_write(buffer, string, strlen(string));
+}
+
+static void manifest__buffer_escape(
+	manifest__buffer_t* buffer, const char* value, size_t size)
+{
+	const char* run = value;
+	const char* c;
+	for (c = value; c < &value[size]; c++)
+	{
+		const char* entity;
+		switch (*c)
+		{
+			case '<' : entity = "&lt;";   break;
+			case '>' : entity = "&gt;";   break;
+			case '&' : entity = "&amp;";  break;
+			case '\"': entity = "&quot;"; break;
+			default:
+				continue;
+		}
+
+		manifest__buffer_write(buffer, run, (c - run));
+		manifest__buffer_string(buffer, entity);
+		run = &c[1];
+	}
+
+	manifest__buffer_write(buffer, run, (c - run));
+}
+
+static void manifest__buffer_attr(
+	manifest__buffer_t* buffer, const char* name, const char* value)
+{
+	manifest__buffer_write(buffer, " ", 1);
+	manifest__buffer_string(buffer, name);
+	manifest__buffer_write(buffer, "=\"", 2);
+	manifest__buffer_escape(buffer, value, strlen(value));
+	manifest__buffer_write(buffer, "\"", 1);
+}
+
+/* Manifests are serialized into a single buffer which is then written
+ * to a temporary file and renamed over the target, so a crash can't
+ * leave a partly written manifest behind. Every project is written with
+ * its remote and revision, so the result doesn't depend on defaults or
+ * includes. Revisions may be given to replace those of the manifest. */
+static bool manifest__write(
+	const manifest_t* manifest, char** revision, const char* path)
+{
+	const manifest_t* base = manifest__base(manifest);
+
+	manifest__buffer_t buffer = { NULL, 0, 0, false };
+	size_t reserve = (size_t)base->string_size
+		+ ((size_t)manifest->project_count * 64) + 4096;
+	buffer.data = (char*)malloc(reserve);
+	if (!buffer.data)
+		return false;
+	buffer.capacity = reserve;
+
+	manifest__buffer_string(&buffer,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	manifest__buffer_string(&buffer, "<manifest>\n");
+
+	unsigned i, j;
+	for (i = 0; i < manifest->remote_count; i++)
+	{
+		const remote_t* remote = &manifest->remote[i];
+
+		manifest__buffer_string(&buffer, "\t<remote");
+		manifest__buffer_attr(&buffer, "name", remote->name);
+		manifest__buffer_attr(&buffer, "fetch", remote->fetch);
+		manifest__buffer_string(&buffer, "/>\n");
+	}
+
+	if (manifest->threads > 1)
+	{
+		manifest__buffer_printf(&buffer,
+			"\t<default sync-j=\"%ld\"/>\n", manifest->threads);
+	}
+
+	for (i = 0; i < manifest->project_count; i++)
+	{
+		project_t project = manifest_project(manifest, i);
+
+		manifest__buffer_string(&buffer, "\t<project");
+		manifest__buffer_attr(&buffer, "path", project.path);
+		manifest__buffer_attr(&buffer, "name", project.name);
+		manifest__buffer_attr(&buffer, "revision",
+			(revision ? revision[i] : project.revision));
+		manifest__buffer_attr(&buffer, "remote", project.remote_name);
+		if (project.priority != 0)
+		{
+			manifest__buffer_printf(&buffer,
+				" priority=\"%d\"", project.priority);
+		}
 
-			unsigned k;
-			for (k = 0; k < mdoc->tag[i]->tag_count; k++)
+		if (project.group_count > 0)
+		{
+			manifest__buffer_string(&buffer, " groups=\"");
+			for (j = 0; j < project.group_count; j++)
 			{
-				if (strcmp(mdoc->tag[i]->tag[k]->name, "copyfile") != 0)
-				{
-					fprintf(stderr,
-						"Warning: Unknown project sub-tag '%s'.\n",
-						mdoc->tag[i]->tag[k]->name);
-					continue;
-				}
-
-				copyfile_t* ncopyfile
-					= (copyfile_t*)realloc(project->copyfile,
-						(project->copyfile_count + 1) * sizeof(copyfile_t));
-				if (!ncopyfile)
-				{
-					fprintf(stderr,
-						"Error: Failed to add copyfile to project.\n");
-					manifest_delete(manifest);
-					return NULL;
-				}
-
-				project->copyfile = ncopyfile;
-				project->copyfile[project->copyfile_count].source
-					= xml_tag_field(mdoc->tag[i]->tag[k], "src");
-				project->copyfile[project->copyfile_count].dest
-					= xml_tag_field(mdoc->tag[i]->tag[k], "dest");
-
-				if (!project->copyfile[project->copyfile_count].source)
-				{
-					fprintf(stderr,
-						"Error: Invalid copyfile tag, missing source field.\n");
-					manifest_delete(manifest);
-					return NULL;
-				}
-
-				if (!project->copyfile[project->copyfile_count].dest)
-				{
-					fprintf(stderr,
-						"Error: Invalid copyfile tag, missing dest field.\n");
-					manifest_delete(manifest);
-					return NULL;
-				}
-
-				project->copyfile_count++;
+				group_t group = manifest_project_group(manifest, i, j);
+				if (j > 0)
+					manifest__buffer_write(&buffer, ",", 1);
+				manifest__buffer_escape(&buffer, group.name, group.size);
 			}
+			manifest__buffer_write(&buffer, "\"", 1);
+		}
 
-			const char* groups
-				= xml_tag_field(mdoc->tag[i], "groups");
-			if (groups)
-			{
-				if (!group_list_parse(groups, false,
-					&project->group, &project->group_count))
-				{
-					fprintf(stderr,
-						"Error: Failed to parse group list.\n");
-						manifest_delete(manifest);
-						return NULL;
-				}
-			}
+		if (project.copyfile_count)
+		{
+			manifest__buffer_string(&buffer, ">\n");
 
-			if (!project->path
-				|| !project->name
-				|| !project->remote
-				|| !project->revision)
+			for (j = 0; j < project.copyfile_count; j++)
 			{
-				fprintf(stderr,
-					"Error: Invalid project tag, missing field.\n");
-				manifest_delete(manifest);
-				return NULL;
+				copyfile_t copyfile
+					= manifest_project_copyfile(manifest, i, j);
+				manifest__buffer_string(&buffer, "\t\t<copyfile");
+				manifest__buffer_attr(&buffer, "src", copyfile.source);
+				manifest__buffer_attr(&buffer, "dest", copyfile.dest);
+				manifest__buffer_string(&buffer, "/>\n");
 			}
 
-			j++;
+			manifest__buffer_string(&buffer, "\t</project>\n");
+		}
+		else
+		{
+			manifest__buffer_string(&buffer, "/>\n");
 		}
 	}
 
-	manifest->document = document;
-	return manifest;
+	manifest__buffer_string(&buffer, "</manifest>\n");
+
+	bool success = !buffer.error
+		&& manifest__file_replace(path, buffer.data, buffer.size);
+	free(buffer.data);
+	return success;
 }
 
-manifest_t* manifest_read(const char* path)
+bool manifest_write(const manifest_t* manifest, const char* path)
 {
-	int fd = open(path, O_RDONLY);
-	if (fd < 0) return NULL;
+	if (!manifest)
+		return false;
 
-	struct stat manifest_stat;
-	if (fstat(fd, &manifest_stat) < 0)
+	if (!manifest__write(manifest, NULL, path))
 	{
-		close(fd);
-		fprintf(stderr, "Error: Failed to stat %s.\n", path);
-		return NULL;
+		fprintf(stderr, "Error: Failed to write manifest to '%s'.\n", path);
+		return false;
 	}
 
-	char manifest_string[manifest_stat.st_size + 1];
-	if (read(fd, manifest_string, manifest_stat.st_size) < 0)
+	return true;
+}
+
+
+
+typedef struct
+{
+	manifest_t* manifest;
+	char**      revision;
+} manifest__snapshot_context_t;
+
+static bool manifest__snapshot_revision(void* context, unsigned i)
+{
+	manifest__snapshot_context_t* sc
+		= (manifest__snapshot_context_t*)context;
+
+	const char* path = manifest_project_path(sc->manifest, i);
+
+	sc->revision[i] = git_current_commit(path);
+	if (!sc->revision[i])
 	{
-		close(fd);
-		fprintf(stderr, "Error: Failed to read %s.\n", path);
-		return NULL;
+		fprintf(stderr, "Error: Failed to get current revision"
+			" of '%s' during snapshot.\n", path);
+		return false;
 	}
-	manifest_string[manifest_stat.st_size] = '\0';
 
-	close(fd);
+	return true;
+}
+
+bool manifest_write_snapshot(
+	manifest_t* manifest, const char* path, long int threads)
+{
+	if (!manifest)
+		return false;
 
-	xml_tag_t* manifest_xml
-		= xml_document_parse(manifest_string);
-	if (!manifest_xml)
+	char** revision = (char**)calloc(
+		(manifest->project_count + 1), sizeof(char*));
+	if (!revision)
 	{
-		fprintf(stderr, "Error: Failed to parse xml in manifest file.\n");
-		return NULL;
+		fprintf(stderr, "Error: Failed to allocate manifest snapshot.\n");
+		return false;
 	}
 
-	manifest_t* manifest
-		= manifest_parse(manifest_xml);
-	if (!manifest)
+	manifest__snapshot_context_t sc;
+	sc.manifest = manifest;
+	sc.revision = revision;
+
+	bool success = parallel_for(manifest->project_count, threads,
+		manifest__snapshot_revision, &sc);
+
+	if (success && !manifest__write(manifest, revision, path))
 	{
-		fprintf(stderr, "Error: Failed to parse manifest from xml document.\n");
-		xml_tag_delete(manifest_xml);
-		return NULL;
+		fprintf(stderr, "Error: Failed to write manifest snapshot"
+			" to '%s'.\n", path);
+		success = false;
 	}
 
-	return manifest;
+	unsigned i;
+	for (i = 0; i < manifest->project_count; i++)
+		free(revision[i]);
+	free(revision);
+
+	return success;
 }
 
 
 
-manifest_t* manifest_copy(manifest_t* a)
+manifest_t* manifest_group_filter(
+	manifest_t* manifest,
+	group_t* filter, unsigned filter_count)
 {
-	if (!a) return NULL;
+	if (!manifest)
+		return NULL;
 
-	manifest_t* manifest = (manifest_t*)malloc(
-		sizeof(manifest_t)
-		+ (a->remote_count * sizeof(remote_t))
-		+ (a->project_count * sizeof(project_t)));
-	if (!manifest) return NULL;
-	manifest->remote_count = a->remote_count;
-	manifest->remote  = (remote_t*)((uintptr_t)manifest + sizeof(manifest_t));
-	manifest->project_count = a->project_count;
-	manifest->project = (project_t*)&manifest->remote[manifest->remote_count];
-	manifest->document = NULL;
+	bool include_default = true;
+	bool include_all = false;
 
 	unsigned i;
-	for (i = 0; i < a->remote_count; i++)
-		manifest->remote[i] = a->remote[i];
+	if (group_list_match(
+		"default", strlen("default"),
+		filter, filter_count, &i))
+		include_default = !filter[i].exclude;
+	if (group_list_match(
+		"all", strlen("all"),
+		filter, filter_count, &i))
+		include_all = !filter[i].exclude;
 
-	for (i = 0; i < a->project_count; i++)
+	const manifest_t* base = manifest__base(manifest);
+	unsigned words = GROUP_SET_WORDS(base->groups.count);
+
+	unsigned default_id;
+	bool has_default = group_table_find(&base->groups,
+		"default", strlen("default"), &default_id);
+
+	/* Each project's group set is a row of its base manifest. The
+	 * arrays are sized by the manifest, so they're allocated together. */
+	unsigned count = manifest->project_count;
+	size_t* row = (size_t*)malloc((count + 1)
+		* (sizeof(size_t) + (2 * sizeof(bool))));
+	if (!row) return NULL;
+	bool* mask  = (bool*)&row[count + 1];
+	bool* fixed = &mask[count + 1];
+
+	/* Projects without groups or in the default group ignore the filter,
+	 * for the rest the last filter entry naming one of their groups wins.
+	 * Each entry is applied across every project in turn. */
+	for (i = 0; i < count; i++)
 	{
-		manifest->project[i] = a->project[i];
-		manifest->project[i].copyfile = NULL;
-		manifest->project[i].copyfile_count = 0;
-		manifest->project[i].group = NULL;
-		manifest->project[i].group_count = 0;
+		uint32_t index = manifest__base_index(manifest, i);
+		row[i] = (size_t)index * words;
+
+		fixed[i] = (base->project_group[index]
+				== base->project_group[index + 1])
+			|| (has_default && (base->group_set[row[i]
+				+ (default_id >> 6)] & (1ULL << (default_id & 63))));
+		mask[i] = include_all || (fixed[i] && include_default);
 	}
 
-	for (i = 0; i < a->project_count; i++)
+	unsigned j;
+	for (j = 0; j < filter_count; j++)
 	{
-		if (a->project[i].copyfile_count)
+		unsigned id;
+		if (!group_table_find(&base->groups,
+			filter[j].name, filter[j].size, &id))
+			continue;
+
+		const uint64_t* word = &base->group_set[id >> 6];
+		uint64_t bit = (1ULL << (id & 63));
+		bool include = !filter[j].exclude;
+
+		for (i = 0; i < count; i++)
 		{
-			manifest->project[i].copyfile
-				= (copyfile_t*)malloc(
-					a->project[i].copyfile_count * sizeof(copyfile_t));
-			if (!manifest->project[i].copyfile)
-			{
-				manifest_delete(manifest);
-				return NULL;
-			}
-			memcpy(
-				manifest->project[i].copyfile,
-				a->project[i].copyfile,
-				(a->project[i].copyfile_count * sizeof(copyfile_t)));
-			manifest->project[i].copyfile_count
-				= a->project[i].copyfile_count;
-		}
-		if (a->project[i].group_count)
-		{
-			if (!group_list_copy(
-				a->project[i].group,
-				a->project[i].group_count,
-				&manifest->project[i].group,
-				&manifest->project[i].group_count))
-			{
-				manifest_delete(manifest);
-				return NULL;
-			}
+			if (!fixed[i] && (word[row[i]] & bit))
+				mask[i] = include;
 		}
 	}
 
-	return manifest;
+	unsigned project_count = 0;
+	for (i = 0; i < count; i++)
+		project_count += mask[i];
+
+	manifest_t* view = manifest__view(manifest, mask, project_count);
+	free(row);
+	return view;
 }
 
 
 
-manifest_t* manifest_subtract(manifest_t* a, manifest_t* b)
+static char* manifest__snapshot_commit(
+	const project_t* project, const char* revision)
 {
-	if (!a) return NULL;
-	if (!b) return manifest_copy(a);
-
-	unsigned project_count = a->project_count;
+	if (!revision)
+		return NULL;
 
-	unsigned i, j;
-	for (i = 0; i < a->project_count; i++)
+	/* Branch names in a manifest refer to the project's remote. */
+	if (project->remote_name)
 	{
-		for (j = 0; j < b->project_count; j++)
+		const char* branch = revision;
+		if (strncmp(branch, "refs/heads/", 11) == 0)
+			branch = &branch[11];
+
+		if (strncmp(branch, "refs/", 5) != 0)
 		{
-			if (strcmp(a->project[i].path, b->project[j].path) == 0)
-				project_count--;
+			char ref[strlen(project->remote_name) + strlen(branch) + 16];
+			sprintf(ref, "refs/remotes/%s/%s", project->remote_name, branch);
+
+			char* commit = git_ref_commit(project->path, ref);
+			if (commit)
+				return commit;
 		}
 	}
 
-	if (project_count == 0)
-		return NULL;
+	return git_ref_commit(project->path, revision);
+}
 
-	manifest_t* manifest = (manifest_t*)malloc(
-		sizeof(manifest_t)
-		+ (a->remote_count * sizeof(remote_t))
-		+ (project_count * sizeof(project_t)));
-	if (!manifest) return NULL;
-	manifest->remote_count = a->remote_count;
-	manifest->remote  = (remote_t*)((uintptr_t)manifest + sizeof(manifest_t));
-	manifest->project_count = project_count;
-	manifest->project = (project_t*)&manifest->remote[manifest->remote_count];
-	manifest->document = NULL;
+manifest_t* manifest_changed_since(
+	manifest_t* manifest, manifest_t* snapshot)
+{
+	if (!manifest || !snapshot)
+		return NULL;
 
-	for (i = 0; i < a->remote_count; i++)
-		manifest->remote[i] = a->remote[i];
+	bool* mask = (bool*)malloc((manifest->project_count + 1) * sizeof(bool));
+	if (!mask) return NULL;
 
-	for (i = 0; i < project_count; i++)
+	unsigned project_count = 0;
+	unsigned i;
+	for (i = 0; i < manifest->project_count; i++)
 	{
-		manifest->project[i].copyfile = NULL;
-		manifest->project[i].copyfile_count = 0;
-		manifest->project[i].group = NULL;
-		manifest->project[i].group_count = 0;
-	}
+		project_t project = manifest_project(manifest, i);
+		mask[i] = true;
 
-	unsigned k;
-	for (i = 0, k = 0; i < a->project_count; i++)
-	{
-		for (j = 0; j < b->project_count; j++)
+		unsigned recorded_project;
+		if (manifest_find_path(snapshot, project.path, &recorded_project))
 		{
-			if (strcmp(a->project[i].path, b->project[j].path) == 0)
-				break;
+			char* current = git_current_commit(project.path);
+			char* recorded = manifest__snapshot_commit(&project,
+				manifest_project_revision(snapshot, recorded_project));
+			mask[i] = (!current || !recorded
+				|| (strcmp(current, recorded) != 0));
+			free(recorded);
+			free(current);
 		}
 
-		if (j >= b->project_count)
-		{
-			manifest->project[k] = a->project[i];
-			if (a->project[i].copyfile_count)
-			{
-				manifest->project[k].copyfile
-					= (copyfile_t*)malloc(
-						manifest->project[i].copyfile_count * sizeof(copyfile_t));
-				if (!manifest->project[k].copyfile)
-				{
-					manifest_delete(manifest);
-					return NULL;
-				}
-				memcpy(
-					manifest->project[k].copyfile,
-					a->project[i].copyfile,
-					(a->project[i].copyfile_count * sizeof(copyfile_t)));
-			}
-			if (a->project[i].group_count)
-			{
-				if (!group_list_copy(
-					a->project[i].group,
-					a->project[i].group_count,
-					&manifest->project[k].group,
-					&manifest->project[k].group_count))
-				{
-					manifest_delete(manifest);
-					return NULL;
-				}
-			}
-			k++;
-		}
+		if (mask[i])
+			project_count++;
 	}
 
-	return manifest;
+	manifest_t* view = manifest__view(manifest, mask, project_count);
+	free(mask);
+	return view;
 }
 
 
 
-bool manifest_write_snapshot(manifest_t* manifest, const char* path)
+/* The cache is an image of a filtered manifest which can be mapped and
+ * used without parsing any XML. A manifest's table only holds offsets
+ * and indexes, so it's stored as it is and used in place, followed by the
+ * group sets, group names and project indexes which can be too. */
+
+#define MANIFEST__CACHE_MAGIC   "FREPOMC"
+#define MANIFEST__CACHE_VERSION 7
+
+typedef struct
 {
-	if (!manifest)
-		return false;
+	char     magic[8];
+	uint32_t version;
+	uint32_t remote_count;
+	uint64_t fingerprint;
+	uint64_t checksum;
+	int64_t  threads;
+	uint32_t project_count;
+	uint32_t copyfile_count;
+	uint32_t group_count;
+	uint32_t group_name_count;
+	uint32_t path_slots;
+	uint32_t name_slots;
+	uint32_t string_size;
+	uint32_t include_count;
+	uint32_t trie_count;
+	uint32_t trie_slots;
+} manifest__cache_header_t;
+
+static bool manifest__file_hash(const char* path, uint64_t* hash)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
 
-	FILE* fp = fopen(path, "w");
-	if (!fp)
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) < 0)
 	{
-		fprintf(stderr, "Error: Failed to open '%s'"
-			" to write manifest snapshot.\n", path);
+		close(fd);
 		return false;
 	}
 
-	fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
-	fprintf(fp, "<manifest>\n");
+	size_t size = file_stat.st_size;
+	*hash = 0;
+	if (size > 0)
+	{
+		void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+		*hash = hash_data(data, size, 0);
+		munmap(data, size);
+	}
+	close(fd);
+	return true;
+}
+
+static uint64_t manifest__include_hash(const manifest_t* manifest, unsigned i)
+{
+	return (uint64_t)manifest->include_hash[i * 2]
+		| ((uint64_t)manifest->include_hash[(i * 2) + 1] << 32);
+}
+
+uint64_t manifest_fingerprint(
+	const char* path, group_t* filter, unsigned filter_count)
+{
+	uint64_t fingerprint;
+	if (!manifest__file_hash(path, &fingerprint))
+		return 0;
 
 	unsigned i;
-	for (i = 0; i < manifest->remote_count; i++)
+	for (i = 0; i < filter_count; i++)
 	{
-		remote_t* remote = &manifest->remote[i];
+		char exclude = (filter[i].exclude ? '-' : '+');
+		fingerprint = hash_data(&exclude, 1, fingerprint);
+		fingerprint = hash_data(filter[i].name, filter[i].size, fingerprint);
+	}
+
+	/* Zero is kept to mean that there is no fingerprint. */
+	return (fingerprint ? fingerprint : 1);
+}
+
+/* Views are written as a manifest of their own, with a table holding
+ * only their projects. */
+static manifest_t* manifest__materialize(const manifest_t* manifest)
+{
+	const manifest_t* base = manifest__base(manifest);
 
-		fprintf(fp, "\t<remote name=\"%s\" fetch=\"%s\"/>\n",
-			remote->name, remote->fetch);
+	manifest__table_t table;
+	manifest__table_init(&table);
+
+	unsigned i, j;
+	for (i = 0; i < manifest->remote_count; i++)
+	{
+		manifest__table_remote(&table,
+			manifest->remote[i].name, manifest->remote[i].fetch);
 	}
 
 	for (i = 0; i < manifest->project_count; i++)
 	{
-		project_t* project = &manifest->project[i];
+		project_t project = manifest_project(manifest, i);
+		manifest__table_project(&table, project.path, project.name,
+			project.revision,
+			base->project_remote[manifest__base_index(manifest, i)],
+			project.priority);
 
-		char* revision
-			= git_current_commit(project->path);
-		if (!revision)
+		for (j = 0; j < project.copyfile_count; j++)
 		{
-			fprintf(stderr, "Error: Failed to get current revision"
-				" during snapshot.\n");
-			fclose(fp);
-			return false;
+			copyfile_t copyfile = manifest_project_copyfile(manifest, i, j);
+			manifest__table_copyfile(&table, copyfile.source, copyfile.dest);
 		}
 
-		fprintf(fp, "\t<project path=\"%s\" name=\"%s\""
-			" revision=\"%s\" remote=\"%s\"",
-			project->path, project->name,
-			revision, project->remote_name);
-
-		if (project->group_count > 0)
+		for (j = 0; j < project.group_count; j++)
 		{
-			fprintf(fp, " group=\"");
-			unsigned j;
-			for (j = 0; j < project->group_count; j++)
-			{
-				fprintf(fp, "%s%.*s",
-					(j > 0 ? "," : ""),
-					project->group[j].size,
-					project->group[j].name);
-			}
-			fprintf(fp, "\"");
+			group_t group = manifest_project_group(manifest, i, j);
+			manifest__table_group(&table, group.name, group.size);
 		}
+	}
 
-		free(revision);
+	for (i = 0; i < base->include_count; i++)
+	{
+		manifest__table_include(&table,
+			&base->string[base->include[i]], manifest__include_hash(base, i));
+	}
 
-		if (project->copyfile_count)
-		{
-			fprintf(fp, ">\n");
+	return manifest__table_finish(&table, manifest->threads);
+}
 
-			unsigned j;
-			for (j = 0; j < project->copyfile_count; j++)
-			{
-				fprintf(fp, "\t\t<copyfile src=\"%s\" dest=\"%s\"/>\n",
-					project->copyfile[j].source, project->copyfile[j].dest);
-			}
+bool manifest_cache_write(
+	manifest_t* manifest, const char* path, uint64_t fingerprint)
+{
+	if (!manifest || !fingerprint)
+		return false;
 
-			fprintf(fp, "\t</project>\n");
-		}
-		else
-		{
-			fprintf(fp, "/>\n");
-		}
+	manifest_t* base = manifest;
+	if (manifest->base)
+	{
+		base = manifest__materialize(manifest);
+		if (!base) return false;
 	}
 
-	fprintf(fp, "</manifest>\n");
-	bool err = ferror(fp);
-	fclose(fp);
-	return !err;
-}
+	if (!manifest__trie_build(base))
+	{
+		if (base != manifest)
+			manifest_delete(base);
+		return false;
+	}
 
+	unsigned group_words = GROUP_SET_WORDS(base->groups.count);
+	unsigned group_name_count = base->groups.count;
+	uint32_t group_name[group_name_count + 1];
+	unsigned i;
+	for (i = 0; i < group_name_count; i++)
+		group_name[i] = base->groups.name[i].name - base->string;
+
+	manifest__cache_header_t header;
+	memset(&header, 0x00, sizeof(header));
+	memcpy(header.magic, MANIFEST__CACHE_MAGIC, sizeof(header.magic));
+	header.version        = MANIFEST__CACHE_VERSION;
+	header.remote_count   = base->remote_count;
+	header.fingerprint    = fingerprint;
+	header.threads        = base->threads;
+	header.project_count  = base->project_count;
+	header.copyfile_count = base->copyfile_count;
+	header.group_count    = base->group_count;
+	header.group_name_count = group_name_count;
+	header.path_slots     = base->path_index.mask + 1;
+	header.name_slots     = base->name_index.mask + 1;
+	header.string_size    = base->string_size;
+	header.include_count  = base->include_count;
+	header.trie_count     = base->trie_count;
+	header.trie_slots     = base->trie_mask + 1;
+
+	manifest__buffer_t image = { NULL, 0, 0, false };
+	manifest__buffer_write(&image, &header, sizeof(header));
+	manifest__buffer_write(&image, base->table,
+		manifest__table_layout(base, NULL));
+	manifest__buffer_write(&image, base->group_set,
+		((size_t)base->project_count * group_words * sizeof(uint64_t)));
+	manifest__buffer_write(&image, group_name,
+		(group_name_count * sizeof(uint32_t)));
+	manifest__buffer_write(&image, base->path_index.slot,
+		(header.path_slots * sizeof(uint32_t)));
+	manifest__buffer_write(&image, base->name_index.slot,
+		(header.name_slots * sizeof(uint32_t)));
+	manifest__buffer_write(&image, base->trie, ((size_t)header.trie_count
+		* MANIFEST__TRIE_WORDS * sizeof(uint32_t)));
+	manifest__buffer_write(&image, base->trie_slot,
+		(header.trie_slots * sizeof(uint32_t)));
+
+	bool success = !image.error;
+	if (success)
+	{
+		manifest__cache_header_t* iheader
+			= (manifest__cache_header_t*)image.data;
+		iheader->checksum = hash_data(&iheader[1],
+			(image.size - sizeof(header)), 0);
+		success = manifest__file_replace(path, image.data, image.size);
+	}
 
+	if (base != manifest)
+		manifest_delete(base);
+	free(image.data);
+	return success;
+}
 
-manifest_t* manifest_group_filter(
-	manifest_t* manifest,
-	group_t* filter, unsigned filter_count)
+static bool manifest__cache_offsets(
+	const uint32_t* offset, size_t count, uint32_t limit)
 {
-	if (!manifest)
-		return NULL;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		if (offset[i] >= limit)
+			return false;
+	}
+	return true;
+}
 
-	bool include_default = true;
-	bool include_all = false;
+static bool manifest__cache_ranges(
+	const uint32_t* range, unsigned count, uint32_t total)
+{
+	if (range[0] != 0)
+		return false;
 
 	unsigned i;
-	if (group_list_match(
-		"default", strlen("default"),
-		filter, filter_count, &i))
-		include_default = !filter[i].exclude;
-	if (group_list_match(
-		"all", strlen("all"),
-		filter, filter_count, &i))
-		include_all = !filter[i].exclude;
+	for (i = 0; i < count; i++)
+	{
+		if (range[i + 1] < range[i])
+			return false;
+	}
+	return (range[count] == total);
+}
+
+/* Nodes are added after their parent and each is linked ahead of its
+ * older siblings, which is checked so that no walk of a trie from a
+ * cache can loop. */
+static bool manifest__cache_trie(const manifest_t* manifest)
+{
+	uint32_t count = manifest->trie_count;
+	uint32_t slots = manifest->trie_mask + 1;
+	if ((count == 0) || (slots == 0) || ((slots & (slots - 1)) != 0)
+		|| (count >= slots))
+		return false;
 
-	bool mask[manifest->project_count];
+	uint32_t n;
+	for (n = 0; n < count; n++)
+	{
+		const uint32_t* node = &manifest->trie[n * MANIFEST__TRIE_WORDS];
+		uint32_t parent  = node[MANIFEST__TRIE_PARENT];
+		uint32_t child   = node[MANIFEST__TRIE_CHILD];
+		uint32_t sibling = node[MANIFEST__TRIE_SIBLING];
+		uint32_t project = node[MANIFEST__TRIE_PROJECT];
+
+		if (((n == 0) ? (parent != UINT32_MAX) : (parent >= n))
+			|| (node[MANIFEST__TRIE_NAME] > manifest->string_size)
+			|| (node[MANIFEST__TRIE_SIZE]
+				> (manifest->string_size - node[MANIFEST__TRIE_NAME]))
+			|| ((project != UINT32_MAX)
+				&& (project >= manifest->project_count))
+			|| ((child != UINT32_MAX) && ((child <= n) || (child >= count)
+				|| (manifest->trie[(child * MANIFEST__TRIE_WORDS)
+					+ MANIFEST__TRIE_PARENT] != n)))
+			|| ((sibling != UINT32_MAX) && ((n == 0) || (sibling >= n)
+				|| (manifest->trie[(sibling * MANIFEST__TRIE_WORDS)
+					+ MANIFEST__TRIE_PARENT] != parent))))
+			return false;
+	}
 
-	unsigned project_count = 0;
-	for (i = 0; i < manifest->project_count; i++)
+	uint32_t used = 0;
+	uint32_t s;
+	for (s = 0; s < slots; s++)
 	{
-		mask[i] = include_all;
-		if ((manifest->project[i].group_count == 0)
-			|| (group_list_match(
-				"default", strlen("default"),
-				manifest->project[i].group,
-				manifest->project[i].group_count, NULL)))
-		{
-			mask[i] |= include_default;
-		}
-		else if (filter)
-		{
-			unsigned j;
-			for (j = 0; j < filter_count; j++)
-			{
-				unsigned m;
-				if (group_list_match(
-					filter[j].name, filter[j].size,
-					manifest->project[i].group,
-					manifest->project[i].group_count,
-					&m))
-					mask[i] = !filter[j].exclude;
-			}
-		}
+		uint32_t node = manifest->trie_slot[s];
+		if (node == UINT32_MAX)
+			continue;
+		if ((node == 0) || (node >= count))
+			return false;
+		used++;
+	}
+	return (used < slots);
+}
 
-		if (mask[i])
-			project_count++;
+manifest_t* manifest_cache_read(
+	const char* path, uint64_t fingerprint)
+{
+	if (!fingerprint)
+		return NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat cache_stat;
+	if ((fstat(fd, &cache_stat) < 0)
+		|| ((size_t)cache_stat.st_size < sizeof(manifest__cache_header_t)))
+	{
+		close(fd);
+		return NULL;
 	}
 
-	manifest_t* filtered = (manifest_t*)malloc(
-		sizeof(manifest_t)
-		+ (manifest->remote_count * sizeof(remote_t))
-		+ (project_count * sizeof(project_t)));
-	if (!filtered) return NULL;
-	filtered->remote_count = manifest->remote_count;
-	filtered->remote  = (remote_t*)((uintptr_t)filtered + sizeof(manifest_t));
-	filtered->project_count = project_count;
-	filtered->project = (project_t*)&filtered->remote[filtered->remote_count];
-	filtered->document = NULL;
+	size_t size = cache_stat.st_size;
+	void* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
 
-	for (i = 0; i < manifest->remote_count; i++)
-		filtered->remote[i] = manifest->remote[i];
+	const manifest__cache_header_t* header
+		= (const manifest__cache_header_t*)image;
+	if ((memcmp(header->magic, MANIFEST__CACHE_MAGIC,
+			sizeof(header->magic)) != 0)
+		|| (header->version != MANIFEST__CACHE_VERSION)
+		|| (header->fingerprint != fingerprint))
+	{
+		munmap(image, size);
+		return NULL;
+	}
 
-	unsigned j;
-	for (i = 0, j = 0; i < manifest->project_count; i++)
+	manifest_t* manifest = (manifest_t*)malloc(sizeof(manifest_t)
+		+ (header->remote_count * sizeof(remote_t)));
+	if (!manifest)
 	{
-		if (!mask[i])
-			continue;
+		munmap(image, size);
+		return NULL;
+	}
+	manifest__init(manifest);
+	manifest->mapping      = image;
+	manifest->mapping_size = size;
+	manifest->remote_count = header->remote_count;
+	manifest->remote = (remote_t*)((uintptr_t)manifest + sizeof(manifest_t));
+	manifest->project_count  = header->project_count;
+	manifest->threads        = header->threads;
+	manifest->copyfile_count = header->copyfile_count;
+	manifest->group_count    = header->group_count;
+	manifest->string_size    = header->string_size;
+	manifest->include_count  = header->include_count;
+
+	size_t table_size = manifest__table_layout(manifest, NULL);
+	uint64_t group_set_size = (uint64_t)header->project_count
+		* GROUP_SET_WORDS((uint64_t)header->group_name_count)
+		* sizeof(uint64_t);
+	uint64_t expect = sizeof(manifest__cache_header_t)
+		+ table_size + group_set_size
+		+ ((uint64_t)header->group_name_count * sizeof(uint32_t))
+		+ ((uint64_t)header->path_slots * sizeof(uint32_t))
+		+ ((uint64_t)header->name_slots * sizeof(uint32_t))
+		+ ((uint64_t)header->trie_count
+			* MANIFEST__TRIE_WORDS * sizeof(uint32_t))
+		+ ((uint64_t)header->trie_slots * sizeof(uint32_t));
+
+	/* A damaged image is caught by the checksum, and every offset is
+	 * checked before use so that even one which matches can't lead to
+	 * reads out of bounds. */
+	if ((expect != size)
+		|| (hash_data(&header[1], (size - sizeof(*header)), 0)
+			!= header->checksum))
+	{
+		manifest_delete(manifest);
+		return NULL;
+	}
 
-		filtered->project[j] = manifest->project[i];
-		filtered->project[j].copyfile = NULL;
-		filtered->project[j].copyfile_count = 0;
-		filtered->project[j].group = NULL;
-		filtered->project[j].group_count = 0;
+	manifest->table = (void*)&header[1];
+	manifest__table_layout(manifest, manifest->table);
 
-		j++;
+	if (group_set_size > 0)
+	{
+		manifest->group_set = (uint64_t*)(
+			(uintptr_t)manifest->table + table_size);
 	}
+	const uint32_t* group_name = (const uint32_t*)(
+		(uintptr_t)manifest->table + table_size + group_set_size);
+	const uint32_t* path_slot = &group_name[header->group_name_count];
+	const uint32_t* name_slot = &path_slot[header->path_slots];
+	manifest->trie       = (uint32_t*)&name_slot[header->name_slots];
+	manifest->trie_count = header->trie_count;
+	manifest->trie_slot  = &manifest->trie[
+		(size_t)header->trie_count * MANIFEST__TRIE_WORDS];
+	manifest->trie_mask  = header->trie_slots - 1;
+
+	uint32_t string_size = manifest->string_size;
+	unsigned project_count = manifest->project_count;
+	bool valid = (string_size > 0)
+		&& (manifest->string[string_size - 1] == '\0')
+		&& manifest__cache_offsets(manifest->remote_string,
+			((size_t)manifest->remote_count * 2), string_size)
+		&& manifest__cache_offsets(
+			manifest->project_path, project_count, string_size)
+		&& manifest__cache_offsets(
+			manifest->project_name, project_count, string_size)
+		&& manifest__cache_offsets(
+			manifest->project_revision, project_count, string_size)
+		&& manifest__cache_offsets(manifest->project_remote,
+			project_count, manifest->remote_count)
+		&& manifest__cache_ranges(manifest->project_copyfile,
+			project_count, manifest->copyfile_count)
+		&& manifest__cache_ranges(manifest->project_group,
+			project_count, manifest->group_count)
+		&& manifest__cache_offsets(manifest->copyfile,
+			((size_t)manifest->copyfile_count * 2), string_size)
+		&& manifest__cache_offsets(
+			manifest->group, manifest->group_count, string_size)
+		&& manifest__cache_offsets(
+			group_name, header->group_name_count, string_size)
+		&& manifest__cache_offsets(
+			manifest->include, manifest->include_count, string_size)
+		&& hash_table_wrap(&manifest->path_index, path_slot,
+			header->path_slots, project_count)
+		&& hash_table_wrap(&manifest->name_index, name_slot,
+			header->name_slots, project_count)
+		&& manifest__cache_trie(manifest);
 
-	for (i = 0, j = 0; i < manifest->project_count; i++)
+	unsigned i;
+	for (i = 0; valid && (i < manifest->remote_count); i++)
 	{
-		if (!mask[i])
-			continue;
+		manifest->remote[i].name
+			= &manifest->string[manifest->remote_string[i * 2]];
+		manifest->remote[i].fetch
+			= &manifest->string[manifest->remote_string[(i * 2) + 1]];
+	}
 
-		if (manifest->project[i].copyfile_count)
-		{
-			filtered->project[j].copyfile
-				= (copyfile_t*)malloc(
-					manifest->project[i].copyfile_count * sizeof(copyfile_t));
-			if (!filtered->project[j].copyfile)
-			{
-				manifest_delete(filtered);
-				return NULL;
-			}
-			memcpy(
-				filtered->project[j].copyfile,
-				manifest->project[i].copyfile,
-				(manifest->project[i].copyfile_count * sizeof(copyfile_t)));
-			filtered->project[j].copyfile_count
-				= manifest->project[i].copyfile_count;
-		}
-		if (manifest->project[i].group_count)
-		{
-			if (!group_list_copy(
-				manifest->project[i].group,
-				manifest->project[i].group_count,
-				&filtered->project[j].group,
-				&filtered->project[j].group_count))
-			{
-				manifest_delete(filtered);
-				return NULL;
-			}
-		}
+	for (i = 0; valid && (i < header->group_name_count); i++)
+	{
+		const char* name = &manifest->string[group_name[i]];
+		unsigned id;
+		valid = group_table_intern(&manifest->groups,
+			name, strlen(name), &id) && (id == i);
+	}
 
-		j++;
+	/* The image is only valid while every included file is unchanged. */
+	for (i = 0; valid && (i < manifest->include_count); i++)
+	{
+		uint64_t hash;
+		valid = manifest__file_hash(
+				&manifest->string[manifest->include[i]], &hash)
+			&& (hash == manifest__include_hash(manifest, i));
+	}
+
+	if (!valid)
+	{
+		manifest_delete(manifest);
+		return NULL;
 	}
 
-	return filtered;
+	return manifest__index(manifest);
 }
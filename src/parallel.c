@@ -0,0 +1,306 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+
+
+typedef struct
+{
+	parallel_func_t func;
+	void*           context;
+	unsigned        count;
+	unsigned        next;
+	bool            success;
+	pthread_mutex_t mutex;
+} parallel__queue_t;
+
+static void* parallel__thread(void* param)
+{
+	parallel__queue_t* queue = (parallel__queue_t*)param;
+
+	while (true)
+	{
+		pthread_mutex_lock(&queue->mutex);
+		unsigned index = queue->next;
+		if (index < queue->count)
+			queue->next++;
+		pthread_mutex_unlock(&queue->mutex);
+
+		if (index >= queue->count)
+			break;
+
+		if (!queue->func(queue->context, index))
+		{
+			pthread_mutex_lock(&queue->mutex);
+			queue->success = false;
+			pthread_mutex_unlock(&queue->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+bool parallel_for(
+	unsigned count, long int threads,
+	parallel_func_t func, void* context)
+{
+	if (!func)
+		return false;
+
+	if (threads <= 0)
+		threads = 1;
+	if ((unsigned long)threads > count)
+		threads = count;
+
+	if (threads <= 1)
+	{
+		bool success = true;
+		unsigned i;
+		for (i = 0; i < count; i++)
+			success = func(context, i) && success;
+		return success;
+	}
+
+	parallel__queue_t queue;
+	queue.func    = func;
+	queue.context = context;
+	queue.count   = count;
+	queue.next    = 0;
+	queue.success = true;
+	if (pthread_mutex_init(&queue.mutex, NULL) != 0)
+		abort();
+
+	pthread_t thread[threads];
+	long int t;
+	for (t = 0; t < threads; t++)
+	{
+		if (pthread_create(&thread[t], NULL,
+			parallel__thread, &queue) != 0)
+			abort();
+	}
+
+	for (t = 0; t < threads; t++)
+		pthread_join(thread[t], NULL);
+
+	pthread_mutex_destroy(&queue.mutex);
+	return queue.success;
+}
+
+
+
+/* Dependent tasks are queued as the task they depend on succeeds, each
+ * task's dependents being linked as a list. Ready tasks are kept in a
+ * heap so that the one with the highest priority, or the first of those,
+ * runs next. A thread waits while nothing is ready but tasks are running,
+ * and stops once neither is so. */
+typedef struct
+{
+	parallel_func_t func;
+	void*           context;
+	unsigned        count;
+	const int*      priority;
+	unsigned*       ready;
+	unsigned        ready_count;
+	unsigned        queued;
+	unsigned*       child;
+	unsigned*       sibling;
+	unsigned        running;
+	bool            success;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+} parallel__graph_t;
+
+static bool parallel__graph_before(
+	const parallel__graph_t* graph, unsigned a, unsigned b)
+{
+	if (graph->priority && (graph->priority[a] != graph->priority[b]))
+		return (graph->priority[a] > graph->priority[b]);
+	return (a < b);
+}
+
+static void parallel__graph_push(parallel__graph_t* graph, unsigned index)
+{
+	unsigned i = graph->ready_count++;
+	while (i > 0)
+	{
+		unsigned up = (i - 1) / 2;
+		if (!parallel__graph_before(graph, index, graph->ready[up]))
+			break;
+		graph->ready[i] = graph->ready[up];
+		i = up;
+	}
+	graph->ready[i] = index;
+	graph->queued++;
+}
+
+static unsigned parallel__graph_pop(parallel__graph_t* graph)
+{
+	unsigned top = graph->ready[0];
+	unsigned last = graph->ready[--graph->ready_count];
+
+	unsigned i = 0;
+	while (true)
+	{
+		unsigned c = (i * 2) + 1;
+		if (c >= graph->ready_count)
+			break;
+		if (((c + 1) < graph->ready_count) && parallel__graph_before(
+			graph, graph->ready[c + 1], graph->ready[c]))
+			c++;
+		if (!parallel__graph_before(graph, graph->ready[c], last))
+			break;
+		graph->ready[i] = graph->ready[c];
+		i = c;
+	}
+	graph->ready[i] = last;
+
+	return top;
+}
+
+static void* parallel__graph_thread(void* param)
+{
+	parallel__graph_t* graph = (parallel__graph_t*)param;
+
+	pthread_mutex_lock(&graph->mutex);
+	while (true)
+	{
+		while ((graph->ready_count == 0) && (graph->running > 0))
+			pthread_cond_wait(&graph->cond, &graph->mutex);
+
+		if (graph->ready_count == 0)
+			break;
+
+		unsigned index = parallel__graph_pop(graph);
+		graph->running++;
+		pthread_mutex_unlock(&graph->mutex);
+
+		bool success = graph->func(graph->context, index);
+
+		pthread_mutex_lock(&graph->mutex);
+		graph->running--;
+		if (!success)
+		{
+			graph->success = false;
+		}
+		else
+		{
+			unsigned c;
+			for (c = graph->child[index]; c < graph->count;
+				c = graph->sibling[c])
+				parallel__graph_push(graph, c);
+		}
+		pthread_cond_broadcast(&graph->cond);
+	}
+	pthread_mutex_unlock(&graph->mutex);
+
+	return NULL;
+}
+
+bool parallel_for_depend(
+	unsigned count, long int threads,
+	const unsigned* depend, const int* priority,
+	parallel_func_t func, void* context)
+{
+	if (!depend && !priority)
+		return parallel_for(count, threads, func, context);
+
+	if (!func)
+		return false;
+
+	if (threads <= 0)
+		threads = 1;
+	if ((unsigned long)threads > count)
+		threads = count;
+
+	parallel__graph_t graph;
+	graph.func        = func;
+	graph.context     = context;
+	graph.count       = count;
+	graph.priority    = priority;
+	graph.ready       = (unsigned*)malloc(count * sizeof(unsigned));
+	graph.ready_count = 0;
+	graph.queued      = 0;
+	graph.child       = (unsigned*)malloc(count * sizeof(unsigned));
+	graph.sibling     = (unsigned*)malloc(count * sizeof(unsigned));
+	graph.running     = 0;
+	graph.success     = true;
+	if (!graph.ready || !graph.child || !graph.sibling)
+	{
+		free(graph.ready);
+		free(graph.child);
+		free(graph.sibling);
+		return false;
+	}
+
+	unsigned i;
+	for (i = 0; i < count; i++)
+		graph.child[i] = count;
+
+	for (i = count; depend && (i > 0); i--)
+	{
+		unsigned d = depend[i - 1];
+		if ((d < count) && (d != (i - 1)))
+		{
+			graph.sibling[i - 1] = graph.child[d];
+			graph.child[d] = (i - 1);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (!depend || (depend[i] >= count) || (depend[i] == i))
+			parallel__graph_push(&graph, i);
+	}
+
+	if ((pthread_mutex_init(&graph.mutex, NULL) != 0)
+		|| (pthread_cond_init(&graph.cond, NULL) != 0))
+		abort();
+
+	if (threads <= 1)
+	{
+		parallel__graph_thread(&graph);
+	}
+	else
+	{
+		pthread_t thread[threads];
+		long int t;
+		for (t = 0; t < threads; t++)
+		{
+			if (pthread_create(&thread[t], NULL,
+				parallel__graph_thread, &graph) != 0)
+				abort();
+		}
+
+		for (t = 0; t < threads; t++)
+			pthread_join(thread[t], NULL);
+	}
+
+	pthread_cond_destroy(&graph.cond);
+	pthread_mutex_destroy(&graph.mutex);
+
+	/* Tasks never queued depended on a failure, or on each other. */
+	bool success = (graph.success && (graph.queued == count));
+	free(graph.ready);
+	free(graph.child);
+	free(graph.sibling);
+	return success;
+}
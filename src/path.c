@@ -105,3 +105,56 @@ char* path_join(const char* base, const char* path)
 		(needs_slash ? "/" : ""), path);
 	return rpath;
 }
+
+char* path_relative(const char* root, const char* path)
+{
+	if (!root || !path || (path[0] != '/'))
+		return NULL;
+
+	char normal[strlen(path) + 1];
+	size_t size = 0;
+
+	const char* c = path;
+	while (*c != '\0')
+	{
+		while (*c == '/')
+			c++;
+		if (*c == '\0')
+			break;
+
+		const char* end = c;
+		while ((*end != '\0') && (*end != '/'))
+			end++;
+
+		size_t part = end - c;
+		if ((part == 2) && (c[0] == '.') && (c[1] == '.'))
+		{
+			while ((size > 0) && (normal[size - 1] != '/'))
+				size--;
+			if (size > 0)
+				size--;
+		}
+		else if ((part != 1) || (c[0] != '.'))
+		{
+			normal[size++] = '/';
+			memcpy(&normal[size], c, part);
+			size += part;
+		}
+
+		c = end;
+	}
+	normal[size] = '\0';
+
+	size_t root_size = strlen(root);
+	while ((root_size > 0) && (root[root_size - 1] == '/'))
+		root_size--;
+
+	if ((strncmp(normal, root, root_size) != 0)
+		|| ((normal[root_size] != '\0') && (normal[root_size] != '/')))
+		return NULL;
+
+	const char* relative = &normal[root_size];
+	if (relative[0] == '/')
+		relative++;
+	return strdup(relative);
+}
@@ -0,0 +1,338 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "process.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+extern char** environ;
+
+static unsigned process__spawn_count = 0;
+
+
+
+char** process_environ(
+	const char* const* name, const char* const* value, unsigned count)
+{
+	unsigned env_count = 0;
+	size_t   env_size  = 0;
+
+	unsigned i, j;
+	for (i = 0; environ[i]; i++)
+	{
+		env_count++;
+		env_size += strlen(environ[i]) + 1;
+	}
+
+	for (j = 0; j < count; j++)
+	{
+		if (!value[j])
+			continue;
+		env_count++;
+		env_size += strlen(name[j]) + strlen(value[j]) + 2;
+	}
+
+	char** env = (char**)malloc(
+		((env_count + 1) * sizeof(char*)) + env_size);
+	if (!env) return NULL;
+
+	char* str = (char*)&env[env_count + 1];
+
+	unsigned e = 0;
+	for (i = 0; environ[i]; i++)
+	{
+		for (j = 0; j < count; j++)
+		{
+			size_t nlen = strlen(name[j]);
+			if ((strncmp(environ[i], name[j], nlen) == 0)
+				&& (environ[i][nlen] == '='))
+				break;
+		}
+		if (j < count)
+			continue;
+
+		env[e++] = str;
+		strcpy(str, environ[i]);
+		str += strlen(str) + 1;
+	}
+
+	for (j = 0; j < count; j++)
+	{
+		if (!value[j])
+			continue;
+		env[e++] = str;
+		sprintf(str, "%s=%s", name[j], value[j]);
+		str += strlen(str) + 1;
+	}
+
+	env[e] = NULL;
+	return env;
+}
+
+
+
+static bool process__output_append(
+	process_result_t* result, size_t* capacity,
+	const char* data, size_t size)
+{
+	if ((result->output_size + size + 1) > *capacity)
+	{
+		size_t ncapacity = (*capacity ? *capacity : 256);
+		while ((result->output_size + size + 1) > ncapacity)
+			ncapacity <<= 1;
+
+		char* noutput = (char*)realloc(result->output, ncapacity);
+		if (!noutput) return false;
+		result->output = noutput;
+		*capacity = ncapacity;
+	}
+
+	memcpy(&result->output[result->output_size], data, size);
+	result->output_size += size;
+	result->output[result->output_size] = '\0';
+	return true;
+}
+
+void process_spawned(void)
+{
+	__sync_fetch_and_add(&process__spawn_count, 1);
+}
+
+unsigned process_spawn_count(void)
+{
+	return __sync_fetch_and_add(&process__spawn_count, 0);
+}
+
+bool process_run(
+	const char* path, const char* command,
+	const char* const* argv, unsigned argc,
+	char* const* env,
+	const char* input, size_t input_size,
+	bool capture, process_result_t* result)
+{
+	if (!command || !result)
+		return false;
+
+	result->status      = -1;
+	result->output      = NULL;
+	result->output_size = 0;
+
+	const char* args[argc + 5];
+	args[0] = "sh";
+	args[1] = "-c";
+	args[2] = command;
+	args[3] = "sh";
+	unsigned a;
+	for (a = 0; a < argc; a++)
+		args[4 + a] = argv[a];
+	args[4 + argc] = NULL;
+
+	/* Pipes are close-on-exec so that children started concurrently
+	 * by other threads don't hold each other's pipes open. */
+	int out_pipe[2] = { -1, -1 };
+	int in_pipe[2]  = { -1, -1 };
+
+	if (capture && (pipe2(out_pipe, O_CLOEXEC) != 0))
+		return false;
+
+	if (input)
+	{
+		signal(SIGPIPE, SIG_IGN);
+		if (pipe2(in_pipe, O_CLOEXEC) != 0)
+		{
+			if (capture)
+			{
+				close(out_pipe[0]);
+				close(out_pipe[1]);
+			}
+			return false;
+		}
+	}
+
+	process_spawned();
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		if (capture)
+		{
+			close(out_pipe[0]);
+			close(out_pipe[1]);
+		}
+		if (input)
+		{
+			close(in_pipe[0]);
+			close(in_pipe[1]);
+		}
+		return false;
+	}
+
+	if (pid == 0)
+	{
+		/* Only async-signal-safe calls are allowed past this point. */
+		signal(SIGPIPE, SIG_DFL);
+
+		if (input)
+		{
+			if (dup2(in_pipe[0], STDIN_FILENO) < 0)
+				_exit(127);
+		}
+		else if (capture)
+		{
+			int null_fd = open("/dev/null", O_RDONLY);
+			if ((null_fd < 0)
+				|| (dup2(null_fd, STDIN_FILENO) < 0))
+				_exit(127);
+		}
+
+		if (capture
+			&& ((dup2(out_pipe[1], STDOUT_FILENO) < 0)
+				|| (dup2(out_pipe[1], STDERR_FILENO) < 0)))
+			_exit(127);
+
+		if (path && (chdir(path) != 0))
+			_exit(127);
+
+		execve("/bin/sh", (char* const*)args,
+			(env ? env : environ));
+		_exit(127);
+	}
+
+	if (capture)
+		close(out_pipe[1]);
+	if (input)
+		close(in_pipe[0]);
+
+	int    out_fd  = (capture ? out_pipe[0] : -1);
+	int    in_fd   = (input ? in_pipe[1] : -1);
+	size_t written = 0;
+	size_t capacity = 0;
+	bool   success = true;
+
+	if (input && (input_size == 0))
+	{
+		close(in_fd);
+		in_fd = -1;
+	}
+
+	while ((out_fd >= 0) || (in_fd >= 0))
+	{
+		struct pollfd pfd[2];
+		nfds_t nfds = 0;
+		if (out_fd >= 0)
+		{
+			pfd[nfds].fd     = out_fd;
+			pfd[nfds].events = POLLIN;
+			nfds++;
+		}
+		if (in_fd >= 0)
+		{
+			pfd[nfds].fd     = in_fd;
+			pfd[nfds].events = POLLOUT;
+			nfds++;
+		}
+
+		if (poll(pfd, nfds, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			success = false;
+			break;
+		}
+
+		nfds_t f;
+		for (f = 0; f < nfds; f++)
+		{
+			if (pfd[f].revents == 0)
+				continue;
+
+			if (pfd[f].fd == out_fd)
+			{
+				char buff[4096];
+				ssize_t r = read(out_fd, buff, sizeof(buff));
+				if ((r < 0) && (errno == EINTR))
+					continue;
+				if ((r > 0) && process__output_append(
+					result, &capacity, buff, r))
+					continue;
+
+				if (r != 0)
+					success = false;
+				close(out_fd);
+				out_fd = -1;
+			}
+			else
+			{
+				ssize_t w = write(in_fd,
+					&input[written], (input_size - written));
+				if ((w < 0) && (errno == EINTR))
+					continue;
+				if (w > 0)
+					written += w;
+
+				if ((w < 0) || (written >= input_size))
+				{
+					close(in_fd);
+					in_fd = -1;
+				}
+			}
+		}
+	}
+
+	if (out_fd >= 0)
+		close(out_fd);
+	if (in_fd >= 0)
+		close(in_fd);
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0)
+	{
+		if (errno != EINTR)
+		{
+			free(result->output);
+			result->output = NULL;
+			result->output_size = 0;
+			return false;
+		}
+	}
+
+	if (WIFEXITED(status))
+		result->status = WEXITSTATUS(status);
+	else if (WIFSIGNALED(status))
+		result->status = 128 + WTERMSIG(status);
+
+	if (!success)
+	{
+		free(result->output);
+		result->output = NULL;
+		result->output_size = 0;
+	}
+
+	return success;
+}
@@ -0,0 +1,113 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "strpool.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+
+
+typedef struct strpool__block_s strpool__block_t;
+
+struct strpool__block_s
+{
+	strpool__block_t* next;
+	size_t            size;
+	size_t            used;
+};
+
+struct strpool_s
+{
+	strpool__block_t* block;
+};
+
+
+
+strpool_t* strpool_create(void)
+{
+	strpool_t* pool = (strpool_t*)malloc(sizeof(strpool_t));
+	if (!pool) return NULL;
+	pool->block = NULL;
+	return pool;
+}
+
+void strpool_delete(strpool_t* pool)
+{
+	if (!pool)
+		return;
+
+	strpool__block_t* block = pool->block;
+	while (block)
+	{
+		strpool__block_t* next = block->next;
+		free(block);
+		block = next;
+	}
+
+	free(pool);
+}
+
+const char* strpool_add(
+	strpool_t* pool, const char* string, unsigned size)
+{
+	if (!pool || !string)
+		return NULL;
+
+	strpool__block_t* block = pool->block;
+	if (!block || ((block->used + size + 1) > block->size))
+	{
+		/* Blocks double in size so a manifest's strings take a
+		 * logarithmic number of allocations. */
+		size_t block_size = (block ? (block->size << 1) : 16384);
+		while (block_size < (size + 1))
+			block_size <<= 1;
+
+		block = (strpool__block_t*)malloc(
+			sizeof(strpool__block_t) + block_size);
+		if (!block) return NULL;
+		block->next = pool->block;
+		block->size = block_size;
+		block->used = 0;
+		pool->block = block;
+	}
+
+	char* copy = (char*)((uintptr_t)block
+		+ sizeof(strpool__block_t) + block->used);
+	memcpy(copy, string, size);
+	copy[size] = '\0';
+	block->used += size + 1;
+	return copy;
+}
+
+void strpool_merge(strpool_t* pool, strpool_t* other)
+{
+	if (!pool || !other)
+		return;
+
+	/* Blocks are appended behind the pool's current block,
+	 * so it stays the one new strings are added to. */
+	strpool__block_t** tail = &pool->block;
+	while (*tail)
+		tail = &(*tail)->next;
+
+	*tail = other->block;
+	other->block = NULL;
+	strpool_delete(other);
+}
@@ -24,11 +24,291 @@
 #include <string.h>
 #include <ctype.h>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 
-xml_tag_t* xml__tag_create(const char* name, xml_tag_t* parent);
-bool       xml__tag_append_field(xml_tag_t* tag, xml_field_t* field);
-bool       xml__tag_insert_tag(xml_tag_t* tag, xml_tag_t* child);
+
+struct xml_arena_s
+{
+	xml_arena_t* next;
+	size_t       size;
+	size_t       used;
+};
+
+typedef struct
+{
+	const xml_handler_t* handler;
+	void*                context;
+	bool                 error;
+	xml_field_t*         field;
+	unsigned             field_count;
+	unsigned             field_capacity;
+} xml__parser_t;
+
+
+
+/* Scanners used by the tokenizer's hot loops. Each returns a pointer to
+ * the first byte that ends the run it scans, the NUL terminator always
+ * ends a run. Vector versions only use aligned loads, which never cross
+ * into the next page, so reading past the terminator is safe. Build with
+ * -DXML_SCAN_SCALAR to force the scalar versions for comparison. */
+
+typedef struct
+{
+	const char* (*space)(const char* source);
+	const char* (*quote)(const char* source);
+	const char* (*dash)(const char* source);
+	const char* (*name)(const char* source);
+	const char* (*field_name)(const char* source);
+} xml__scanner_t;
+
+static inline bool xml__is_space(char c)
+{
+	return ((c == ' ') || ((unsigned char)(c - '\t') <= ('\r' - '\t')));
+}
+
+static inline bool xml__is_name(char c)
+{
+	return (((unsigned char)(c - '0') <= 9)
+		|| ((unsigned char)((c | 0x20) - 'a') <= ('z' - 'a'))
+		|| (c == '_'));
+}
+
+static const char* xml__scan_space_scalar(const char* source)
+{
+	while (xml__is_space(*source))
+		source++;
+	return source;
+}
+
+static const char* xml__scan_quote_scalar(const char* source)
+{
+	while ((*source != '\"') && (*source != '\0'))
+		source++;
+	return source;
+}
+
+static const char* xml__scan_dash_scalar(const char* source)
+{
+	while ((*source != '-') && (*source != '\0'))
+		source++;
+	return source;
+}
+
+static const char* xml__scan_name_scalar(const char* source)
+{
+	while (xml__is_name(*source))
+		source++;
+	return source;
+}
+
+static const char* xml__scan_field_name_scalar(const char* source)
+{
+	while (xml__is_name(*source) || (*source == '-'))
+		source++;
+	return source;
+}
+
+#if !defined(XML_SCAN_SCALAR) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define XML_SCAN_X86
+
+/* Byte ranges are checked with a wrapping subtract and an unsigned
+ * minimum, (c - lo) <= (hi - lo) holds exactly when min() is unchanged. */
+#define XML__RANGE_SSE2(v, lo, hi) \
+	_mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), \
+		_mm_set1_epi8((hi) - (lo))), _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+#define XML__RANGE_AVX2(v, lo, hi) \
+	_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(lo)), \
+		_mm256_set1_epi8((hi) - (lo))), _mm256_sub_epi8(v, _mm256_set1_epi8(lo)))
+
+__attribute__((target("sse2")))
+static inline unsigned xml__stop_space_sse2(__m128i v)
+{
+	__m128i space = _mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		XML__RANGE_SSE2(v, '\t', '\r'));
+	return (~_mm_movemask_epi8(space) & 0xFFFF);
+}
+
+__attribute__((target("sse2")))
+static inline unsigned xml__stop_quote_sse2(__m128i v)
+{
+	return _mm_movemask_epi8(_mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('\"')),
+		_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+__attribute__((target("sse2")))
+static inline unsigned xml__stop_dash_sse2(__m128i v)
+{
+	return _mm_movemask_epi8(_mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+		_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i xml__name_sse2(__m128i v)
+{
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	return _mm_or_si128(
+		_mm_or_si128(XML__RANGE_SSE2(v, '0', '9'),
+			XML__RANGE_SSE2(lower, 'a', 'z')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+__attribute__((target("sse2")))
+static inline unsigned xml__stop_name_sse2(__m128i v)
+{
+	return (~_mm_movemask_epi8(xml__name_sse2(v)) & 0xFFFF);
+}
+
+__attribute__((target("sse2")))
+static inline unsigned xml__stop_field_name_sse2(__m128i v)
+{
+	return (~_mm_movemask_epi8(_mm_or_si128(xml__name_sse2(v),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('-')))) & 0xFFFF);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned xml__stop_space_avx2(__m256i v)
+{
+	__m256i space = _mm256_or_si256(
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+		XML__RANGE_AVX2(v, '\t', '\r'));
+	return ~(unsigned)_mm256_movemask_epi8(space);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned xml__stop_quote_avx2(__m256i v)
+{
+	return _mm256_movemask_epi8(_mm256_or_si256(
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')),
+		_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned xml__stop_dash_avx2(__m256i v)
+{
+	return _mm256_movemask_epi8(_mm256_or_si256(
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')),
+		_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xml__name_avx2(__m256i v)
+{
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	return _mm256_or_si256(
+		_mm256_or_si256(XML__RANGE_AVX2(v, '0', '9'),
+			XML__RANGE_AVX2(lower, 'a', 'z')),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned xml__stop_name_avx2(__m256i v)
+{
+	return ~(unsigned)_mm256_movemask_epi8(xml__name_avx2(v));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned xml__stop_field_name_avx2(__m256i v)
+{
+	return ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(xml__name_avx2(v),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'))));
+}
+
+/* The first block is loaded from the aligned address below the source
+ * and the stop bits for bytes before the source are shifted out. */
+#define XML__SCAN_SSE2(kind) \
+	__attribute__((target("sse2"))) \
+	static const char* xml__scan_##kind##_sse2(const char* source) \
+	{ \
+		unsigned offset = ((uintptr_t)source & 15); \
+		const __m128i* block = (const __m128i*)(source - offset); \
+		unsigned stop = (xml__stop_##kind##_sse2( \
+			_mm_load_si128(block)) >> offset); \
+		if (stop) \
+			return &source[__builtin_ctz(stop)]; \
+		while (true) \
+		{ \
+			block++; \
+			stop = xml__stop_##kind##_sse2(_mm_load_si128(block)); \
+			if (stop) \
+				return &((const char*)block)[__builtin_ctz(stop)]; \
+		} \
+	}
+
+#define XML__SCAN_AVX2(kind) \
+	__attribute__((target("avx2"))) \
+	static const char* xml__scan_##kind##_avx2(const char* source) \
+	{ \
+		unsigned offset = ((uintptr_t)source & 31); \
+		const __m256i* block = (const __m256i*)(source - offset); \
+		unsigned stop = (xml__stop_##kind##_avx2( \
+			_mm256_load_si256(block)) >> offset); \
+		if (stop) \
+			return &source[__builtin_ctz(stop)]; \
+		while (true) \
+		{ \
+			block++; \
+			stop = xml__stop_##kind##_avx2(_mm256_load_si256(block)); \
+			if (stop) \
+				return &((const char*)block)[__builtin_ctz(stop)]; \
+		} \
+	}
+
+XML__SCAN_SSE2(space)
+XML__SCAN_SSE2(quote)
+XML__SCAN_SSE2(dash)
+XML__SCAN_SSE2(name)
+XML__SCAN_SSE2(field_name)
+
+XML__SCAN_AVX2(space)
+XML__SCAN_AVX2(quote)
+XML__SCAN_AVX2(dash)
+XML__SCAN_AVX2(name)
+XML__SCAN_AVX2(field_name)
+#endif
+
+static xml__scanner_t xml__scan =
+{
+	xml__scan_space_scalar,
+	xml__scan_quote_scalar,
+	xml__scan_dash_scalar,
+	xml__scan_name_scalar,
+	xml__scan_field_name_scalar,
+};
+
+static pthread_once_t xml__scan_once = PTHREAD_ONCE_INIT;
+
+static void xml__scan_init(void)
+{
+#ifdef XML_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		xml__scan.space      = xml__scan_space_avx2;
+		xml__scan.quote      = xml__scan_quote_avx2;
+		xml__scan.dash       = xml__scan_dash_avx2;
+		xml__scan.name       = xml__scan_name_avx2;
+		xml__scan.field_name = xml__scan_field_name_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		xml__scan.space      = xml__scan_space_sse2;
+		xml__scan.quote      = xml__scan_quote_sse2;
+		xml__scan.dash       = xml__scan_dash_sse2;
+		xml__scan.name       = xml__scan_name_sse2;
+		xml__scan.field_name = xml__scan_field_name_sse2;
+	}
+#endif
+}
 
 
 
@@ -39,17 +319,24 @@ unsigned xml__parse_comment(const char* source)
 	if (strncmp(source, "<!--", 4) != 0)
 		return 0;
 
-	unsigned i;
-	for (i = 4; source[i] != '\0'; i++)
+	const char* end = &source[4];
+	while (true)
 	{
-		if (strncmp(&source[i], "-->", 3) == 0)
+		/* An unterminated comment is an error rather than running to
+		 * the end of the source, so that a terminator placed in the
+		 * middle of a document can't end one early. */
+		end = xml__scan.dash(end);
+		if (*end == '\0')
+			return 0;
+		if (strncmp(end, "-->", 3) == 0)
 		{
-			i += 3;
+			end += 3;
 			break;
 		}
+		end++;
 	}
 
-	return i;
+	return (unsigned)(end - source);
 }
 
 unsigned xml__parse_whitespace(const char* source)
@@ -57,8 +344,7 @@ unsigned xml__parse_whitespace(const char* source)
 	if (!source)
 		return 0;
 
-	unsigned i;
-	for (i = 0; isspace(source[i]); i++);
+	unsigned i = (unsigned)(xml__scan.space(source) - source);
 
 	unsigned c = xml__parse_comment(&source[i]);
 	if (c)
@@ -70,7 +356,100 @@ unsigned xml__parse_whitespace(const char* source)
 	return i;
 }
 
-unsigned xml__parse_field(const char* source, xml_field_t** field)
+static unsigned xml__utf8_encode(unsigned long code, char* dest)
+{
+	if (code < 0x80)
+	{
+		dest[0] = code;
+		return 1;
+	}
+	if (code < 0x800)
+	{
+		dest[0] = 0xC0 | (code >> 6);
+		dest[1] = 0x80 | (code & 0x3F);
+		return 2;
+	}
+	if (code < 0x10000)
+	{
+		dest[0] = 0xE0 | (code >> 12);
+		dest[1] = 0x80 | ((code >> 6) & 0x3F);
+		dest[2] = 0x80 | (code & 0x3F);
+		return 3;
+	}
+	dest[0] = 0xF0 | (code >> 18);
+	dest[1] = 0x80 | ((code >> 12) & 0x3F);
+	dest[2] = 0x80 | ((code >> 6) & 0x3F);
+	dest[3] = 0x80 | (code & 0x3F);
+	return 4;
+}
+
+/* Decodes entities in place, a decoded entity is never longer than its
+ * reference so this never needs a copy. Unknown references are kept. */
+static unsigned xml__decode(char* data, unsigned size)
+{
+	static const struct
+	{
+		const char* name;
+		unsigned    size;
+		char        value;
+	} entity[] =
+	{
+		{ "lt"  , 2, '<'  },
+		{ "gt"  , 2, '>'  },
+		{ "amp" , 3, '&'  },
+		{ "quot", 4, '\"' },
+		{ "apos", 4, '\'' },
+	};
+
+	unsigned i, j;
+	for (i = 0, j = 0; i < size; )
+	{
+		if (data[i] != '&')
+		{
+			data[j++] = data[i++];
+			continue;
+		}
+
+		const char* end = memchr(&data[i], ';', (size - i));
+		unsigned len = (end ? (unsigned)(end - &data[i]) - 1 : 0);
+
+		if (len > 1 && (data[i + 1] == '#'))
+		{
+			bool hex = (data[i + 2] == 'x');
+			char* num_end;
+			unsigned long code = strtoul(
+				&data[i + (hex ? 3 : 2)], &num_end, (hex ? 16 : 10));
+			if ((num_end == end) && (code > 0) && (code <= 0x10FFFF))
+			{
+				j += xml__utf8_encode(code, &data[j]);
+				i += len + 2;
+				continue;
+			}
+		}
+
+		unsigned e;
+		for (e = 0; e < (sizeof(entity) / sizeof(entity[0])); e++)
+		{
+			if ((len == entity[e].size)
+				&& (strncmp(&data[i + 1], entity[e].name, len) == 0))
+				break;
+		}
+
+		if (e < (sizeof(entity) / sizeof(entity[0])))
+		{
+			data[j++] = entity[e].value;
+			i += len + 2;
+		}
+		else
+		{
+			data[j++] = data[i++];
+		}
+	}
+
+	return j;
+}
+
+unsigned xml__parse_field(char* source, xml_field_t* field)
 {
 	if (!source)
 		return 0;
@@ -78,15 +457,11 @@ unsigned xml__parse_field(const char* source, xml_field_t** field)
 	unsigned i = 0;
 	i += xml__parse_whitespace(&source[i]);
 
-	const char* name = &source[i];
+	char* name = &source[i];
 	if (!isalpha(source[i])
 		&& (source[i] != '_'))
 		return 0;
-	unsigned n;
-	for (n = 1; isalnum(source[i + n])
-		|| (source[i + n] == '_')
-		|| (source[i + n] == '-')
-		; n++);
+	unsigned n = (unsigned)(xml__scan.field_name(&name[1]) - name);
 	i += n;
 
 	if (source[i++] != '=')
@@ -94,55 +469,87 @@ unsigned xml__parse_field(const char* source, xml_field_t** field)
 
 	if (source[i++] != '\"')
 		return 0;
-	const char* data = &source[i];
-	unsigned d;
-	for (d = 0; (source[i + d] != '\"')
-		&& (source[i + d] != '\0'); d++);
+	char* data = &source[i];
+	unsigned d = (unsigned)(xml__scan.quote(data) - data);
 	i += d;
 	if (source[i++] != '\"')
 		return 0;
 
 	i += xml__parse_whitespace(&source[i]);
 
+	if (memchr(data, '&', d))
+		d = xml__decode(data, d);
+
+	/* Terminators overwrite the '=' and closing quote,
+	 * neither is looked at again. */
+	name[n] = '\0';
+	data[d] = '\0';
+
 	if (field)
 	{
-		xml_field_t* nfield
-			= (xml_field_t*)malloc(sizeof(xml_field_t)
-				+ n + d + 2);
-		if (!nfield) return 0;
+		field->name      = name;
+		field->name_size = n;
+		field->data      = data;
+		field->data_size = d;
+	}
 
-		nfield->name = (char*)((uintptr_t)nfield + sizeof(xml_field_t));
-		nfield->data = (char*)((uintptr_t)nfield->name + n + 1);
+	return i;
+}
 
-		memcpy(nfield->name, name, n);
-		nfield->name[n] = '\0';
 
-		memcpy(nfield->data, data, d);
-		nfield->data[d] = '\0';
 
-		*field = nfield;
+static void* xml__arena_alloc(xml_arena_t** arena, size_t size)
+{
+	size = (size + 7) & ~(size_t)7;
+
+	xml_arena_t* block = *arena;
+	if (!block || ((block->used + size) > block->size))
+	{
+		/* Blocks double in size so a document takes a logarithmic
+		 * number of allocations. */
+		size_t block_size = (block ? (block->size << 1) : 65536);
+		while (block_size < size)
+			block_size <<= 1;
+
+		block = (xml_arena_t*)malloc(
+			sizeof(xml_arena_t) + block_size);
+		if (!block) return NULL;
+		block->next = *arena;
+		block->size = block_size;
+		block->used = 0;
+		*arena = block;
 	}
 
-	return i;
+	void* ptr = (void*)((uintptr_t)block
+		+ sizeof(xml_arena_t) + block->used);
+	block->used += size;
+	return ptr;
+}
+
+static void xml__arena_delete(xml_arena_t* arena)
+{
+	while (arena)
+	{
+		xml_arena_t* next = arena->next;
+		free(arena);
+		arena = next;
+	}
 }
 
 
 
-xml_tag_t* xml__tag_create(const char* name, xml_tag_t* parent)
+static xml_tag_t* xml__tag_create(
+	xml_arena_t** arena,
+	const char* name, unsigned name_size)
 {
-	xml_tag_t* tag
-		= (xml_tag_t*)malloc(sizeof(xml_tag_t)
-			+ (name ? strlen(name) + 1 : 0));
+	xml_tag_t* tag = (xml_tag_t*)xml__arena_alloc(
+		arena, sizeof(xml_tag_t));
 	if (!tag) return NULL;
 
-	tag->name = NULL;
-	if (name)
-	{
-		tag->name = (char*)((uintptr_t)tag + sizeof(xml_tag_t));
-		strcpy(tag->name, name);
-	}
-
-	tag->parent = parent;
+	tag->name = name;
+	tag->name_size = name_size;
+	tag->parent = NULL;
+	tag->next = NULL;
 	tag->field = NULL;
 	tag->field_count = 0;
 	tag->tag = NULL;
@@ -151,66 +558,54 @@ xml_tag_t* xml__tag_create(const char* name, xml_tag_t* parent)
 	return tag;
 }
 
-void xml_tag_delete(xml_tag_t* tag)
+static bool xml__parser_push_field(
+	xml__parser_t* parser, xml_field_t* field)
 {
-	if (!tag)
-		return;
-
-	if (tag->field)
-	{
-		unsigned i;
-		for (i = 0; i < tag->field_count; i++)
-			free(tag->field[i]);
-		free(tag->field);
-	}
-
-	if (tag->tag)
+	if (parser->field_count >= parser->field_capacity)
 	{
-		unsigned i;
-		for (i = 0; i < tag->tag_count; i++)
-			xml_tag_delete(tag->tag[i]);
-		free(tag->tag);
+		unsigned capacity = (parser->field_capacity
+			? (parser->field_capacity << 1) : 16);
+		xml_field_t* nfield = (xml_field_t*)realloc(
+			parser->field, (capacity * sizeof(xml_field_t)));
+		if (!nfield) return false;
+		parser->field = nfield;
+		parser->field_capacity = capacity;
 	}
 
-	free(tag);
+	parser->field[parser->field_count++] = *field;
+	return true;
 }
 
-bool xml__tag_append_field(xml_tag_t* tag, xml_field_t* field)
+/* Fields are gathered in a scratch array that is reused for every tag,
+ * handlers see it only for the duration of the tag_open call. */
+static bool xml__parse_fields(
+	xml__parser_t* parser, char* source, unsigned* length)
 {
-	if (!tag || !field)
-		return false;
+	parser->field_count = 0;
 
-	xml_field_t** nfield
-		= (xml_field_t**)realloc(tag->field,
-			(tag->field_count + 1) * sizeof(xml_field_t*));
-	if (!nfield) return false;
-
-	tag->field = nfield;
-	tag->field[tag->field_count++] = field;
-	return true;
-}
+	unsigned i = 0;
+	while (true)
+	{
+		xml_field_t field;
+		unsigned field_length = xml__parse_field(&source[i], &field);
+		if (field_length == 0) break;
 
-bool xml__tag_insert_tag(xml_tag_t* tag, xml_tag_t* child)
-{
-	if (!tag || !child)
-		return false;
+		if (!xml__parser_push_field(parser, &field))
+			return false;
 
-	xml_tag_t** ntag
-		= (xml_tag_t**)realloc(tag->tag,
-			(tag->tag_count + 1) * sizeof(xml_tag_t*));
-	if (!ntag) return false;
+		i += field_length;
+	}
 
-	tag->tag = ntag;
-	tag->tag[tag->tag_count++] = child;
-	child->parent = tag;
+	*length = i;
 	return true;
 }
 
 
 
-unsigned xml__parse_tag(const char* source, xml_tag_t** tag)
+static unsigned xml__parse_tag(
+	xml__parser_t* parser, char* source)
 {
-	if (!source)
+	if (!source || parser->error)
 		return 0;
 
 	unsigned i = 0;
@@ -219,38 +614,22 @@ unsigned xml__parse_tag(const char* source, xml_tag_t** tag)
 	if (source[i++] != '<')
 		return 0;
 
-	const char* name = &source[i];
+	char* name = &source[i];
 	if (!isalpha(source[i])
 		&& (source[i] != '_'))
 		return 0;
-	unsigned n;
-	for (n = 1; isalnum(source[i + n]) || (source[i + n] == '_'); n++);
+	unsigned n = (unsigned)(xml__scan.name(&name[1]) - name);
 	i += n;
 
 	i += xml__parse_whitespace(&source[i]);
 
-	char nstr[n + 1];
-	memcpy(nstr, name, n);
-	nstr[n] = '\0';
-
-	xml_tag_t* ntag = xml__tag_create(nstr, NULL);
-	if (!ntag) return 0;
-
-	while (true)
+	unsigned fields_length;
+	if (!xml__parse_fields(parser, &source[i], &fields_length))
 	{
-		xml_field_t* field;
-		unsigned field_length = xml__parse_field(&source[i], &field);
-		if (field_length == 0) break;
-
-		if (!xml__tag_append_field(ntag, field))
-		{
-			free(field);
-			xml_tag_delete(ntag);
-			return 0;
-		}
-
-		i += field_length;
+		parser->error = true;
+		return 0;
 	}
+	i += fields_length;
 
 	i += xml__parse_whitespace(&source[i]);
 
@@ -258,117 +637,359 @@ unsigned xml__parse_tag(const char* source, xml_tag_t** tag)
 	if (empty) i++;
 
 	if (source[i++] != '>')
+		return 0;
+	i += xml__parse_whitespace(&source[i]);
+
+	if (parser->handler->tag_open
+		&& !parser->handler->tag_open(parser->context,
+			name, n, parser->field, parser->field_count))
 	{
-		xml_tag_delete(ntag);
+		parser->error = true;
 		return 0;
 	}
-	i += xml__parse_whitespace(&source[i]);
 
 	if (!empty)
 	{
 		while (true)
 		{
-			xml_tag_t* ctag;
-			unsigned ctag_length = xml__parse_tag(&source[i], &ctag);
+			unsigned ctag_length = xml__parse_tag(parser, &source[i]);
 			if (ctag_length == 0) break;
-
-			if (!xml__tag_insert_tag(ntag, ctag))
-			{
-				xml_tag_delete(ctag);
-				xml_tag_delete(ntag);
-				return 0;
-			}
-
 			i += ctag_length;
 		}
 
+		if (parser->error)
+			return 0;
+
 		i += xml__parse_whitespace(&source[i]);
 		if ((strncmp(&source[i], "</", 2) != 0)
 			|| (strncmp(&source[i + 2], name, n) != 0)
 			|| (source[i + 2 + n] != '>'))
-		{
-			xml_tag_delete(ntag);
 			return 0;
-		}
 		i += (2 + n + 1);
 		i += xml__parse_whitespace(&source[i]);
 	}
 
-	if (tag)
-		*tag = ntag;
-	else
-		xml_tag_delete(ntag);
+	/* The name is only terminated once the closing tag has been matched,
+	 * the character after it may be the '>' or '/' parsed above. */
+	name[n] = '\0';
+
+	if (parser->handler->tag_close
+		&& !parser->handler->tag_close(parser->context, name, n))
+	{
+		parser->error = true;
+		return 0;
+	}
 
 	return i;
 }
 
+static bool xml__parse(
+	char* source, size_t size, bool fragment,
+	const xml_handler_t* handler, void* context)
+{
+	if (!source || !handler)
+		return false;
+
+	pthread_once(&xml__scan_once, xml__scan_init);
 
+	xml__parser_t parser;
+	parser.handler        = handler;
+	parser.context        = context;
+	parser.error          = false;
+	parser.field          = NULL;
+	parser.field_count    = 0;
+	parser.field_capacity = 0;
 
-xml_tag_t* xml_document_parse(const char* source)
-{
-	xml_tag_t* document
-		= xml__tag_create(NULL, NULL);
-	if (!document) return NULL;
+	bool success = false;
 
 	unsigned i = 0;
 	i += xml__parse_whitespace(&source[i]);
 
-	if (strncmp(&source[i], "<?xml", 5) == 0)
+	if (!fragment && (strncmp(&source[i], "<?xml", 5) == 0))
 	{
 		i += 5;
 
-		while (true)
-		{
-			xml_field_t* field;
-			unsigned field_length = xml__parse_field(&source[i], &field);
-			if (field_length == 0) break;
-
-			if (!xml__tag_append_field(document, field))
-			{
-				free(field);
-				xml_tag_delete(document);
-				return NULL;
-			}
-
-			i += field_length;
-		}
+		unsigned fields_length;
+		if (!xml__parse_fields(&parser, &source[i], &fields_length))
+			goto xml_parse_done;
+		i += fields_length;
 
 		i += xml__parse_whitespace(&source[i]);
 		if (strncmp(&source[i], "?>", 2) != 0)
-		{
-			xml_tag_delete(document);
-			return NULL;
-		}
+			goto xml_parse_done;
 		i += 2;
 		i += xml__parse_whitespace(&source[i]);
 	}
 
 	while (true)
 	{
-		xml_tag_t* tag;
-		unsigned tag_length = xml__parse_tag(&source[i], &tag);
+		unsigned tag_length = xml__parse_tag(&parser, &source[i]);
 		if (tag_length == 0) break;
-
-		if (!xml__tag_insert_tag(document, tag))
-		{
-			xml_tag_delete(tag);
-			xml_tag_delete(document);
-			return NULL;
-		}
-
 		i += tag_length;
 	}
 	i += xml__parse_whitespace(&source[i]);
 
-	if (source[i] != '\0')
+	success = (!parser.error
+		&& (i == size) && (source[i] == '\0'));
+
+xml_parse_done:
+	free(parser.field);
+	return success;
+}
+
+bool xml_parse(
+	char* source, size_t size,
+	const xml_handler_t* handler, void* context)
+{
+	return xml__parse(source, size, false, handler, context);
+}
+
+bool xml_parse_fragment(
+	char* source, size_t size,
+	const xml_handler_t* handler, void* context)
+{
+	return xml__parse(source, size, true, handler, context);
+}
+
+
+
+char* xml_source_map(const char* path, size_t* size, size_t* mapped)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat source_stat;
+	if (fstat(fd, &source_stat) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	*size = source_stat.st_size;
+
+	/* Reserve one byte past the end so the source is NUL terminated even
+	 * when the file is an exact number of pages, then map the file over
+	 * the start of the reservation. The mapping is private so parsing can
+	 * terminate and decode strings in place without touching the file. */
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		page_size = 4096;
+	*mapped = ((*size + page_size) / page_size) * page_size;
+
+	char* source = (char*)mmap(NULL, *mapped,
+		(PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+	if (source == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	if ((*size > 0)
+		&& (mmap(source, *size, (PROT_READ | PROT_WRITE),
+			(MAP_PRIVATE | MAP_FIXED), fd, 0) == MAP_FAILED))
+	{
+		munmap(source, *mapped);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	return source;
+}
+
+bool xml_read(
+	const char* path,
+	const xml_handler_t* handler, void* context)
+{
+	size_t size, mapped;
+	char* source = xml_source_map(path, &size, &mapped);
+	if (!source) return false;
+
+	bool success = xml_parse(
+		source, size, handler, context);
+	munmap(source, mapped);
+	return success;
+}
+
+
+
+/* The document is built from parser events, each open tag keeps a frame
+ * with its children linked through next until the tag is closed. */
+
+typedef struct
+{
+	xml_tag_t* tag;
+	xml_tag_t* first;
+	xml_tag_t* last;
+} xml__frame_t;
+
+typedef struct
+{
+	xml_arena_t*  arena;
+	xml__frame_t* frame;
+	unsigned      frame_count;
+	unsigned      frame_capacity;
+} xml__builder_t;
+
+static bool xml__builder_push(xml__builder_t* builder, xml_tag_t* tag)
+{
+	if (builder->frame_count >= builder->frame_capacity)
+	{
+		unsigned capacity = (builder->frame_capacity
+			? (builder->frame_capacity << 1) : 16);
+		xml__frame_t* nframe = (xml__frame_t*)realloc(
+			builder->frame, (capacity * sizeof(xml__frame_t)));
+		if (!nframe) return false;
+		builder->frame = nframe;
+		builder->frame_capacity = capacity;
+	}
+
+	xml__frame_t* frame = &builder->frame[builder->frame_count++];
+	frame->tag   = tag;
+	frame->first = NULL;
+	frame->last  = NULL;
+	return true;
+}
+
+static bool xml__builder_pop(xml__builder_t* builder)
+{
+	xml__frame_t* frame = &builder->frame[--builder->frame_count];
+	xml_tag_t* tag = frame->tag;
+
+	if (tag->tag_count == 0)
+		return true;
+
+	tag->tag = (xml_tag_t**)xml__arena_alloc(&builder->arena,
+		(tag->tag_count * sizeof(xml_tag_t*)));
+	if (!tag->tag)
+		return false;
+
+	unsigned i;
+	xml_tag_t* child;
+	for (i = 0, child = frame->first; child; child = child->next)
+		tag->tag[i++] = child;
+	return true;
+}
+
+static bool xml__builder_open(
+	void* context, const char* name, unsigned name_size,
+	xml_field_t* field, unsigned field_count)
+{
+	xml__builder_t* builder = (xml__builder_t*)context;
+
+	xml_tag_t* tag = xml__tag_create(
+		&builder->arena, name, name_size);
+	if (!tag) return false;
+
+	if (field_count > 0)
 	{
-		xml_tag_delete(document);
+		tag->field = (xml_field_t*)xml__arena_alloc(&builder->arena,
+			(field_count * sizeof(xml_field_t)));
+		if (!tag->field)
+			return false;
+		memcpy(tag->field, field,
+			(field_count * sizeof(xml_field_t)));
+		tag->field_count = field_count;
+	}
+
+	xml__frame_t* parent = &builder->frame[builder->frame_count - 1];
+	tag->parent = parent->tag;
+	if (parent->last)
+		parent->last->next = tag;
+	else
+		parent->first = tag;
+	parent->last = tag;
+	parent->tag->tag_count++;
+
+	return xml__builder_push(builder, tag);
+}
+
+static bool xml__builder_close(
+	void* context, const char* name, unsigned name_size)
+{
+	(void)name;
+	(void)name_size;
+	return xml__builder_pop((xml__builder_t*)context);
+}
+
+static const xml_handler_t xml__builder_handler =
+{
+	.tag_open  = xml__builder_open,
+	.tag_close = xml__builder_close,
+};
+
+
+
+xml_document_t* xml_document_parse(char* source, size_t size)
+{
+	if (!source)
+		return NULL;
+
+	xml_document_t* document
+		= (xml_document_t*)malloc(sizeof(xml_document_t));
+	if (!document) return NULL;
+
+	xml__builder_t builder;
+	builder.arena          = NULL;
+	builder.frame          = NULL;
+	builder.frame_count    = 0;
+	builder.frame_capacity = 0;
+
+	document->source = source;
+	document->size   = size;
+	document->mapped = 0;
+	document->root   = xml__tag_create(&builder.arena, NULL, 0);
+	if (!document->root
+		|| !xml__builder_push(&builder, document->root)
+		|| !xml_parse(source, size, &xml__builder_handler, &builder)
+		|| !xml__builder_pop(&builder))
+		goto xml_document_parse_fail;
+
+	free(builder.frame);
+	document->arena = builder.arena;
+	return document;
+
+xml_document_parse_fail:
+	/* The caller keeps ownership of the source on failure. */
+	free(builder.frame);
+	xml__arena_delete(builder.arena);
+	free(document);
+	return NULL;
+}
+
+xml_document_t* xml_document_read(const char* path)
+{
+	size_t size, mapped;
+	char* source = xml_source_map(path, &size, &mapped);
+	if (!source) return NULL;
+
+	xml_document_t* document
+		= xml_document_parse(source, size);
+	if (!document)
+	{
+		munmap(source, mapped);
 		return NULL;
 	}
 
+	document->mapped = mapped;
 	return document;
 }
 
+void xml_document_delete(xml_document_t* document)
+{
+	if (!document)
+		return;
+
+	xml__arena_delete(document->arena);
+
+	if (document->mapped)
+		munmap(document->source, document->mapped);
+	else
+		free(document->source);
+
+	free(document);
+}
+
 
 
 const char* xml_tag_field(xml_tag_t* tag, const char* name)
@@ -376,11 +997,14 @@ const char* xml_tag_field(xml_tag_t* tag, const char* name)
 	if (!tag || !name)
 		return NULL;
 
+	size_t name_size = strlen(name);
+
 	unsigned i;
 	for (i = 0; i < tag->field_count; i++)
 	{
-		if (strcmp(tag->field[i]->name, name) == 0)
-			return tag->field[i]->data;
+		if ((tag->field[i].name_size == name_size)
+			&& (memcmp(tag->field[i].name, name, name_size) == 0))
+			return tag->field[i].data;
 	}
 
 	return NULL;
@@ -0,0 +1,683 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks of the manifest module, linked against every object but main's
+ * and manifest's own. The chunked parser is static and falls back to the
+ * serial one quietly, so it's only reachable by including its source.
+ * Each check reports what it found wrong and carries on, so that one run
+ * shows every failure. */
+
+#include "../src/manifest.c"
+
+
+
+static manifest_t* manifest_check_parse(const char* source)
+{
+	char* copy = strdup(source);
+	if (!copy) return NULL;
+	return manifest_parse_string(copy);
+}
+
+static bool manifest_check_change(
+	const manifest_t* manifest, const unsigned* change,
+	const char* path, unsigned expect)
+{
+	unsigned i;
+	if (!manifest_find_path(manifest, path, &i))
+	{
+		fprintf(stderr, "Error: Project '%s' is missing.\n", path);
+		return false;
+	}
+
+	if (change[i] != expect)
+	{
+		fprintf(stderr, "Error: Project '%s' has changes %#x"
+			" instead of %#x.\n", path, change[i], expect);
+		return false;
+	}
+
+	return true;
+}
+
+/* A project which is only in the old manifest is found by subtracting
+ * the new one from it, the diff itself only covers the new one. */
+static bool manifest_check_diff(void)
+{
+	static const char* old_source =
+		"<manifest>"
+		"<remote name=\"origin\" fetch=\"git://a\"/>"
+		"<remote name=\"mirror\" fetch=\"git://b\"/>"
+		"<default revision=\"master\" remote=\"origin\"/>"
+		"<project path=\"same\" name=\"same\"/>"
+		"<project path=\"revision\" name=\"revision\"/>"
+		"<project path=\"remote\" name=\"remote\"/>"
+		"<project path=\"copyfile\" name=\"copyfile\">"
+		"<copyfile src=\"a\" dest=\"a\"/>"
+		"</project>"
+		"<project path=\"removed\" name=\"removed\"/>"
+		"</manifest>";
+	static const char* new_source =
+		"<manifest>"
+		"<remote name=\"origin\" fetch=\"git://a\"/>"
+		"<remote name=\"mirror\" fetch=\"git://b\"/>"
+		"<default revision=\"master\" remote=\"origin\"/>"
+		"<project path=\"same\" name=\"same\"/>"
+		"<project path=\"revision\" name=\"revision\" revision=\"next\"/>"
+		"<project path=\"remote\" name=\"remote\" remote=\"mirror\"/>"
+		"<project path=\"copyfile\" name=\"copyfile\">"
+		"<copyfile src=\"a\" dest=\"b\"/>"
+		"</project>"
+		"<project path=\"added\" name=\"added\"/>"
+		"</manifest>";
+
+	manifest_t* a = manifest_check_parse(old_source);
+	manifest_t* b = manifest_check_parse(new_source);
+	if (!a || !b)
+	{
+		fprintf(stderr, "Error: Failed to parse diff manifests.\n");
+		manifest_delete(a);
+		manifest_delete(b);
+		return false;
+	}
+
+	unsigned change[b->project_count];
+	bool success = manifest_diff(a, b, change);
+	if (!success)
+		fprintf(stderr, "Error: Failed to diff manifests.\n");
+
+	success = success
+		&& manifest_check_change(b, change, "same", manifest_change_none)
+		&& manifest_check_change(b, change, "revision",
+			manifest_change_revision)
+		&& manifest_check_change(b, change, "remote",
+			manifest_change_remote)
+		&& manifest_check_change(b, change, "copyfile",
+			manifest_change_copyfile)
+		&& manifest_check_change(b, change, "added",
+			manifest_change_added);
+
+	manifest_t* removed = manifest_subtract(a, b);
+	if (!removed || (removed->project_count != 1)
+		|| (strcmp(manifest_project_path(removed, 0), "removed") != 0))
+	{
+		fprintf(stderr, "Error: Subtraction didn't find the removed"
+			" project alone.\n");
+		success = false;
+	}
+
+	manifest_delete(removed);
+	manifest_delete(b);
+	manifest_delete(a);
+	return success;
+}
+
+
+
+static bool manifest_check_string(
+	const char* what, unsigned i, const char* a, const char* b)
+{
+	if ((a == b) || (a && b && (strcmp(a, b) == 0)))
+		return true;
+
+	fprintf(stderr, "Error: %s of project %u is '%s' instead of '%s'.\n",
+		what, i, (b ? b : "(null)"), (a ? a : "(null)"));
+	return false;
+}
+
+/* Compares everything a manifest's accessors return, so that manifests
+ * built in different ways can be checked against each other. */
+static bool manifest_check_same(const manifest_t* a, const manifest_t* b)
+{
+	if ((a->remote_count != b->remote_count)
+		|| (a->project_count != b->project_count))
+	{
+		fprintf(stderr, "Error: Manifest has %u remotes and %u projects"
+			" instead of %u and %u.\n", b->remote_count, b->project_count,
+			a->remote_count, a->project_count);
+		return false;
+	}
+
+	unsigned i, j;
+	for (i = 0; i < a->remote_count; i++)
+	{
+		if (!manifest_check_string("Remote name", i,
+				a->remote[i].name, b->remote[i].name)
+			|| !manifest_check_string("Remote fetch", i,
+				a->remote[i].fetch, b->remote[i].fetch))
+			return false;
+	}
+
+	for (i = 0; i < a->project_count; i++)
+	{
+		project_t pa = manifest_project(a, i);
+		project_t pb = manifest_project(b, i);
+
+		if (!manifest_check_string("Path", i, pa.path, pb.path)
+			|| !manifest_check_string("Name", i, pa.name, pb.name)
+			|| !manifest_check_string("Remote", i, pa.remote, pb.remote)
+			|| !manifest_check_string("Remote name", i,
+				pa.remote_name, pb.remote_name)
+			|| !manifest_check_string("Revision", i,
+				pa.revision, pb.revision))
+			return false;
+
+		if ((pa.priority != pb.priority)
+			|| (pa.copyfile_count != pb.copyfile_count)
+			|| (pa.group_count != pb.group_count))
+		{
+			fprintf(stderr, "Error: Project %u has a different priority,"
+				" copyfile count or group count.\n", i);
+			return false;
+		}
+
+		for (j = 0; j < pa.copyfile_count; j++)
+		{
+			copyfile_t ca = manifest_project_copyfile(a, i, j);
+			copyfile_t cb = manifest_project_copyfile(b, i, j);
+			if (!manifest_check_string("Copyfile source", i,
+					ca.source, cb.source)
+				|| !manifest_check_string("Copyfile dest", i,
+					ca.dest, cb.dest))
+				return false;
+		}
+
+		for (j = 0; j < pa.group_count; j++)
+		{
+			group_t ga = manifest_project_group(a, i, j);
+			group_t gb = manifest_project_group(b, i, j);
+			if ((ga.size != gb.size)
+				|| (memcmp(ga.name, gb.name, ga.size) != 0))
+			{
+				fprintf(stderr, "Error: Group %u of project %u differs.\n",
+					j, i);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+
+#define MANIFEST_CHECK_CHUNKED_SIZE    (4 * MANIFEST__CHUNK_SIZE)
+#define MANIFEST_CHECK_CHUNKED_THREADS 4
+
+typedef struct
+{
+	char*   data;
+	size_t  size;
+	size_t  capacity;
+	size_t* start;
+	size_t* end;
+	size_t  count;
+} manifest_check_source_t;
+
+static bool manifest_check_append(
+	manifest_check_source_t* source, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(&source->data[source->size],
+		(source->capacity - source->size), format, args);
+	va_end(args);
+
+	if ((len < 0) || ((source->size + len) >= source->capacity))
+		return false;
+	source->size += len;
+	return true;
+}
+
+/* Projects vary in their attributes and children and the larger ones
+ * span several lines, the offsets of each are kept so that the check
+ * can tell where the chunk boundaries fall. */
+static bool manifest_check_generate(manifest_check_source_t* source)
+{
+	source->capacity = MANIFEST_CHECK_CHUNKED_SIZE + 4096;
+	source->data  = (char*)malloc(source->capacity);
+	source->start = (size_t*)malloc(
+		(MANIFEST_CHECK_CHUNKED_SIZE / 32) * sizeof(size_t));
+	source->end   = (size_t*)malloc(
+		(MANIFEST_CHECK_CHUNKED_SIZE / 32) * sizeof(size_t));
+	source->size  = 0;
+	source->count = 0;
+	if (!source->data || !source->start || !source->end)
+		return false;
+
+	if (!manifest_check_append(source,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<manifest>\n"
+		"  <remote name=\"origin\" fetch=\"git://a\"/>\n"
+		"  <remote name=\"mirror\" fetch=\"git://b\"/>\n"
+		"  <default revision=\"master\" remote=\"origin\"/>\n"))
+		return false;
+
+	unsigned p;
+	for (p = 0; source->size < MANIFEST_CHECK_CHUNKED_SIZE; p++)
+	{
+		source->start[source->count] = source->size + 2;
+
+		bool success = manifest_check_append(source,
+			"  <project path=\"dir%u/proj_%u\" name=\"group/proj_%u\""
+			" groups=\"g%u,all\"", (p % 97), p, p, (p % 7));
+		if (success && ((p % 5) == 0))
+			success = manifest_check_append(source, " revision=\"r%u\"", p);
+		if (success && ((p % 3) == 0))
+			success = manifest_check_append(source, " remote=\"mirror\"");
+
+		if (success && ((p % 4) == 0))
+		{
+			success = manifest_check_append(source, "/>\n");
+		}
+		else if (success)
+		{
+			success = manifest_check_append(source, ">\n"
+				"    <copyfile src=\"Makefile\" dest=\"build/%u.mk\"/>\n"
+				"    <copyfile src=\"a &amp; b\" dest=\"c%u\"/>\n"
+				"  </project>\n", p, p);
+		}
+		if (!success)
+			return false;
+
+		source->end[source->count++] = source->size - 1;
+	}
+
+	return manifest_check_append(source, "</manifest>\n");
+}
+
+/* Boundaries are placed by the chunked parser at the first project after
+ * each even share of the body, the shares are found here the same way so
+ * that the check fails if no project element straddles one of them. */
+static bool manifest_check_straddle(const manifest_check_source_t* source)
+{
+	size_t body = strstr(source->data, "<manifest>") - source->data + 10;
+	size_t tail = strstr(source->data, "</manifest>") - source->data;
+
+	unsigned count = (tail - body) / MANIFEST__CHUNK_SIZE;
+	if (count > MANIFEST__CHUNK_COUNT)
+		count = MANIFEST__CHUNK_COUNT;
+
+	bool straddle = false;
+	unsigned c;
+	size_t e;
+	for (c = 1; c < count; c++)
+	{
+		size_t from = body + (((tail - body) / count) * c);
+		for (e = 0; e < source->count; e++)
+		{
+			if ((source->start[e] < from) && (from < source->end[e]))
+				straddle = true;
+		}
+	}
+
+	if (!straddle)
+		fprintf(stderr, "Error: No project straddles a chunk boundary.\n");
+	return straddle;
+}
+
+static bool manifest_check_chunked(void)
+{
+	manifest_check_source_t source = { NULL, 0, 0, NULL, NULL, 0 };
+	bool success = manifest_check_generate(&source);
+	if (!success)
+		fprintf(stderr, "Error: Failed to generate chunked manifest.\n");
+
+	success = success && manifest_check_straddle(&source);
+
+	char* serial_source = (success ? strdup(source.data) : NULL);
+	manifest_t* serial = (serial_source
+		? manifest_parse(serial_source, source.size) : NULL);
+	manifest_t* chunked = (success ? manifest__parse_chunked(
+		source.data, source.size, MANIFEST_CHECK_CHUNKED_THREADS,
+		NULL, NULL, NULL) : NULL);
+
+	if (success && !serial)
+	{
+		fprintf(stderr, "Error: Failed to parse manifest serially.\n");
+		success = false;
+	}
+	if (success && !chunked)
+	{
+		fprintf(stderr, "Error: Manifest wasn't parsed in chunks.\n");
+		success = false;
+	}
+
+	success = success && manifest_check_same(serial, chunked);
+
+	manifest_delete(chunked);
+	manifest_delete(serial);
+	free(serial_source);
+	free(source.end);
+	free(source.start);
+	free(source.data);
+	return success;
+}
+
+
+
+static bool manifest_check_cache_file(
+	const char* path, const void* image, size_t size)
+{
+	FILE* fp = fopen(path, "wb");
+	if (!fp) return false;
+	bool success = (fwrite(image, 1, size, fp) == size);
+	return ((fclose(fp) == 0) && success);
+}
+
+static bool manifest_check_cache_rejected(
+	const char* path, uint64_t fingerprint,
+	const void* image, size_t size, const char* damage, size_t offset)
+{
+	if (!manifest_check_cache_file(path, image, size))
+	{
+		fprintf(stderr, "Error: Failed to write damaged cache.\n");
+		return false;
+	}
+
+	manifest_t* manifest = manifest_cache_read(path, fingerprint);
+	if (!manifest)
+		return true;
+
+	fprintf(stderr, "Error: Cache with %s at %zu was accepted.\n",
+		damage, offset);
+	manifest_delete(manifest);
+	return false;
+}
+
+/* Every byte after the header is covered by the checksum, so a change to
+ * any one of them must be caught, as must one to a header field that
+ * keys or sizes the image. */
+static bool manifest_check_cache_damage(
+	const char* path, uint64_t fingerprint, char* image, size_t size)
+{
+	static const size_t field[] =
+	{
+		offsetof(manifest__cache_header_t, magic),
+		offsetof(manifest__cache_header_t, version),
+		offsetof(manifest__cache_header_t, fingerprint),
+		offsetof(manifest__cache_header_t, checksum),
+		offsetof(manifest__cache_header_t, project_count),
+		offsetof(manifest__cache_header_t, string_size),
+		offsetof(manifest__cache_header_t, trie_slots),
+	};
+	unsigned field_count = (sizeof(field) / sizeof(field[0]));
+
+	bool success = true;
+	size_t i;
+	for (i = 0; success && (i < (field_count + size)); i++)
+	{
+		size_t offset = (i < field_count ? field[i]
+			: (sizeof(manifest__cache_header_t) + (i - field_count)));
+		if (offset >= size)
+			break;
+
+		image[offset] ^= 0x01;
+		success = manifest_check_cache_rejected(
+			path, fingerprint, image, size, "a flipped bit", offset);
+		image[offset] ^= 0x01;
+	}
+
+	size_t truncate[] = { 0, sizeof(manifest__cache_header_t), (size - 1) };
+	for (i = 0; success && (i < 3); i++)
+	{
+		success = manifest_check_cache_rejected(path, fingerprint,
+			image, truncate[i], "truncation", truncate[i]);
+	}
+
+	return success;
+}
+
+static bool manifest_check_cache(void)
+{
+	static const char* source =
+		"<manifest>"
+		"<remote name=\"origin\" fetch=\"git://a\"/>"
+		"<remote name=\"mirror\" fetch=\"git://b\"/>"
+		"<default revision=\"master\" remote=\"origin\"/>"
+		"<project path=\"a\" name=\"a\" groups=\"x,y\"/>"
+		"<project path=\"a/b\" name=\"b\" remote=\"mirror\"/>"
+		"<project path=\"c\" name=\"c\" revision=\"next\" groups=\"y\">"
+		"<copyfile src=\"a\" dest=\"b\"/>"
+		"</project>"
+		"</manifest>";
+	uint64_t fingerprint = 0x0123456789ABCDEFULL;
+
+	char path[] = "/tmp/frepo-cache-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Failed to create cache file.\n");
+		return false;
+	}
+	close(fd);
+
+	manifest_t* manifest = manifest_check_parse(source);
+	bool success = manifest
+		&& manifest_cache_write(manifest, path, fingerprint);
+	if (!success)
+		fprintf(stderr, "Error: Failed to write cache.\n");
+
+	manifest_t* cached = (success
+		? manifest_cache_read(path, fingerprint) : NULL);
+	if (success && !cached)
+	{
+		fprintf(stderr, "Error: Failed to read cache back.\n");
+		success = false;
+	}
+	success = success && manifest_check_same(manifest, cached);
+
+	if (success && manifest_cache_read(path, (fingerprint + 1)))
+	{
+		fprintf(stderr, "Error: Cache with another fingerprint"
+			" was accepted.\n");
+		success = false;
+	}
+
+	size_t size = 0;
+	char* image = NULL;
+	FILE* fp = (success ? fopen(path, "rb") : NULL);
+	if (fp)
+	{
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		rewind(fp);
+		image = (char*)malloc(size);
+		if (!image || (fread(image, 1, size, fp) != size))
+		{
+			fprintf(stderr, "Error: Failed to read cache image.\n");
+			success = false;
+		}
+		fclose(fp);
+	}
+
+	success = success && image
+		&& manifest_check_cache_damage(path, fingerprint, image, size);
+
+	free(image);
+	manifest_delete(cached);
+	manifest_delete(manifest);
+	unlink(path);
+	return success;
+}
+
+
+
+/* The chain top, mid and leaf must merge into the same manifest as the
+ * flat one, with every string in the one pool, whether the included
+ * manifests are parsed or loaded from the include cache. */
+static bool manifest_check_include_chain(const char* dir)
+{
+	static const char* flat_source =
+		"<manifest>"
+		"<remote name=\"origin\" fetch=\"git://a\"/>"
+		"<remote name=\"mirror\" fetch=\"git://b\"/>"
+		"<default revision=\"master\" remote=\"origin\"/>"
+		"<project path=\"top\" name=\"top\" groups=\"x\"/>"
+		"<project path=\"mid\" name=\"mid\" remote=\"mirror\""
+		" groups=\"x,y\"/>"
+		"<project path=\"top/leaf\" name=\"leaf\" revision=\"next\">"
+		"<copyfile src=\"Makefile\" dest=\"Makefile\"/>"
+		"</project>"
+		"<project path=\"after\" name=\"after\"/>"
+		"</manifest>";
+
+	char cache_dir[] = "/tmp/frepo-include-XXXXXX";
+	if (!mkdtemp(cache_dir))
+	{
+		fprintf(stderr, "Error: Failed to create include cache.\n");
+		return false;
+	}
+
+	char path[strlen(dir) + 16];
+	sprintf(path, "%s/top.xml", dir);
+
+	manifest_t* flat = manifest_check_parse(flat_source);
+	bool success = (flat != NULL);
+
+	unsigned pass;
+	for (pass = 0; success && (pass < 2); pass++)
+	{
+		manifest_t* manifest = manifest_read_include(path, NULL, cache_dir);
+		if (!manifest)
+		{
+			fprintf(stderr, "Error: Failed to read included manifests"
+				" (pass %u).\n", pass);
+			success = false;
+			break;
+		}
+
+		success = manifest_check_same(flat, manifest);
+		if (success && (manifest->include_count != 2))
+		{
+			fprintf(stderr, "Error: Merged manifest records %u includes"
+				" instead of 2.\n", manifest->include_count);
+			success = false;
+		}
+
+		unsigned i;
+		for (i = 0; success && (i < manifest->project_count); i++)
+		{
+			project_t project = manifest_project(manifest, i);
+			if ((project.path < manifest->string)
+				|| (project.path >= &manifest->string[manifest->string_size])
+				|| (project.revision < manifest->string)
+				|| (project.revision
+					>= &manifest->string[manifest->string_size]))
+			{
+				fprintf(stderr, "Error: Project %u isn't in the merged"
+					" string pool.\n", i);
+				success = false;
+			}
+		}
+
+		manifest_delete(manifest);
+	}
+
+	manifest_delete(flat);
+
+	char command[sizeof(cache_dir) + 16];
+	sprintf(command, "rm -rf %s", cache_dir);
+	if (system(command) != 0)
+		fprintf(stderr, "Warning: Failed to remove '%s'.\n", cache_dir);
+	return success;
+}
+
+/* The cycle comes back to the first manifest by another spelling of its
+ * path, so it's only caught on the first trip by comparing resolved
+ * paths; later trips would repeat the spellings and name cycle_back.xml
+ * instead. It must fail with one error rather than one per trip. */
+static bool manifest_check_include_cycle(const char* dir)
+{
+	char path[strlen(dir) + 16];
+	sprintf(path, "%s/cycle.xml", dir);
+
+	FILE* log = tmpfile();
+	int saved = dup(STDERR_FILENO);
+	if (!log || (saved < 0))
+	{
+		fprintf(stderr, "Error: Failed to capture errors.\n");
+		if (log) fclose(log);
+		return false;
+	}
+
+	fflush(stderr);
+	dup2(fileno(log), STDERR_FILENO);
+	manifest_t* manifest = manifest_read_include(path, NULL, NULL);
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	char text[4096];
+	rewind(log);
+	size_t size = fread(text, 1, (sizeof(text) - 1), log);
+	text[size] = '\0';
+	fclose(log);
+
+	bool success = true;
+	if (manifest)
+	{
+		fprintf(stderr, "Error: Include cycle was accepted.\n");
+		manifest_delete(manifest);
+		success = false;
+	}
+
+	unsigned count = 0;
+	const char* error;
+	for (error = strstr(text, "includes itself"); error;
+		error = strstr(&error[1], "includes itself"))
+		count++;
+
+	if ((count != 1) || !strstr(text, "/cycle.xml' includes itself"))
+	{
+		fprintf(stderr, "Error: Include cycle wasn't reported once"
+			" at cycle.xml:\n%s", text);
+		success = false;
+	}
+
+	return success;
+}
+
+
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s fixture-dir\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bool success = true;
+
+	if (!manifest_check_diff())
+		success = false;
+	if (!manifest_check_chunked())
+		success = false;
+	if (!manifest_check_cache())
+		success = false;
+	if (!manifest_check_include_chain(argv[1]))
+		success = false;
+	if (!manifest_check_include_cycle(argv[1]))
+		success = false;
+
+	if (!success)
+		return EXIT_FAILURE;
+
+	printf("manifest: ok\n");
+	return EXIT_SUCCESS;
+}
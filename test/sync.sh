@@ -0,0 +1,104 @@
+#!/bin/sh
+# Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+#
+# This file is part of frepo.
+#
+# frepo is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# frepo is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+
+# Syncs a scratch workspace against local repositories and checks the
+# projects on disk and the stored state after each step.
+# Usage: test/sync.sh path/to/frepo
+
+set -e
+
+FREPO=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+export GIT_AUTHOR_NAME=frepo GIT_AUTHOR_EMAIL=frepo@localhost
+export GIT_COMMITTER_NAME=frepo GIT_COMMITTER_EMAIL=frepo@localhost
+export GIT_CONFIG_NOSYSTEM=1 HOME="$TMP"
+
+fail()
+{
+	echo "Error: $*" >&2
+	exit 1
+}
+
+REMOTE="$TMP/remote"
+for p in vendor lib other d; do
+	git init -q -b master "$REMOTE/$p"
+	(cd "$REMOTE/$p" && echo "$p" > f && git add f && git commit -qm init)
+done
+
+manifest()
+{
+	{
+		echo '<?xml version="1.0" encoding="UTF-8"?>'
+		echo '<manifest>'
+		echo "  <remote name=\"origin\" fetch=\"$REMOTE\"/>"
+		echo '  <default revision="master" remote="origin"/>'
+		for p in "$@"; do
+			echo "  <project path=\"${p%%:*}\" name=\"${p##*:}\"/>"
+		done
+		echo '</manifest>'
+	} > "$REMOTE/manifest/default.xml"
+	(cd "$REMOTE/manifest" && git add default.xml && git commit -qm update)
+}
+
+git init -q -b master "$REMOTE/manifest"
+manifest vendor:vendor vendor/lib:lib other:other
+
+cd "$TMP"
+"$FREPO" init ws -u "$REMOTE/manifest" > /dev/null || fail "init failed"
+cd ws
+[ -f vendor/lib/f ] || fail "init didn't clone vendor/lib"
+
+# A manifest pulled by hand is synced as it is by sync -n, so projects it
+# adds are cloned and those it drops are removed.
+manifest vendor:vendor other:other d:d
+git -C manifest pull -q
+"$FREPO" sync -n -f > /dev/null || fail "sync -n after a manual pull failed"
+[ -f d/f ] || fail "sync -n didn't clone a project added by hand"
+[ ! -e vendor/lib/f ] || fail "sync -n didn't remove a project dropped by hand"
+grep -q 'path="d"' .frepo/manifest.xml \
+	|| fail "stored state is missing d"
+! grep -q 'path="vendor/lib"' .frepo/manifest.xml \
+	|| fail "stored state still lists vendor/lib"
+
+# A second sync finds nothing to do.
+"$FREPO" sync -n > /dev/null || fail "repeated sync -n failed"
+
+# A damaged or truncated manifest cache is rejected, the stored manifest
+# is parsed instead and the cache is written again.
+"$FREPO" list > "$TMP/list" || fail "list failed"
+[ -s .frepo/manifest.cache ] || fail "list didn't write the manifest cache"
+cp .frepo/manifest.cache "$TMP/cache"
+size=$(wc -c < .frepo/manifest.cache)
+byte=X
+[ "$(dd if="$TMP/cache" bs=1 skip=$((size / 2)) count=1 2> /dev/null)" \
+	!= X ] || byte=Y
+printf '%s' "$byte" | dd of=.frepo/manifest.cache bs=1 seek=$((size / 2)) \
+	conv=notrunc 2> /dev/null
+"$FREPO" list | cmp -s - "$TMP/list" \
+	|| fail "list differs with a damaged cache"
+cmp -s .frepo/manifest.cache "$TMP/cache" \
+	|| fail "damaged cache wasn't rewritten"
+head -c $((size - 1)) "$TMP/cache" > .frepo/manifest.cache
+"$FREPO" list | cmp -s - "$TMP/list" \
+	|| fail "list differs with a truncated cache"
+cmp -s .frepo/manifest.cache "$TMP/cache" \
+	|| fail "truncated cache wasn't rewritten"
+
+echo "sync: ok"
@@ -0,0 +1,517 @@
+/* Copyright (c) 2013-14 Codethink Ltd. (http://www.codethink.co.uk)
+ *
+ * This file is part of frepo.
+ *
+ * frepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * frepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with frepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Differential test of the xml scanners. It's built once as normal and
+ * once with -DXML_SCAN_SCALAR, and both builds must print the same
+ * transcript of scan results and parse events. The vector build also
+ * checks each vector scanner against the scalar one directly, so that a
+ * mismatch is reported where it happens. The parser's statics are only
+ * reachable by including its source. */
+
+#include "../src/xml.c"
+
+#include <stdio.h>
+
+
+
+#define XML_SCAN_ALIGN  64
+#define XML_SCAN_LENGTH 80
+#define XML_SCAN_RANDOM 4096
+#define XML_SCAN_SIZE   16384
+
+typedef const char* (*xml_scan_func_t)(const char* source);
+
+typedef struct
+{
+	const char*     name;
+	char            run;
+	xml_scan_func_t scalar;
+	xml_scan_func_t dispatch;
+	xml_scan_func_t sse2;
+	xml_scan_func_t avx2;
+} xml_scan_kind_t;
+
+static char xml_scan_buffer[XML_SCAN_SIZE + XML_SCAN_ALIGN]
+	__attribute__((aligned(XML_SCAN_ALIGN)));
+
+static uint64_t xml_scan_seed = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t xml_scan_random(void)
+{
+	xml_scan_seed ^= (xml_scan_seed << 13);
+	xml_scan_seed ^= (xml_scan_seed >> 7);
+	xml_scan_seed ^= (xml_scan_seed << 17);
+	return xml_scan_seed;
+}
+
+static uint64_t xml_scan_mix(uint64_t sum, uint64_t value)
+{
+	return ((sum ^ value) * 0x100000001B3ULL);
+}
+
+static bool xml_scan_compare(
+	const xml_scan_kind_t* kind, const char* impl,
+	xml_scan_func_t func, const char* source, const char* expect)
+{
+	if (!func)
+		return true;
+
+	const char* result = func(source);
+	if (result == expect)
+		return true;
+
+	fprintf(stderr, "Error: %s %s scanner stopped at %td instead of %td"
+		" (source alignment %u).\n", impl, kind->name,
+		(result - source), (expect - source),
+		(unsigned)((uintptr_t)source % XML_SCAN_ALIGN));
+	return false;
+}
+
+static bool xml_scan_check(
+	const xml_scan_kind_t* kind, const char* source, uint64_t* sum)
+{
+	const char* expect = kind->scalar(source);
+	*sum = xml_scan_mix(*sum, (uint64_t)(kind->dispatch(source) - source));
+
+	return xml_scan_compare(kind, "dispatched", kind->dispatch, source, expect)
+		&& xml_scan_compare(kind, "SSE2", kind->sse2, source, expect)
+		&& xml_scan_compare(kind, "AVX2", kind->avx2, source, expect);
+}
+
+/* Every byte value is placed after runs of every length at every
+ * alignment, the bytes before the source are set to the same value so
+ * that any which aren't shifted out would stop the scan early. Only the
+ * first mismatch of each scanner is reported. */
+static bool xml_scan_edges(const xml_scan_kind_t* kind)
+{
+	uint64_t sum = 0;
+	bool success = true;
+
+	unsigned align, length, value;
+	for (value = 0; success && (value < 256); value++)
+	{
+		for (align = 0; success && (align < XML_SCAN_ALIGN); align++)
+		{
+			for (length = 0; success && (length < XML_SCAN_LENGTH);
+				length++)
+			{
+				char* source = &xml_scan_buffer[align];
+				memset(xml_scan_buffer, value, align);
+				memset(source, kind->run, (XML_SCAN_LENGTH * 2));
+				source[length] = (char)value;
+				source[XML_SCAN_LENGTH * 2] = '\0';
+
+				success = xml_scan_check(kind, source, &sum);
+			}
+		}
+	}
+
+	printf("scan %s edges %016llx\n", kind->name, (unsigned long long)sum);
+	return success;
+}
+
+/* Random bytes, mostly from the run the scanner skips, with a terminator
+ * now and then, scanned from every position. */
+static bool xml_scan_randomized(const xml_scan_kind_t* kind)
+{
+	static const char pick[] = " \t\r\n-\"azAZ09_<>=/&!";
+
+	uint64_t sum = 0;
+	bool success = true;
+
+	unsigned round, i;
+	for (round = 0; success && (round < 16); round++)
+	{
+		for (i = 0; i < XML_SCAN_RANDOM; i++)
+		{
+			uint64_t r = xml_scan_random();
+			switch (r & 7)
+			{
+				case 0:
+					xml_scan_buffer[i] = (char)(r >> 8);
+					break;
+				case 1:
+					xml_scan_buffer[i] = pick[(r >> 8) % (sizeof(pick) - 1)];
+					break;
+				default:
+					xml_scan_buffer[i] = kind->run;
+					break;
+			}
+			if (((r >> 32) & 255) == 0)
+				xml_scan_buffer[i] = '\0';
+		}
+		xml_scan_buffer[XML_SCAN_RANDOM] = '\0';
+
+		for (i = 0; success && (i < XML_SCAN_RANDOM); i++)
+			success = xml_scan_check(kind, &xml_scan_buffer[i], &sum);
+	}
+
+	printf("scan %s random %016llx\n", kind->name, (unsigned long long)sum);
+	return success;
+}
+
+
+
+/* Parse events are written to a transcript, which has to be the same
+ * wherever the document sits relative to a vector boundary. */
+
+typedef struct
+{
+	char*  data;
+	size_t size;
+	FILE*  stream;
+} xml_scan_transcript_t;
+
+static bool xml_scan_tag_open(void* context,
+	const char* name, unsigned name_size,
+	xml_field_t* field, unsigned field_count)
+{
+	FILE* stream = ((xml_scan_transcript_t*)context)->stream;
+	fprintf(stream, "  open '%.*s'", (int)name_size, name);
+
+	unsigned i;
+	for (i = 0; i < field_count; i++)
+	{
+		fprintf(stream, " '%.*s'='%.*s'",
+			(int)field[i].name_size, field[i].name,
+			(int)field[i].data_size, field[i].data);
+	}
+	fprintf(stream, "\n");
+	return true;
+}
+
+static bool xml_scan_tag_close(void* context,
+	const char* name, unsigned name_size)
+{
+	FILE* stream = ((xml_scan_transcript_t*)context)->stream;
+	fprintf(stream, "  close '%.*s'\n", (int)name_size, name);
+	return true;
+}
+
+static const xml_handler_t xml_scan_handler =
+{
+	xml_scan_tag_open,
+	xml_scan_tag_close,
+};
+
+static bool xml_scan_parse_at(
+	const char* document, size_t size, bool fragment, unsigned align,
+	xml_scan_transcript_t* transcript)
+{
+	char* source = &xml_scan_buffer[align];
+	memcpy(source, document, size);
+	source[size] = '\0';
+
+	transcript->data = NULL;
+	transcript->size = 0;
+	transcript->stream = open_memstream(
+		&transcript->data, &transcript->size);
+	if (!transcript->stream)
+		return false;
+
+	bool success = (fragment
+		? xml_parse_fragment(source, size, &xml_scan_handler, transcript)
+		: xml_parse(source, size, &xml_scan_handler, transcript));
+	fprintf(transcript->stream, "  %s\n", (success ? "ok" : "failed"));
+	fclose(transcript->stream);
+	return true;
+}
+
+static bool xml_scan_parse(
+	const char* name, const char* document, size_t size)
+{
+	if (size + XML_SCAN_ALIGN >= XML_SCAN_SIZE)
+		return false;
+
+	unsigned pass;
+	for (pass = 0; pass < 2; pass++)
+	{
+		bool fragment = (pass > 0);
+
+		xml_scan_transcript_t first;
+		if (!xml_scan_parse_at(document, size, fragment, 0, &first))
+			return false;
+
+		bool success = true;
+		unsigned align;
+		for (align = 1; success && (align < XML_SCAN_ALIGN); align++)
+		{
+			xml_scan_transcript_t other;
+			if (!xml_scan_parse_at(document, size, fragment, align, &other))
+			{
+				free(first.data);
+				return false;
+			}
+
+			if ((other.size != first.size)
+				|| (memcmp(other.data, first.data, first.size) != 0))
+			{
+				fprintf(stderr, "Error: Parse of %s differs"
+					" at alignment %u.\n", name, align);
+				success = false;
+			}
+			free(other.data);
+		}
+
+		printf("parse %s%s\n%s", name,
+			(fragment ? " fragment" : ""), first.data);
+		free(first.data);
+
+		if (!success)
+			return false;
+	}
+
+	return true;
+}
+
+static const char* xml_scan_documents[] =
+{
+	"<a/>",
+	"<a></a>",
+	"  \t\r\n<a/>\n",
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<a/>",
+	"<a><b/><c></c></a>",
+	"<a b=\"\" c-d=\"e\"/>",
+	"<a b=\"&amp;&lt;&gt;&quot;&apos;&#65;&#x42;&#x20AC;\"/>",
+	"<a b=\"&unknown;\"/>",
+	"<a b=\"&#xZZ;\"/>",
+	"<!-- comment --><a/><!---->",
+	"<!-- - -- --- ---><a/>",
+	"<a><!-- - --></a>",
+	"<!-- unterminated <a/>",
+	"<a b=\"unterminated/>",
+	"<a b='single'/>",
+	"<a b=\"c\"d=\"e\"/>",
+	"<a\x80/>",
+	"<a b\x80=\"c\"/>",
+	"<1a/>",
+	"<a></b>",
+	"<a>",
+	"</a>",
+	"<a/>trailing",
+	"",
+	"   ",
+};
+
+/* Names, values, whitespace and comments whose lengths cross the vector
+ * widths, so that every scanner meets runs ending on either side of a
+ * block boundary. */
+static bool xml_scan_lengths(void)
+{
+	bool success = true;
+
+	unsigned length;
+	for (length = 1; length <= XML_SCAN_LENGTH; length++)
+	{
+		char document[(XML_SCAN_LENGTH * 4) + 64];
+		char run[XML_SCAN_LENGTH + 1];
+		char name[64];
+		int size;
+
+		memset(run, 'n', length);
+		run[length] = '\0';
+		snprintf(name, sizeof(name), "name %u", length);
+		size = snprintf(document, sizeof(document),
+			"<%s %s=\"v\"></%s>", run, run, run);
+		success = xml_scan_parse(name, document, size) && success;
+
+		memset(run, '-', length);
+		run[0] = 'f';
+		snprintf(name, sizeof(name), "field %u", length);
+		size = snprintf(document, sizeof(document),
+			"<a %s=\"v\"/>", run);
+		success = xml_scan_parse(name, document, size) && success;
+
+		memset(run, 'v', length);
+		snprintf(name, sizeof(name), "value %u", length);
+		size = snprintf(document, sizeof(document),
+			"<a b=\"%s\" c=\"%s-\"/>", run, run);
+		success = xml_scan_parse(name, document, size) && success;
+
+		unsigned i;
+		for (i = 0; i < length; i++)
+			run[i] = " \t\r\n"[i & 3];
+		snprintf(name, sizeof(name), "space %u", length);
+		size = snprintf(document, sizeof(document),
+			"%s<a%sb=\"c\"%s/>%s", run, run, run, run);
+		success = xml_scan_parse(name, document, size) && success;
+
+		for (i = 0; i < length; i++)
+			run[i] = ((i % 3) == 2 ? '-' : 'c');
+		snprintf(name, sizeof(name), "comment %u", length);
+		size = snprintf(document, sizeof(document),
+			"<!--%s--><a><!--%s --></a>", run, run);
+		success = xml_scan_parse(name, document, size) && success;
+	}
+
+	return success;
+}
+
+static unsigned xml_scan_append(char* document, unsigned size,
+	const char* piece)
+{
+	size_t length = strlen(piece);
+	memcpy(&document[size], piece, length);
+	return (size + length);
+}
+
+static unsigned xml_scan_word(char* document, unsigned size,
+	const char* alphabet)
+{
+	unsigned length = (xml_scan_random() % 40);
+	unsigned count = strlen(alphabet);
+	unsigned i;
+	for (i = 0; i < length; i++)
+		document[size++] = alphabet[xml_scan_random() % count];
+	return size;
+}
+
+/* Random documents are mostly well formed, with a damaged byte now and
+ * then so that the failure paths are compared too. */
+static unsigned xml_scan_tag(char* document, unsigned size, unsigned depth)
+{
+	static const char* space[] = { "", " ", "\n  ", "\t", " \r\n " };
+	static const char* value[] = { "", "&amp;", "&#65;", "-", "x" };
+
+	if ((xml_scan_random() % 4) == 0)
+	{
+		size = xml_scan_append(document, size, "<!--");
+		size = xml_scan_word(document, size, "c- ");
+		size = xml_scan_append(document, size, "-->");
+	}
+
+	char name[48];
+	unsigned name_size = xml_scan_word(name, 0, "abcXYZ09_");
+	name[0] = 'a';
+	name[(name_size ? name_size : 1)] = '\0';
+
+	size = xml_scan_append(document, size, "<");
+	size = xml_scan_append(document, size, name);
+
+	unsigned fields = (xml_scan_random() % 4);
+	unsigned i;
+	for (i = 0; i < fields; i++)
+	{
+		size = xml_scan_append(document, size, " f");
+		size = xml_scan_word(document, size, "ab-_9");
+		size = xml_scan_append(document, size, "=\"");
+		size = xml_scan_word(document, size, "vw -");
+		size = xml_scan_append(document, size,
+			value[xml_scan_random() % 5]);
+		size = xml_scan_append(document, size, "\"");
+	}
+	size = xml_scan_append(document, size, space[xml_scan_random() % 5]);
+
+	unsigned children = (depth < 2 ? (xml_scan_random() % 4) : 0);
+	if (children == 0)
+		return xml_scan_append(document, size, "/>");
+
+	size = xml_scan_append(document, size, ">");
+	for (i = 0; i < children; i++)
+	{
+		size = xml_scan_append(document, size, space[xml_scan_random() % 5]);
+		size = xml_scan_tag(document, size, (depth + 1));
+	}
+	size = xml_scan_append(document, size, "</");
+	size = xml_scan_append(document, size, name);
+	return xml_scan_append(document, size, ">");
+}
+
+static bool xml_scan_documents_random(void)
+{
+	bool success = true;
+
+	unsigned i;
+	for (i = 0; i < 256; i++)
+	{
+		char document[XML_SCAN_SIZE];
+		unsigned size = xml_scan_tag(document, 0, 0);
+		if ((i % 4) == 3)
+			document[xml_scan_random() % size] = (char)xml_scan_random();
+
+		char name[32];
+		snprintf(name, sizeof(name), "random %u", i);
+		success = xml_scan_parse(name, document, size) && success;
+	}
+
+	return success;
+}
+
+
+
+int main(void)
+{
+	pthread_once(&xml__scan_once, xml__scan_init);
+
+	xml_scan_kind_t kind[] =
+	{
+		{ "space", ' ',
+			xml__scan_space_scalar, xml__scan.space, NULL, NULL },
+		{ "quote", 'a',
+			xml__scan_quote_scalar, xml__scan.quote, NULL, NULL },
+		{ "dash", 'a',
+			xml__scan_dash_scalar, xml__scan.dash, NULL, NULL },
+		{ "name", 'a',
+			xml__scan_name_scalar, xml__scan.name, NULL, NULL },
+		{ "field_name", 'a',
+			xml__scan_field_name_scalar, xml__scan.field_name, NULL, NULL },
+	};
+	unsigned kind_count = (sizeof(kind) / sizeof(kind[0]));
+
+#ifdef XML_SCAN_X86
+	if (__builtin_cpu_supports("sse2"))
+	{
+		kind[0].sse2 = xml__scan_space_sse2;
+		kind[1].sse2 = xml__scan_quote_sse2;
+		kind[2].sse2 = xml__scan_dash_sse2;
+		kind[3].sse2 = xml__scan_name_sse2;
+		kind[4].sse2 = xml__scan_field_name_sse2;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		kind[0].avx2 = xml__scan_space_avx2;
+		kind[1].avx2 = xml__scan_quote_avx2;
+		kind[2].avx2 = xml__scan_dash_avx2;
+		kind[3].avx2 = xml__scan_name_avx2;
+		kind[4].avx2 = xml__scan_field_name_avx2;
+	}
+#endif
+
+	bool success = true;
+
+	unsigned k;
+	for (k = 0; k < kind_count; k++)
+	{
+		success = xml_scan_edges(&kind[k]) && success;
+		success = xml_scan_randomized(&kind[k]) && success;
+	}
+
+	unsigned d;
+	for (d = 0; d < (sizeof(xml_scan_documents) / sizeof(char*)); d++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "document %u", d);
+		success = xml_scan_parse(name, xml_scan_documents[d],
+			strlen(xml_scan_documents[d])) && success;
+	}
+
+	success = xml_scan_lengths() && success;
+	success = xml_scan_documents_random() && success;
+
+	return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}